@@ -0,0 +1,116 @@
+#include "corpus.hpp"
+#include <array>
+#include <cstdint>
+#include <fmt/format.h>
+#include <fstream>
+
+// MPEG-1 Layer III bitrates in kbit/s, indexed by the header field.
+static constexpr std::array<unsigned int, 15> bitrates = {
+    0, 32, 40, 48, 56, 64, 80, 96, 112, 128, 160, 192, 224, 256, 320};
+
+static constexpr unsigned int samples_per_frame = 1152;
+
+struct StreamSpec {
+  const char *label;
+  unsigned int rate;
+  bool stereo;
+  bool vbr;
+  int bitrate_index;
+};
+
+static unsigned char rate_bits(unsigned int rate) {
+  switch (rate) {
+  case 48000:
+    return 1;
+  case 32000:
+    return 2;
+  default:
+    return 0;
+  }
+}
+
+static void write_stream(const std::filesystem::path &path,
+                         const StreamSpec &spec, unsigned int seconds) {
+  std::ofstream out(path, std::ios::binary | std::ios::trunc);
+
+  const uint64_t frames = (uint64_t)spec.rate * seconds / samples_per_frame;
+
+  // Deterministic bitrate walk for the VBR streams.
+  uint32_t lcg = 12345;
+  uint64_t slot_rest = 0;
+  std::vector<char> frame;
+
+  for (uint64_t i = 0; i < frames; i++) {
+    int index = spec.bitrate_index;
+    if (spec.vbr) {
+      lcg = lcg * 1103515245 + 12345;
+      index = 5 + (lcg >> 16) % 10;
+    }
+
+    // Padding slots keep the average frame length exact at 44.1 kHz.
+    const uint64_t numerator = 144ull * bitrates[index] * 1000;
+    const size_t length = numerator / spec.rate;
+    slot_rest += numerator % spec.rate;
+    int padding = 0;
+    if (slot_rest >= spec.rate) {
+      slot_rest -= spec.rate;
+      padding = 1;
+    }
+
+    // Everything after the header stays zero: empty side info means no main
+    // data, so mpg123 skips Huffman decoding and dequantization and every
+    // granule decodes to silence. See generate_corpus().
+    frame.assign(length + padding, 0);
+    frame[0] = (char)0xff;
+    frame[1] = (char)0xfb; // MPEG-1, Layer III, no CRC
+    frame[2] = (char)(index << 4 | rate_bits(spec.rate) << 2 | padding << 1);
+    frame[3] = (char)(spec.stereo ? 0x00 : 0xc0);
+
+    out.write(frame.data(), frame.size());
+  }
+}
+
+std::vector<CorpusFile> generate_corpus(const std::filesystem::path &dir,
+                                        unsigned int seconds) {
+  static constexpr std::array<StreamSpec, 6> specs = {{
+      {"cbr128_44k_stereo", 44100, true, false, 9},
+      {"cbr320_48k_stereo", 48000, true, false, 14},
+      {"cbr64_44k_mono", 44100, false, false, 5},
+      {"vbr_44k_stereo", 44100, true, true, 0},
+      {"vbr_48k_stereo", 48000, true, true, 0},
+      {"vbr_48k_mono", 48000, false, true, 0},
+  }};
+
+  std::filesystem::create_directories(dir);
+
+  std::vector<CorpusFile> files;
+  for (const StreamSpec &spec : specs) {
+    std::filesystem::path path = dir / fmt::format("{}.mp3", spec.label);
+    write_stream(path, spec, seconds);
+    files.push_back(
+        {path, fmt::format("{} (synthetic, header parse only)", spec.label),
+         true});
+  }
+
+  return files;
+}
+
+void print_synthetic_notice() {
+  fmt::print("Synthetic corpus: frames carry no audio data, so decoding is\n"
+             "header parsing only and far faster than real MP3s. Do not use\n"
+             "these numbers for buffer sizing or regressions, pass a\n"
+             "directory of real MP3s instead.\n\n");
+}
+
+std::vector<CorpusFile> load_corpus(const std::filesystem::path &dir) {
+  std::vector<CorpusFile> files;
+
+  for (const auto &entry :
+       std::filesystem::recursive_directory_iterator(dir)) {
+    if (entry.is_regular_file() && entry.path().extension() == ".mp3") {
+      files.push_back({entry.path(), entry.path().filename().string()});
+    }
+  }
+
+  return files;
+}
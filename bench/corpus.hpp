@@ -0,0 +1,26 @@
+#pragma once
+#include <filesystem>
+#include <string>
+#include <vector>
+
+struct CorpusFile {
+  std::filesystem::path path;
+  std::string label;
+  // Generated stream whose timings do not reflect real decoding.
+  bool synthetic = false;
+};
+
+// Writes a set of synthetic MPEG-1 Layer III streams into `dir`: CBR and VBR,
+// mono and stereo, 44.1 and 48 kHz, each `seconds` long. The frames have
+// empty side info and no main data, so the decoder parses headers and skips
+// Huffman decoding and dequantization: results over this corpus are far
+// above real MP3 decoding and only good for a smoke run. Pass a directory of
+// real MP3s to the benches for numbers that mean something.
+std::vector<CorpusFile> generate_corpus(const std::filesystem::path &dir,
+                                        unsigned int seconds);
+
+// Tells that the results below come from the synthetic corpus.
+void print_synthetic_notice();
+
+// Collects every .mp3 below `dir`.
+std::vector<CorpusFile> load_corpus(const std::filesystem::path &dir);
@@ -0,0 +1,168 @@
+#include "../src/decoder.hpp"
+#include "corpus.hpp"
+#include <algorithm>
+#include <array>
+#include <chrono>
+#include <cstdint>
+#include <filesystem>
+#include <fmt/format.h>
+#include <memory>
+#include <random>
+#include <vector>
+
+// Decoder throughput, open and seek latency over an MP3 corpus.
+//
+//   musicplayer_bench [corpus_dir]
+//
+// Pass a directory of real MP3s. Without one a synthetic corpus is generated
+// in the temp dir; it only exercises header parsing, see generate_corpus().
+
+using bench_clock = std::chrono::steady_clock;
+
+static constexpr unsigned int corpus_seconds = 120;
+static constexpr int open_rounds = 20;
+static constexpr int seek_rounds = 200;
+static constexpr std::array<int, 4> buffer_sizes = {4096, 16384, 65536,
+                                                    262144};
+
+static double elapsed_us(bench_clock::time_point since) {
+  return std::chrono::duration<double, std::micro>(bench_clock::now() - since)
+      .count();
+}
+
+static double percentile(std::vector<double> v, double p) {
+  if (v.empty()) {
+    return 0;
+  }
+  std::sort(v.begin(), v.end());
+  return v[std::min(v.size() - 1, (size_t)(p * v.size()))];
+}
+
+static bool open_file(Decoder &dec, const std::filesystem::path &path,
+                      Audio::FormatInfo &afi) {
+  if (dec.open(path) != DecoderRetCode::OpenRes::Success)
+    return false;
+  if (dec.get_format(afi) != DecoderRetCode::GetFmtRes::Success)
+    return false;
+  if (dec.set_format(afi) != DecoderRetCode::SetFmtRes::Success)
+    return false;
+  return true;
+}
+
+static void bench_open(const CorpusFile &file) {
+  std::vector<double> samples;
+  Audio::FormatInfo afi;
+
+  for (int i = 0; i < open_rounds; i++) {
+    std::unique_ptr<Decoder> dec = DecoderFactory::create(Enum::FileType::MP3);
+
+    auto start = bench_clock::now();
+    if (!open_file(*dec, file.path, afi)) {
+      fmt::print("  open: failed\n");
+      return;
+    }
+    samples.push_back(elapsed_us(start));
+    dec->close();
+  }
+
+  fmt::print("  open: p50 {:.1f} us, p90 {:.1f} us\n",
+             percentile(samples, 0.5), percentile(samples, 0.9));
+}
+
+static void bench_read(const CorpusFile &file, int bufsize) {
+  std::unique_ptr<Decoder> dec = DecoderFactory::create(Enum::FileType::MP3);
+  Audio::FormatInfo afi;
+  if (!open_file(*dec, file.path, afi)) {
+    fmt::print("  read {:>7}: open failed\n", bufsize);
+    return;
+  }
+
+  std::vector<char> buf(bufsize);
+  uint64_t bytes = 0;
+  size_t done = 0;
+
+  auto start = bench_clock::now();
+  while (dec->read(buf.data(), bufsize, done) ==
+         DecoderRetCode::ReadRes::Success) {
+    bytes += done;
+  }
+  bytes += done;
+  const double wall_s = elapsed_us(start) / 1e6;
+  dec->close();
+
+  const double audio_s = (double)bytes / afi.frame_size / afi.rate;
+  fmt::print("  read {:>7}: {:8.1f} MB/s PCM, {:7.1f}x realtime{}\n",
+             bufsize, bytes / wall_s / 1e6, audio_s / wall_s,
+             file.synthetic ? " (header parse only)" : "");
+}
+
+static void bench_seek(const CorpusFile &file) {
+  std::unique_ptr<Decoder> dec = DecoderFactory::create(Enum::FileType::MP3);
+  Audio::FormatInfo afi;
+  if (!open_file(*dec, file.path, afi)) {
+    fmt::print("  seek: open failed\n");
+    return;
+  }
+
+  const int64_t length = dec->length_frames();
+  if (length <= 0) {
+    fmt::print("  seek: unknown length\n");
+    return;
+  }
+
+  std::mt19937 rng(42);
+  std::uniform_int_distribution<int64_t> dist(0, length - 1);
+  std::vector<double> samples;
+  std::vector<char> buf(4096);
+  size_t done;
+
+  for (int i = 0; i < seek_rounds; i++) {
+    auto start = bench_clock::now();
+    if (dec->seek_frame(dist(rng)) != DecoderRetCode::SeekRes::Success) {
+      fmt::print("  seek: failed\n");
+      return;
+    }
+    // A seek only counts once PCM from the new position is available.
+    dec->read(buf.data(), buf.size(), done);
+    samples.push_back(elapsed_us(start));
+  }
+  dec->close();
+
+  fmt::print("  seek: p50 {:.1f} us, p90 {:.1f} us, max {:.1f} us\n",
+             percentile(samples, 0.5), percentile(samples, 0.9),
+             percentile(samples, 1.0));
+}
+
+int main(int argc, char **argv) {
+  std::vector<CorpusFile> corpus;
+  std::filesystem::path generated;
+
+  if (argc > 1) {
+    corpus = load_corpus(argv[1]);
+  } else {
+    generated =
+        std::filesystem::temp_directory_path() / "musicplayer_bench_corpus";
+    corpus = generate_corpus(generated, corpus_seconds);
+    print_synthetic_notice();
+  }
+
+  if (corpus.empty()) {
+    fmt::print("No MP3 files found\n");
+    return 1;
+  }
+
+  for (const CorpusFile &file : corpus) {
+    fmt::print("{}\n", file.label);
+    bench_open(file);
+    for (int bufsize : buffer_sizes) {
+      bench_read(file, bufsize);
+    }
+    bench_seek(file);
+  }
+
+  if (!generated.empty()) {
+    std::filesystem::remove_all(generated);
+  }
+
+  return 0;
+}
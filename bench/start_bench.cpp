@@ -0,0 +1,128 @@
+#include "../src/player.hpp"
+#include "corpus.hpp"
+#include <algorithm>
+#include <chrono>
+#include <filesystem>
+#include <fmt/format.h>
+#include <thread>
+#include <vector>
+
+// Time to first audio: Player::load() up to the first write to the output,
+// measured with the null output so no sound card is needed.
+//
+//   musicplayer_start_bench [corpus_dir]
+//
+// Pass a directory of real MP3s. Without one a synthetic corpus is generated
+// in the temp dir; it only exercises header parsing, see generate_corpus().
+
+static constexpr unsigned int corpus_seconds = 30;
+static constexpr int start_rounds = 30;
+
+static int64_t percentile(std::vector<int64_t> v, double p) {
+  if (v.empty()) {
+    return 0;
+  }
+  std::sort(v.begin(), v.end());
+  return v[std::min(v.size() - 1, (size_t)(p * v.size()))];
+}
+
+static void report(const char *name, const std::vector<int64_t> &samples) {
+  fmt::print("  {:<14} p50 {:>7} us, p90 {:>7} us\n", name,
+             percentile(samples, 0.5), percentile(samples, 0.9));
+}
+
+static bool wait_first_write(Player &p, StartTiming &timing) {
+  auto deadline =
+      std::chrono::steady_clock::now() + std::chrono::milliseconds(2000);
+
+  while (std::chrono::steady_clock::now() < deadline) {
+    timing = p.get_start_timing();
+    if (timing.first_write_us >= 0) {
+      return true;
+    }
+    std::this_thread::sleep_for(std::chrono::microseconds(100));
+  }
+
+  return false;
+}
+
+int main(int argc, char **argv) {
+  std::vector<CorpusFile> corpus;
+  std::filesystem::path generated;
+
+  if (argc > 1) {
+    corpus = load_corpus(argv[1]);
+  } else {
+    generated =
+        std::filesystem::temp_directory_path() / "musicplayer_start_corpus";
+    corpus = generate_corpus(generated, corpus_seconds);
+    print_synthetic_notice();
+  }
+
+  if (corpus.empty()) {
+    fmt::print("No MP3 files found\n");
+    return 1;
+  }
+
+  PlayerConfig config{Enum::OutputType::NULL_SINK,
+                      Enum::OutputDeviceType::DEFAULT};
+  Player p = Player(config);
+  if (p.init() != PlayerRetCode::InitRes::Success) {
+    fmt::print("Failed to init player\n");
+    return 1;
+  }
+
+  for (const CorpusFile &corpus_file : corpus) {
+    Entity::File file;
+    file.id = -1;
+    file.filename = corpus_file.path.filename();
+    file.fulldir_path = corpus_file.path.parent_path();
+    file.filetype = Enum::FileType::MP3;
+
+    std::vector<int64_t> load, decoder_open, output_open, first_decode,
+        first_write, total;
+
+    for (int i = 0; i < start_rounds; i++) {
+      auto start = std::chrono::steady_clock::now();
+
+      if (p.load(file) != PlayerRetCode::LoadRes::Success ||
+          p.play() != PlayerRetCode::PlayRes::Success) {
+        fmt::print("{}: failed to start\n", corpus_file.label);
+        break;
+      }
+
+      StartTiming timing;
+      if (!wait_first_write(p, timing)) {
+        fmt::print("{}: no audio written\n", corpus_file.label);
+        break;
+      }
+
+      total.push_back(std::chrono::duration_cast<std::chrono::microseconds>(
+                          std::chrono::steady_clock::now() - start)
+                          .count());
+      load.push_back(timing.load_us);
+      decoder_open.push_back(timing.decoder_open_us);
+      output_open.push_back(timing.output_open_us);
+      first_decode.push_back(timing.first_decode_us);
+      first_write.push_back(timing.first_write_us);
+
+      p.stop();
+    }
+
+    fmt::print("{}\n", corpus_file.label);
+    report("load", load);
+    report("decoder open", decoder_open);
+    report("output open", output_open);
+    report("first decode", first_decode);
+    report("first write", first_write);
+    report("end to end", total);
+  }
+
+  p.exit();
+
+  if (!generated.empty()) {
+    std::filesystem::remove_all(generated);
+  }
+
+  return 0;
+}
@@ -0,0 +1,72 @@
+#pragma once
+#include <condition_variable>
+#include <cstddef>
+#include <deque>
+#include <mutex>
+#include <utility>
+
+// Blocking multi-producer/multi-consumer queue holding at most `capacity`
+// items, push() waits while it is full. After close() pushes fail and pops
+// drain what is left, cancel() also drops the remaining items.
+template <typename T> class BoundedQueue {
+public:
+  explicit BoundedQueue(size_t capacity__) : capacity(capacity__) {}
+
+  BoundedQueue(const BoundedQueue &) = delete;
+  BoundedQueue &operator=(const BoundedQueue &) = delete;
+
+  bool push(T value) {
+    std::unique_lock<std::mutex> lock(mtx);
+    not_full.wait(lock, [&]() { return closed || items.size() < capacity; });
+    if (closed) {
+      return false;
+    }
+
+    items.push_back(std::move(value));
+    lock.unlock();
+    not_empty.notify_one();
+    return true;
+  }
+
+  // False once the queue is closed and empty.
+  bool pop(T &result) {
+    std::unique_lock<std::mutex> lock(mtx);
+    not_empty.wait(lock, [&]() { return closed || !items.empty(); });
+    if (items.empty()) {
+      return false;
+    }
+
+    result = std::move(items.front());
+    items.pop_front();
+    lock.unlock();
+    not_full.notify_one();
+    return true;
+  }
+
+  void close() {
+    {
+      std::lock_guard<std::mutex> lock(mtx);
+      closed = true;
+    }
+    not_full.notify_all();
+    not_empty.notify_all();
+  }
+
+  void cancel() {
+    {
+      std::lock_guard<std::mutex> lock(mtx);
+      closed = true;
+      items.clear();
+    }
+    not_full.notify_all();
+    not_empty.notify_all();
+  }
+
+private:
+  const size_t capacity;
+  std::deque<T> items;
+  bool closed = false;
+  std::mutex mtx;
+  std::condition_variable not_full;
+  std::condition_variable not_empty;
+};
@@ -0,0 +1,273 @@
+#include "dir_walker.hpp"
+#include <cerrno>
+#include <cstring>
+#include <dirent.h>
+#include <fcntl.h>
+#include <strings.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <sys/sysmacros.h>
+#include <unistd.h>
+#include <unordered_set>
+#include <vector>
+
+namespace {
+
+struct linux_dirent64 {
+  ino64_t d_ino;
+  off64_t d_off;
+  unsigned short d_reclen;
+  unsigned char d_type;
+  char d_name[];
+};
+
+struct FileKey {
+  std::uint64_t dev;
+  std::uint64_t ino;
+
+  bool operator==(const FileKey &other) const {
+    return dev == other.dev && ino == other.ino;
+  }
+};
+
+struct FileKeyHash {
+  size_t operator()(const FileKey &k) const {
+    return std::hash<std::uint64_t>()(k.ino * 31 + k.dev);
+  }
+};
+
+}; // namespace
+
+static constexpr size_t dirent_buf_size = 64 * 1024;
+
+// One statx call for everything the scanner needs. Falls back to fstatat on
+// kernels without statx.
+static bool stat_entry(int dirfd, const char *name, int flags,
+                       struct statx &stx) {
+  const unsigned int mask = STATX_TYPE | STATX_SIZE | STATX_MTIME | STATX_INO;
+  if (statx(dirfd, name, flags, mask, &stx) == 0) {
+    return true;
+  }
+
+  if (errno != ENOSYS) {
+    return false;
+  }
+
+  struct stat st;
+  if (fstatat(dirfd, name, &st, flags) != 0) {
+    return false;
+  }
+
+  stx.stx_mode = st.st_mode;
+  stx.stx_size = st.st_size;
+  stx.stx_mtime.tv_sec = st.st_mtime;
+  stx.stx_ino = st.st_ino;
+  stx.stx_dev_major = major(st.st_dev);
+  stx.stx_dev_minor = minor(st.st_dev);
+  return true;
+}
+
+Enum::FileType get_filetype_from_name(const char *name) {
+  const char *ext = strrchr(name, '.');
+  if (ext == nullptr) {
+    return Enum::FileType::UNKNOWN;
+  }
+
+  if (strcasecmp(ext, ".mp3") == 0)
+    return Enum::FileType::MP3;
+  else if (strcasecmp(ext, ".flac") == 0)
+    return Enum::FileType::FLAC;
+  else if (strcasecmp(ext, ".ogg") == 0)
+    return Enum::FileType::OGG;
+  else
+    return Enum::FileType::UNKNOWN;
+}
+
+WalkRetCode::WalkRes
+walk_audio_files(const std::filesystem::path &root,
+                 const std::function<void(const WalkEntry &)> &on_file,
+                 const WalkDirHooks *hooks) {
+  std::unordered_set<FileKey, FileKeyHash> seen_dirs;
+  std::unordered_set<FileKey, FileKeyHash> seen_files;
+
+  std::vector<std::filesystem::path> pending{root};
+  std::vector<char> buf(dirent_buf_size);
+  bool is_root = true;
+
+  while (!pending.empty()) {
+    if (hooks && hooks->cancel && *hooks->cancel) {
+      return WalkRetCode::WalkRes::Cancelled;
+    }
+
+    std::filesystem::path dir_path = std::move(pending.back());
+    pending.pop_back();
+
+    WalkDirInfo dir_info;
+    dir_info.path = dir_path;
+    dir_info.modified_time_ns = -1;
+    dir_info.entry_count = 0;
+    dir_info.listed = false;
+    dir_info.unreadable = true;
+
+    // Nothing below a directory that can't be read is known, the caller
+    // must not take its files for deleted.
+    auto report_unreadable = [&]() {
+      if (hooks && hooks->on_dir) {
+        hooks->on_dir(dir_info);
+      }
+    };
+
+    int fd = open(dir_path.c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (fd < 0) {
+      if (is_root) {
+        return WalkRetCode::WalkRes::CannotOpenDir;
+      }
+      report_unreadable();
+      continue;
+    }
+    is_root = false;
+
+    // One fstat per directory keeps symlinked directories from being
+    // walked twice or forever.
+    struct stat dir_st;
+    if (fstat(fd, &dir_st) != 0) {
+      close(fd);
+      report_unreadable();
+      continue;
+    }
+    if (!seen_dirs.insert({dir_st.st_dev, dir_st.st_ino}).second) {
+      close(fd);
+      continue;
+    }
+
+    dir_info.modified_time_ns =
+        (std::int64_t)dir_st.st_mtim.tv_sec * 1000000000 +
+        dir_st.st_mtim.tv_nsec;
+    dir_info.listed = true;
+    dir_info.unreadable = false;
+
+    if (hooks && hooks->should_list) {
+      std::vector<std::filesystem::path> subdirs;
+      if (!hooks->should_list(dir_path, dir_info.modified_time_ns, subdirs)) {
+        close(fd);
+        dir_info.listed = false;
+        if (hooks->on_dir) {
+          hooks->on_dir(dir_info);
+        }
+        for (std::filesystem::path &subdir : subdirs) {
+          pending.push_back(std::move(subdir));
+        }
+        continue;
+      }
+    }
+
+    while (true) {
+      long nread = syscall(SYS_getdents64, fd, buf.data(), buf.size());
+      if (nread < 0 && errno == EINTR) {
+        continue;
+      }
+      // EIO, a stale NFS handle and the like end the listing half way.
+      if (nread < 0) {
+        dir_info.listed = false;
+        dir_info.unreadable = true;
+        break;
+      }
+      if (nread == 0) {
+        break;
+      }
+
+      for (long pos = 0; pos < nread;) {
+        const linux_dirent64 *d =
+            reinterpret_cast<const linux_dirent64 *>(buf.data() + pos);
+        pos += d->d_reclen;
+
+        const char *name = d->d_name;
+        if (name[0] == '.' &&
+            (name[1] == '\0' || (name[1] == '.' && name[2] == '\0'))) {
+          continue;
+        }
+        dir_info.entry_count++;
+
+        if (d->d_type == DT_DIR) {
+          pending.push_back(dir_path / name);
+          dir_info.subdirs.push_back(pending.back());
+          continue;
+        }
+
+        if (d->d_type != DT_REG && d->d_type != DT_LNK &&
+            d->d_type != DT_UNKNOWN) {
+          continue;
+        }
+
+        Enum::FileType filetype = get_filetype_from_name(name);
+
+        // Only symlinks and untyped entries can still turn out to be
+        // directories, anything else without an audio extension is done.
+        if (filetype == Enum::FileType::UNKNOWN && d->d_type == DT_REG) {
+          continue;
+        }
+
+        struct statx stx;
+        if (!stat_entry(fd, name, 0, stx)) {
+          continue;
+        }
+
+        if (S_ISDIR(stx.stx_mode)) {
+          pending.push_back(dir_path / name);
+          dir_info.subdirs.push_back(pending.back());
+          continue;
+        }
+
+        if (!S_ISREG(stx.stx_mode) || filetype == Enum::FileType::UNKNOWN) {
+          continue;
+        }
+
+        const std::uint64_t dev =
+            makedev(stx.stx_dev_major, stx.stx_dev_minor);
+        if (!seen_files.insert({dev, stx.stx_ino}).second) {
+          continue;
+        }
+
+        WalkEntry entry;
+        entry.fulldir_path = dir_path;
+        entry.filename = name;
+        entry.filetype = filetype;
+        entry.size = stx.stx_size;
+        entry.modified_time = stx.stx_mtime.tv_sec;
+        entry.dev = dev;
+        entry.ino = stx.stx_ino;
+        on_file(entry);
+      }
+    }
+
+    close(fd);
+
+    if (hooks && hooks->on_dir) {
+      hooks->on_dir(dir_info);
+    }
+  }
+
+  return WalkRetCode::WalkRes::Success;
+}
+
+bool stat_audio_file(const std::filesystem::path &path, WalkEntry &entry) {
+  Enum::FileType filetype = get_filetype_from_name(path.filename().c_str());
+  if (filetype == Enum::FileType::UNKNOWN) {
+    return false;
+  }
+
+  struct statx stx;
+  if (!stat_entry(AT_FDCWD, path.c_str(), 0, stx) ||
+      !S_ISREG(stx.stx_mode)) {
+    return false;
+  }
+
+  entry.fulldir_path = path.parent_path();
+  entry.filename = path.filename();
+  entry.filetype = filetype;
+  entry.size = stx.stx_size;
+  entry.modified_time = stx.stx_mtime.tv_sec;
+  entry.dev = makedev(stx.stx_dev_major, stx.stx_dev_minor);
+  entry.ino = stx.stx_ino;
+  return true;
+}
@@ -0,0 +1,70 @@
+#pragma once
+#include "types.hpp"
+#include <atomic>
+#include <cstdint>
+#include <filesystem>
+#include <functional>
+#include <vector>
+
+namespace WalkRetCode {
+
+enum class WalkRes { Success = 0, CannotOpenDir, Cancelled };
+
+}; // namespace WalkRetCode
+
+struct WalkEntry {
+  std::filesystem::path fulldir_path;
+  std::filesystem::path filename;
+  Enum::FileType filetype;
+  std::uint64_t size;
+  std::int64_t modified_time;
+  std::uint64_t dev;
+  std::uint64_t ino;
+};
+
+struct WalkDirInfo {
+  std::filesystem::path path;
+  std::int64_t modified_time_ns;
+  std::uint64_t entry_count;
+  bool listed;
+  // Could not be opened or read to the end, listed is then false. Some or
+  // all of its files and subdirectories were not reported, and
+  // modified_time_ns is -1 when it could not be opened.
+  bool unreadable;
+  // Subdirectories found while listing, in the order they are queued.
+  std::vector<std::filesystem::path> subdirs;
+};
+
+// Lets the caller skip directories it already knows. should_list() runs for
+// every directory before its entries are read; when it returns false none of
+// the directory's files are reported and the walk descends into the
+// `subdirs` it filled in instead. on_dir() runs once per visited directory,
+// entry_count is only meaningful for listed ones. Setting *cancel stops the
+// walk before the next directory. Directories that can't be opened get an
+// on_dir() call too, without should_list().
+struct WalkDirHooks {
+  std::function<bool(const std::filesystem::path &dir,
+                     std::int64_t modified_time_ns,
+                     std::vector<std::filesystem::path> &subdirs)>
+      should_list;
+  std::function<void(const WalkDirInfo &)> on_dir;
+  const std::atomic<bool> *cancel = nullptr;
+};
+
+// Recursively lists the audio files below `root` and calls `on_file` for
+// each one. Directories are enumerated with getdents64, so entries are typed
+// without a stat; only files with an audio extension are stat'ed, with a
+// single statx for size, mtime and inode. Symlinked directories are
+// followed, every directory and file is visited once per (dev, inode), which
+// also breaks symlink loops and reports hardlinked files once. Directories
+// below the root that can't be read to the end go to on_dir as unreadable.
+WalkRetCode::WalkRes
+walk_audio_files(const std::filesystem::path &root,
+                 const std::function<void(const WalkEntry &)> &on_file,
+                 const WalkDirHooks *hooks = nullptr);
+
+// Fills `entry` the way walk_audio_files would for a single file. False if
+// the path is missing, not a regular file or has no audio extension.
+bool stat_audio_file(const std::filesystem::path &path, WalkEntry &entry);
+
+Enum::FileType get_filetype_from_name(const char *name);
@@ -0,0 +1,55 @@
+#include "fingerprint.hpp"
+#include <algorithm>
+#include <array>
+#include <fcntl.h>
+#include <unistd.h>
+
+static constexpr size_t sample_size = 4096;
+
+static constexpr std::uint64_t fnv_offset = 14695981039346656037ULL;
+static constexpr std::uint64_t fnv_prime = 1099511628211ULL;
+
+static std::uint64_t fnv1a(std::uint64_t hash, const unsigned char *data,
+                           size_t len) {
+  for (size_t i = 0; i < len; i++) {
+    hash ^= data[i];
+    hash *= fnv_prime;
+  }
+  return hash;
+}
+
+bool file_fingerprint(const std::filesystem::path &path, std::uint64_t size,
+                      std::uint64_t &result) {
+  int fd = open(path.c_str(), O_RDONLY | O_CLOEXEC);
+  if (fd < 0) {
+    return false;
+  }
+
+  // Small files are hashed whole, the samples would overlap.
+  const std::array<std::uint64_t, 3> offsets{
+      0, size > 3 * sample_size ? size / 2 - sample_size / 2 : sample_size,
+      size > 3 * sample_size ? size - sample_size : 2 * sample_size};
+
+  std::uint64_t hash = fnv1a(fnv_offset,
+                             reinterpret_cast<const unsigned char *>(&size),
+                             sizeof(size));
+  std::array<unsigned char, sample_size> buf;
+
+  for (std::uint64_t offset : offsets) {
+    if (offset >= size) {
+      break;
+    }
+
+    const size_t want = std::min<std::uint64_t>(sample_size, size - offset);
+    ssize_t len = pread(fd, buf.data(), want, offset);
+    if (len != (ssize_t)want) {
+      close(fd);
+      return false;
+    }
+    hash = fnv1a(hash, buf.data(), want);
+  }
+
+  close(fd);
+  result = hash == 0 ? 1 : hash;
+  return true;
+}
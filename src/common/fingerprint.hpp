@@ -0,0 +1,10 @@
+#pragma once
+#include <cstdint>
+#include <filesystem>
+
+// Cheap content fingerprint of a file: its size mixed with a hash of a few
+// blocks sampled at the start, middle and end. Renaming or moving a file
+// keeps it, so a scan can tell a moved file from a new one without reading
+// its tags. Never 0, which stands for "not computed".
+bool file_fingerprint(const std::filesystem::path &path, std::uint64_t size,
+                      std::uint64_t &result);
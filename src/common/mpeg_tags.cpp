@@ -0,0 +1,956 @@
+#include "mpeg_tags.hpp"
+#include <algorithm>
+#include <array>
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <fcntl.h>
+#include <string>
+#include <strings.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <vector>
+
+namespace {
+
+struct TagFields {
+  std::string title;
+  std::string artist;
+  std::string album;
+  std::string albumartist;
+  std::string genre;
+  int track_number = 0;
+  int disc_number = 0;
+  int year = 0;
+};
+
+// The start of the file, read once. Anything past it is read on demand.
+struct FileHead {
+  int fd;
+  std::uint64_t size;
+  std::vector<unsigned char> data;
+
+  bool read(std::uint64_t offset, size_t len, unsigned char *out) const {
+    if (offset + len > size) {
+      return false;
+    }
+
+    if (offset + len <= data.size()) {
+      memcpy(out, data.data() + offset, len);
+      return true;
+    }
+
+    return pread(fd, out, len, offset) == (ssize_t)len;
+  }
+};
+
+struct MpegHeader {
+  int version;     // 1, 2, or 25 for MPEG 2.5
+  int layer;       // 1 to 3
+  int bitrate;     // kbps
+  int sample_rate; // Hz
+  bool mono;
+  int samples_per_frame;
+  int frame_length;
+};
+
+}; // namespace
+
+// Enough for the ID3v2 tag of almost every file, cover art aside, and for
+// the first MPEG frame after it.
+static constexpr size_t head_size = 64 * 1024;
+
+// How far past the ID3v2 tag the first MPEG frame is looked for.
+static constexpr size_t frame_search_size = 64 * 1024;
+
+// Larger APE tags hold cover art, TagLib is as good a reader for those.
+static constexpr std::uint32_t max_ape_size = 1024 * 1024;
+
+// ID3v1 genres, as extended by Winamp.
+static const std::array<const char *, 192> id3v1_genres{
+    "Blues",
+    "Classic Rock",
+    "Country",
+    "Dance",
+    "Disco",
+    "Funk",
+    "Grunge",
+    "Hip-Hop",
+    "Jazz",
+    "Metal",
+    "New Age",
+    "Oldies",
+    "Other",
+    "Pop",
+    "R&B",
+    "Rap",
+    "Reggae",
+    "Rock",
+    "Techno",
+    "Industrial",
+    "Alternative",
+    "Ska",
+    "Death Metal",
+    "Pranks",
+    "Soundtrack",
+    "Euro-Techno",
+    "Ambient",
+    "Trip-Hop",
+    "Vocal",
+    "Jazz+Funk",
+    "Fusion",
+    "Trance",
+    "Classical",
+    "Instrumental",
+    "Acid",
+    "House",
+    "Game",
+    "Sound Clip",
+    "Gospel",
+    "Noise",
+    "Alternative Rock",
+    "Bass",
+    "Soul",
+    "Punk",
+    "Space",
+    "Meditative",
+    "Instrumental Pop",
+    "Instrumental Rock",
+    "Ethnic",
+    "Gothic",
+    "Darkwave",
+    "Techno-Industrial",
+    "Electronic",
+    "Pop-Folk",
+    "Eurodance",
+    "Dream",
+    "Southern Rock",
+    "Comedy",
+    "Cult",
+    "Gangsta",
+    "Top 40",
+    "Christian Rap",
+    "Pop/Funk",
+    "Jungle",
+    "Native American",
+    "Cabaret",
+    "New Wave",
+    "Psychedelic",
+    "Rave",
+    "Showtunes",
+    "Trailer",
+    "Lo-Fi",
+    "Tribal",
+    "Acid Punk",
+    "Acid Jazz",
+    "Polka",
+    "Retro",
+    "Musical",
+    "Rock & Roll",
+    "Hard Rock",
+    "Folk",
+    "Folk/Rock",
+    "National Folk",
+    "Swing",
+    "Fast-Fusion",
+    "Bebob",
+    "Latin",
+    "Revival",
+    "Celtic",
+    "Bluegrass",
+    "Avantgarde",
+    "Gothic Rock",
+    "Progressive Rock",
+    "Psychedelic Rock",
+    "Symphonic Rock",
+    "Slow Rock",
+    "Big Band",
+    "Chorus",
+    "Easy Listening",
+    "Acoustic",
+    "Humour",
+    "Speech",
+    "Chanson",
+    "Opera",
+    "Chamber Music",
+    "Sonata",
+    "Symphony",
+    "Booty Bass",
+    "Primus",
+    "Porn Groove",
+    "Satire",
+    "Slow Jam",
+    "Club",
+    "Tango",
+    "Samba",
+    "Folklore",
+    "Ballad",
+    "Power Ballad",
+    "Rhythmic Soul",
+    "Freestyle",
+    "Duet",
+    "Punk Rock",
+    "Drum Solo",
+    "A Cappella",
+    "Euro-House",
+    "Dance Hall",
+    "Goa",
+    "Drum & Bass",
+    "Club-House",
+    "Hardcore",
+    "Terror",
+    "Indie",
+    "BritPop",
+    "Negerpunk",
+    "Polsk Punk",
+    "Beat",
+    "Christian Gangsta Rap",
+    "Heavy Metal",
+    "Black Metal",
+    "Crossover",
+    "Contemporary Christian",
+    "Christian Rock",
+    "Merengue",
+    "Salsa",
+    "Thrash Metal",
+    "Anime",
+    "Jpop",
+    "Synthpop",
+    "Abstract",
+    "Art Rock",
+    "Baroque",
+    "Bhangra",
+    "Big Beat",
+    "Breakbeat",
+    "Chillout",
+    "Downtempo",
+    "Dub",
+    "EBM",
+    "Eclectic",
+    "Electro",
+    "Electroclash",
+    "Emo",
+    "Experimental",
+    "Garage",
+    "Global",
+    "IDM",
+    "Illbient",
+    "Industro-Goth",
+    "Jam Band",
+    "Krautrock",
+    "Leftfield",
+    "Lounge",
+    "Math Rock",
+    "New Romantic",
+    "Nu-Breakz",
+    "Post-Punk",
+    "Post-Rock",
+    "Psytrance",
+    "Shoegaze",
+    "Space Rock",
+    "Trop Rock",
+    "World Music",
+    "Neoclassical",
+    "Audiobook",
+    "Audio Theatre",
+    "Neue Deutsche Welle",
+    "Podcast",
+    "Indie Rock",
+    "G-Funk",
+    "Dubstep",
+    "Garage Rock",
+    "Psybient",
+};
+
+static std::uint32_t read_be32(const unsigned char *p) {
+  return (std::uint32_t)p[0] << 24 | (std::uint32_t)p[1] << 16 |
+         (std::uint32_t)p[2] << 8 | p[3];
+}
+
+static std::uint32_t read_le32(const unsigned char *p) {
+  return (std::uint32_t)p[3] << 24 | (std::uint32_t)p[2] << 16 |
+         (std::uint32_t)p[1] << 8 | p[0];
+}
+
+// 7 bits per byte, false if a high bit is set.
+static bool read_syncsafe(const unsigned char *p, std::uint32_t &result) {
+  if ((p[0] | p[1] | p[2] | p[3]) & 0x80) {
+    return false;
+  }
+  result = (std::uint32_t)p[0] << 21 | (std::uint32_t)p[1] << 14 |
+           (std::uint32_t)p[2] << 7 | p[3];
+  return true;
+}
+
+// Leading decimal number, "3/12" is 3.
+static int leading_int(const std::string &s) {
+  return (int)strtol(s.c_str(), nullptr, 10);
+}
+
+static void append_utf8(std::string &out, std::uint32_t cp) {
+  if (cp < 0x80) {
+    out += (char)cp;
+  } else if (cp < 0x800) {
+    out += (char)(0xC0 | cp >> 6);
+    out += (char)(0x80 | (cp & 0x3F));
+  } else if (cp < 0x10000) {
+    out += (char)(0xE0 | cp >> 12);
+    out += (char)(0x80 | (cp >> 6 & 0x3F));
+    out += (char)(0x80 | (cp & 0x3F));
+  } else {
+    out += (char)(0xF0 | cp >> 18);
+    out += (char)(0x80 | (cp >> 12 & 0x3F));
+    out += (char)(0x80 | (cp >> 6 & 0x3F));
+    out += (char)(0x80 | (cp & 0x3F));
+  }
+}
+
+static std::string latin1_to_utf8(const unsigned char *data, size_t len) {
+  std::string out;
+  out.reserve(len);
+  for (size_t i = 0; i < len; i++) {
+    append_utf8(out, data[i]);
+  }
+  return out;
+}
+
+static std::string utf16_to_utf8(const unsigned char *data, size_t len,
+                                 bool big_endian) {
+  std::string out;
+  out.reserve(len / 2);
+  for (size_t i = 0; i + 1 < len; i += 2) {
+    std::uint32_t unit = big_endian ? (data[i] << 8 | data[i + 1])
+                                    : (data[i + 1] << 8 | data[i]);
+
+    if (unit >= 0xD800 && unit < 0xDC00 && i + 3 < len) {
+      std::uint32_t low = big_endian ? (data[i + 2] << 8 | data[i + 3])
+                                     : (data[i + 3] << 8 | data[i + 2]);
+      if (low >= 0xDC00 && low < 0xE000) {
+        append_utf8(out, 0x10000 + ((unit - 0xD800) << 10) + (low - 0xDC00));
+        i += 2;
+        continue;
+      }
+    }
+    append_utf8(out, unit);
+  }
+  return out;
+}
+
+// The strings of an ID3v2 text frame body, empty ones dropped.
+static std::vector<std::string> id3v2_text_fields(const unsigned char *data,
+                                                  size_t len) {
+  std::vector<std::string> fields;
+  if (len == 0) {
+    return fields;
+  }
+
+  const unsigned char encoding = data[0];
+  const size_t unit = (encoding == 1 || encoding == 2) ? 2 : 1;
+  bool big_endian = encoding == 2;
+
+  size_t start = 1;
+  while (start < len) {
+    size_t end = start;
+    while (end + unit <= len &&
+           !(data[end] == 0 && (unit == 1 || data[end + 1] == 0))) {
+      end += unit;
+    }
+    end = std::min(end, len);
+
+    const unsigned char *s = data + start;
+    size_t s_len = end - start;
+
+    std::string field;
+    if (encoding == 0) {
+      field = latin1_to_utf8(s, s_len);
+    } else if (encoding == 3) {
+      field.assign(reinterpret_cast<const char *>(s), s_len);
+    } else {
+      // Every UTF-16 string carries its own BOM.
+      if (encoding == 1 && s_len >= 2) {
+        if (s[0] == 0xFF && s[1] == 0xFE) {
+          big_endian = false;
+          s += 2;
+          s_len -= 2;
+        } else if (s[0] == 0xFE && s[1] == 0xFF) {
+          big_endian = true;
+          s += 2;
+          s_len -= 2;
+        }
+      }
+      field = utf16_to_utf8(s, s_len, big_endian);
+    }
+
+    if (!field.empty()) {
+      fields.push_back(std::move(field));
+    }
+    start = end + unit;
+  }
+
+  return fields;
+}
+
+static std::string join_fields(const std::vector<std::string> &fields) {
+  std::string out;
+  for (const std::string &f : fields) {
+    if (!out.empty()) {
+      out += ' ';
+    }
+    out += f;
+  }
+  return out;
+}
+
+// Numeric genres name an ID3v1 genre, ID3v2.3 writes them as "(17)" in
+// front of the text.
+static std::string id3v2_genre(const std::vector<std::string> &fields) {
+  std::vector<std::string> genres;
+  auto add = [&](std::string g) {
+    if (g.empty()) {
+      return;
+    }
+
+    char *end = nullptr;
+    long n = strtol(g.c_str(), &end, 10);
+    if (*end == '\0' && n >= 0 && n < (long)id3v1_genres.size()) {
+      g = id3v1_genres[n];
+    }
+
+    if (std::find(genres.begin(), genres.end(), g) == genres.end()) {
+      genres.push_back(std::move(g));
+    }
+  };
+
+  for (const std::string &field : fields) {
+    size_t pos = 0;
+    while (pos < field.size() && field[pos] == '(') {
+      size_t close = field.find(')', pos);
+      if (close == std::string::npos || field.compare(pos, 2, "((") == 0) {
+        break;
+      }
+      add(field.substr(pos + 1, close - pos - 1));
+      pos = close + 1;
+    }
+    add(field.substr(pos));
+  }
+
+  return join_fields(genres);
+}
+
+// Undoes ID3v2 unsynchronisation, a 0x00 inserted after every 0xFF.
+static void resync(std::vector<unsigned char> &data) {
+  size_t out = 0;
+  for (size_t i = 0; i < data.size(); i++) {
+    data[out++] = data[i];
+    if (data[i] == 0xFF && i + 1 < data.size() && data[i + 1] == 0x00) {
+      i++;
+    }
+  }
+  data.resize(out);
+}
+
+static void set_id3v2_field(TagFields &tag, const char *id,
+                            const std::vector<std::string> &fields) {
+  if (fields.empty()) {
+    return;
+  }
+
+  // ID3v2.2 ids are three characters, the others four.
+  auto is = [&](const char *v22, const char *v23) {
+    return strcmp(id, v22) == 0 || strcmp(id, v23) == 0;
+  };
+
+  if (is("TT2", "TIT2")) {
+    tag.title = join_fields(fields);
+  } else if (is("TP1", "TPE1")) {
+    tag.artist = join_fields(fields);
+  } else if (is("TAL", "TALB")) {
+    tag.album = join_fields(fields);
+  } else if (is("TP2", "TPE2")) {
+    tag.albumartist = fields[0];
+  } else if (is("TRK", "TRCK")) {
+    tag.track_number = leading_int(fields[0]);
+  } else if (is("TPA", "TPOS")) {
+    tag.disc_number = leading_int(fields[0]);
+  } else if (is("TYE", "TDRC") || strcmp(id, "TYER") == 0) {
+    tag.year = leading_int(fields[0].substr(0, 4));
+  } else if (is("TCO", "TCON")) {
+    tag.genre = id3v2_genre(fields);
+  }
+}
+
+static bool is_wanted_frame(const char *id) {
+  static const std::array<const char *, 17> wanted{
+      "TT2",  "TP1",  "TAL",  "TP2",  "TRK",  "TPA",  "TYE",  "TCO", "TIT2",
+      "TPE1", "TALB", "TPE2", "TRCK", "TPOS", "TDRC", "TYER", "TCON"};
+  for (const char *w : wanted) {
+    if (strcmp(id, w) == 0) {
+      return true;
+    }
+  }
+  return false;
+}
+
+// Parses the ID3v2 tag at the start of the file, if any. tag_end is where
+// the audio may start.
+static MpegTagsRetCode::ReadRes read_id3v2(const FileHead &head, TagFields &tag,
+                                           std::uint64_t &tag_end) {
+  tag_end = 0;
+
+  unsigned char header[10];
+  if (!head.read(0, sizeof(header), header) || memcmp(header, "ID3", 3) != 0) {
+    return MpegTagsRetCode::ReadRes::Success;
+  }
+
+  const int version = header[3];
+  const unsigned char flags = header[5];
+  std::uint32_t size;
+  if (version < 2 || version > 4 || !read_syncsafe(header + 6, size)) {
+    return MpegTagsRetCode::ReadRes::Unsupported;
+  }
+
+  // ID3v2.4 may end with a footer, a copy of the header.
+  const bool footer = version == 4 && (flags & 0x10);
+  tag_end = 10 + (std::uint64_t)size + (footer ? 10 : 0);
+
+  const bool tag_unsync = flags & 0x80;
+  if (tag_unsync && version < 4) {
+    return MpegTagsRetCode::ReadRes::Unsupported;
+  }
+  if (version == 2 && (flags & 0x40)) {
+    return MpegTagsRetCode::ReadRes::Unsupported;
+  }
+
+  std::uint64_t pos = 10;
+  const std::uint64_t end = 10 + (std::uint64_t)size;
+
+  if (version > 2 && (flags & 0x40)) {
+    unsigned char ext[4];
+    if (!head.read(pos, sizeof(ext), ext)) {
+      return MpegTagsRetCode::ReadRes::Unsupported;
+    }
+
+    // The ID3v2.3 size leaves itself out, the ID3v2.4 one is syncsafe.
+    std::uint32_t ext_size = read_be32(ext);
+    if (version == 4 && !read_syncsafe(ext, ext_size)) {
+      return MpegTagsRetCode::ReadRes::Unsupported;
+    }
+    pos += version == 3 ? 4 + (std::uint64_t)ext_size : ext_size;
+  }
+
+  const size_t id_len = version == 2 ? 3 : 4;
+  const size_t frame_header_len = version == 2 ? 6 : 10;
+
+  while (pos + frame_header_len <= end) {
+    unsigned char fh[10];
+    if (!head.read(pos, frame_header_len, fh)) {
+      return MpegTagsRetCode::ReadRes::Unsupported;
+    }
+
+    // Padding.
+    if (fh[0] == 0) {
+      break;
+    }
+
+    char id[5] = {};
+    memcpy(id, fh, id_len);
+
+    std::uint32_t frame_size;
+    if (version == 2) {
+      frame_size = fh[3] << 16 | fh[4] << 8 | fh[5];
+    } else if (version == 3) {
+      frame_size = read_be32(fh + 4);
+    } else if (!read_syncsafe(fh + 4, frame_size)) {
+      return MpegTagsRetCode::ReadRes::Unsupported;
+    }
+
+    std::uint64_t body = pos + frame_header_len;
+    pos = body + frame_size;
+    if (pos > end) {
+      break;
+    }
+
+    if (!is_wanted_frame(id)) {
+      continue;
+    }
+
+    bool unsync = false;
+    std::uint32_t skip = 0;
+    if (version == 3) {
+      if (fh[9] & 0xC0) {
+        return MpegTagsRetCode::ReadRes::Unsupported;
+      }
+      skip = fh[9] & 0x20 ? 1 : 0;
+    } else if (version == 4) {
+      if (fh[9] & 0x0C) {
+        return MpegTagsRetCode::ReadRes::Unsupported;
+      }
+      skip = (fh[9] & 0x40 ? 1 : 0) + (fh[9] & 0x01 ? 4 : 0);
+      unsync = tag_unsync || (fh[9] & 0x02);
+    }
+
+    if (skip > frame_size) {
+      continue;
+    }
+
+    std::vector<unsigned char> data(frame_size - skip);
+    if (!head.read(body + skip, data.size(), data.data())) {
+      return MpegTagsRetCode::ReadRes::Unsupported;
+    }
+    if (unsync) {
+      resync(data);
+    }
+
+    set_id3v2_field(tag, id, id3v2_text_fields(data.data(), data.size()));
+  }
+
+  return MpegTagsRetCode::ReadRes::Success;
+}
+
+// Latin-1 with whitespace and padding trimmed.
+static std::string id3v1_string(const unsigned char *data, size_t len) {
+  size_t start = 0;
+  while (start < len && (data[start] == ' ' || data[start] == '\0')) {
+    start++;
+  }
+  size_t end = start;
+  for (size_t i = start; i < len && data[i] != '\0'; i++) {
+    if (data[i] != ' ') {
+      end = i + 1;
+    }
+  }
+  return latin1_to_utf8(data + start, end - start);
+}
+
+static void read_id3v1(const unsigned char *data, TagFields &tag) {
+  tag.title = id3v1_string(data + 3, 30);
+  tag.artist = id3v1_string(data + 33, 30);
+  tag.album = id3v1_string(data + 63, 30);
+  tag.year = leading_int(id3v1_string(data + 93, 4));
+
+  // ID3v1.1 keeps the track in the last byte of the comment.
+  if (data[125] == 0 && data[126] != 0) {
+    tag.track_number = data[126];
+  }
+
+  if (data[127] < id3v1_genres.size()) {
+    tag.genre = id3v1_genres[data[127]];
+  }
+}
+
+// Parses the APEv2 tag ending at footer_pos. ape_size receives the bytes it
+// takes at the end of the audio, header included.
+static bool read_ape(const FileHead &head, std::uint64_t footer_pos,
+                     TagFields &tag, std::uint64_t &ape_size) {
+  unsigned char footer[32];
+  if (!head.read(footer_pos, sizeof(footer), footer) ||
+      memcmp(footer, "APETAGEX", 8) != 0) {
+    ape_size = 0;
+    return true;
+  }
+
+  // The size counts the items and the footer, not the optional header.
+  const std::uint32_t size = read_le32(footer + 12);
+  const std::uint32_t count = read_le32(footer + 16);
+  const std::uint32_t flags = read_le32(footer + 20);
+  if (size < 32 || size > max_ape_size || size > footer_pos + 32) {
+    return false;
+  }
+  ape_size = size + (flags & 0x80000000u ? 32 : 0);
+
+  std::vector<unsigned char> items(size - 32);
+  if (!head.read(footer_pos + 32 - size, items.size(), items.data())) {
+    return false;
+  }
+
+  size_t pos = 0;
+  for (std::uint32_t i = 0; i < count && pos + 8 < items.size(); i++) {
+    const std::uint32_t value_len = read_le32(items.data() + pos);
+    const std::uint32_t item_flags = read_le32(items.data() + pos + 4);
+    pos += 8;
+
+    const unsigned char *key_end = static_cast<const unsigned char *>(
+        memchr(items.data() + pos, 0, items.size() - pos));
+    if (!key_end) {
+      return false;
+    }
+    const std::string key(reinterpret_cast<const char *>(items.data() + pos),
+                          key_end - (items.data() + pos));
+    pos += key.size() + 1;
+
+    if (value_len > items.size() - pos) {
+      return false;
+    }
+    const unsigned char *value = items.data() + pos;
+    pos += value_len;
+
+    // Binary and external items.
+    if (item_flags & 0x06) {
+      continue;
+    }
+
+    std::vector<std::string> values;
+    size_t start = 0;
+    for (size_t j = 0; j <= value_len; j++) {
+      if (j == value_len || value[j] == '\0') {
+        if (j > start) {
+          values.emplace_back(reinterpret_cast<const char *>(value + start),
+                              j - start);
+        }
+        start = j + 1;
+      }
+    }
+    if (values.empty()) {
+      continue;
+    }
+
+    const char *k = key.c_str();
+    if (strcasecmp(k, "TITLE") == 0) {
+      tag.title = join_fields(values);
+    } else if (strcasecmp(k, "ARTIST") == 0) {
+      tag.artist = join_fields(values);
+    } else if (strcasecmp(k, "ALBUM") == 0) {
+      tag.album = join_fields(values);
+    } else if (strcasecmp(k, "ALBUM ARTIST") == 0 ||
+               strcasecmp(k, "ALBUMARTIST") == 0) {
+      tag.albumartist = values[0];
+    } else if (strcasecmp(k, "TRACK") == 0) {
+      tag.track_number = leading_int(values[0]);
+    } else if (strcasecmp(k, "DISC") == 0 ||
+               strcasecmp(k, "DISCNUMBER") == 0) {
+      tag.disc_number = leading_int(values[0]);
+    } else if (strcasecmp(k, "YEAR") == 0) {
+      tag.year = leading_int(values[0]);
+    } else if (strcasecmp(k, "GENRE") == 0) {
+      tag.genre = join_fields(values);
+    }
+  }
+
+  return true;
+}
+
+static bool parse_mpeg_header(const unsigned char *h, MpegHeader &result) {
+  static const int bitrates[5][16] = {
+      {0, 32, 64, 96, 128, 160, 192, 224, 256, 288, 320, 352, 384, 416, 448},
+      {0, 32, 48, 56, 64, 80, 96, 112, 128, 160, 192, 224, 256, 320, 384},
+      {0, 32, 40, 48, 56, 64, 80, 96, 112, 128, 160, 192, 224, 256, 320},
+      {0, 32, 48, 56, 64, 80, 96, 112, 128, 144, 160, 176, 192, 224, 256},
+      {0, 8, 16, 24, 32, 40, 48, 56, 64, 80, 96, 112, 128, 144, 160}};
+  static const int sample_rates[3] = {44100, 48000, 32000};
+
+  if (h[0] != 0xFF || (h[1] & 0xE0) != 0xE0) {
+    return false;
+  }
+
+  const int version_bits = (h[1] >> 3) & 0x03;
+  const int layer_bits = (h[1] >> 1) & 0x03;
+  const int bitrate_idx = h[2] >> 4;
+  const int rate_idx = (h[2] >> 2) & 0x03;
+  if (version_bits == 1 || layer_bits == 0 || bitrate_idx == 0 ||
+      bitrate_idx == 15 || rate_idx == 3) {
+    return false;
+  }
+
+  result.version = version_bits == 3 ? 1 : version_bits == 2 ? 2 : 25;
+  result.layer = 4 - layer_bits;
+
+  const int table = result.version == 1 ? result.layer - 1
+                    : result.layer == 1 ? 3
+                                        : 4;
+  result.bitrate = bitrates[table][bitrate_idx];
+  result.sample_rate = sample_rates[rate_idx] /
+                       (result.version == 1 ? 1 : result.version == 2 ? 2 : 4);
+  result.mono = (h[3] >> 6) == 3;
+
+  const int padding = (h[2] >> 1) & 0x01;
+  if (result.layer == 1) {
+    result.samples_per_frame = 384;
+    result.frame_length =
+        (12000 * result.bitrate / result.sample_rate + padding) * 4;
+  } else {
+    result.samples_per_frame =
+        result.layer == 3 && result.version != 1 ? 576 : 1152;
+    result.frame_length = result.samples_per_frame / 8 * 1000 *
+                              result.bitrate / result.sample_rate +
+                          padding;
+  }
+
+  return result.frame_length > 4;
+}
+
+// The first frame whose successor is also a matching frame, so sync-like
+// bytes in padding or a stray tag are not taken for audio.
+static bool find_first_frame(const FileHead &head, std::uint64_t from,
+                             std::uint64_t audio_end, std::uint64_t &offset,
+                             MpegHeader &result) {
+  const std::uint64_t limit =
+      std::min<std::uint64_t>(audio_end, from + frame_search_size);
+  if (from + 4 > limit) {
+    return false;
+  }
+
+  std::vector<unsigned char> window(limit - from);
+  if (!head.read(from, window.size(), window.data())) {
+    return false;
+  }
+
+  for (size_t i = 0; i + 4 <= window.size(); i++) {
+    if (window[i] != 0xFF || !parse_mpeg_header(&window[i], result)) {
+      continue;
+    }
+
+    const std::uint64_t next = from + i + result.frame_length;
+    unsigned char h[4];
+    MpegHeader next_header;
+    if (next + 4 <= audio_end) {
+      if (!head.read(next, sizeof(h), h) ||
+          !parse_mpeg_header(h, next_header) ||
+          next_header.version != result.version ||
+          next_header.layer != result.layer ||
+          next_header.sample_rate != result.sample_rate) {
+        continue;
+      }
+    }
+
+    offset = from + i;
+    return true;
+  }
+
+  return false;
+}
+
+// Length in milliseconds and bitrate from a Xing/Info or VBRI header, the
+// frame count of a VBR stream can't be guessed from its first frame.
+static bool read_vbr_header(const FileHead &head, std::uint64_t frame,
+                            const MpegHeader &h, std::uint64_t &length_ms,
+                            int &bitrate) {
+  unsigned char data[64];
+  std::uint32_t frames = 0;
+  std::uint32_t bytes = 0;
+
+  const int xing_offset =
+      4 + (h.version == 1 ? (h.mono ? 17 : 32) : (h.mono ? 9 : 17));
+  if (head.read(frame + xing_offset, 16, data) &&
+      (memcmp(data, "Xing", 4) == 0 || memcmp(data, "Info", 4) == 0)) {
+    const std::uint32_t flags = read_be32(data + 4);
+    if ((flags & 0x03) == 0x03) {
+      frames = read_be32(data + 8);
+      bytes = read_be32(data + 12);
+    }
+  } else if (head.read(frame + 36, 18, data) &&
+             memcmp(data, "VBRI", 4) == 0) {
+    bytes = read_be32(data + 10);
+    frames = read_be32(data + 14);
+  }
+
+  if (frames == 0 || bytes == 0) {
+    return false;
+  }
+
+  const double ms =
+      (double)frames * h.samples_per_frame * 1000.0 / h.sample_rate;
+  length_ms = (std::uint64_t)(ms + 0.5);
+  bitrate = (int)(bytes * 8.0 / ms + 0.5);
+  return true;
+}
+
+MpegTagsRetCode::ReadRes read_mpeg_tags(const std::filesystem::path &path,
+                                        Entity::File &result) {
+  int fd = open(path.c_str(), O_RDONLY | O_CLOEXEC);
+  if (fd < 0) {
+    return MpegTagsRetCode::ReadRes::CannotOpen;
+  }
+
+  struct stat st;
+  if (fstat(fd, &st) != 0) {
+    close(fd);
+    return MpegTagsRetCode::ReadRes::CannotOpen;
+  }
+
+  FileHead head{fd, (std::uint64_t)st.st_size, {}};
+  head.data.resize(std::min<std::uint64_t>(head.size, head_size));
+  if (pread(fd, head.data.data(), head.data.size(), 0) !=
+      (ssize_t)head.data.size()) {
+    close(fd);
+    return MpegTagsRetCode::ReadRes::CannotOpen;
+  }
+
+  auto done = [&](MpegTagsRetCode::ReadRes res) {
+    close(fd);
+    return res;
+  };
+
+  TagFields id3v2;
+  std::uint64_t audio_start;
+  MpegTagsRetCode::ReadRes res = read_id3v2(head, id3v2, audio_start);
+  if (res != MpegTagsRetCode::ReadRes::Success) {
+    return done(res);
+  }
+
+  TagFields id3v1;
+  std::uint64_t audio_end = head.size;
+  unsigned char v1[128];
+  if (head.size >= sizeof(v1) + audio_start &&
+      head.read(head.size - sizeof(v1), sizeof(v1), v1) &&
+      memcmp(v1, "TAG", 3) == 0) {
+    read_id3v1(v1, id3v1);
+    audio_end -= sizeof(v1);
+  }
+
+  TagFields ape;
+  std::uint64_t ape_size = 0;
+  if (audio_end >= 32 + audio_start) {
+    if (!read_ape(head, audio_end - 32, ape, ape_size) ||
+        ape_size > audio_end - audio_start) {
+      return done(MpegTagsRetCode::ReadRes::Unsupported);
+    }
+    audio_end -= ape_size;
+  }
+
+  std::uint64_t frame;
+  MpegHeader header;
+  if (!find_first_frame(head, audio_start, audio_end, frame, header)) {
+    return done(MpegTagsRetCode::ReadRes::Unsupported);
+  }
+
+  std::uint64_t length_ms;
+  int bitrate;
+  if (!read_vbr_header(head, frame, header, length_ms, bitrate)) {
+    bitrate = header.bitrate;
+    length_ms = (std::uint64_t)((audio_end - frame) * 8.0 / bitrate + 0.5);
+  }
+
+  close(fd);
+
+  // First tag with the field wins.
+  const std::array<const TagFields *, 3> tags{&id3v2, &ape, &id3v1};
+  auto text = [&](std::string TagFields::*field) {
+    for (const TagFields *t : tags) {
+      if (!(t->*field).empty()) {
+        return t->*field;
+      }
+    }
+    return std::string();
+  };
+  auto number = [&](int TagFields::*field) {
+    for (const TagFields *t : tags) {
+      if (t->*field != 0) {
+        return t->*field;
+      }
+    }
+    return 0;
+  };
+
+  result.title = text(&TagFields::title);
+  result.artist = text(&TagFields::artist);
+  result.album = text(&TagFields::album);
+  result.albumartist = text(&TagFields::albumartist);
+  result.genre = text(&TagFields::genre);
+  result.track_number = number(&TagFields::track_number);
+  result.disc_number = number(&TagFields::disc_number);
+  result.year = number(&TagFields::year);
+  result.length = (int)(length_ms / 1000);
+  result.bitrate = bitrate;
+
+  return MpegTagsRetCode::ReadRes::Success;
+}
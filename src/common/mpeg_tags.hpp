@@ -0,0 +1,22 @@
+#pragma once
+#include "types.hpp"
+#include <filesystem>
+
+namespace MpegTagsRetCode {
+
+enum class ReadRes { Success = 0, CannotOpen, Unsupported };
+
+}; // namespace MpegTagsRetCode
+
+// Reads the tags and audio properties of an MP3 without TagLib, through a
+// few preads: the ID3v2 frames it needs from the start of the file, the
+// APEv2 and ID3v1 tags from the end and the first MPEG frame, with its
+// Xing/VBRI header, for length and bitrate. Each field comes from the first
+// tag that has it, ID3v2 then APE then ID3v1, like TagLib's MPEG tag.
+//
+// Fills title, artist, album, albumartist, track_number, disc_number, year,
+// genre, length and bitrate of `result`. Unsupported is returned for what is
+// rare enough to leave to TagLib: unsynchronised ID3v2.3 tags, compressed
+// or encrypted frames, and files without an MPEG frame near the start.
+MpegTagsRetCode::ReadRes read_mpeg_tags(const std::filesystem::path &path,
+                                        Entity::File &result);
@@ -0,0 +1,58 @@
+#pragma once
+#include <atomic>
+#include <utility>
+
+// Unbounded lock-free multi-producer/single-consumer queue (Vyukov style).
+// push() may be called from any thread, pop() and empty() only from the one
+// consumer thread.
+template <typename T> class MPSCQueue {
+public:
+  MPSCQueue() {
+    Node *stub = new Node();
+    head.store(stub, std::memory_order_relaxed);
+    tail = stub;
+  }
+
+  ~MPSCQueue() {
+    T value;
+    while (pop(value)) {
+    }
+    delete tail;
+  }
+
+  MPSCQueue(const MPSCQueue &) = delete;
+  MPSCQueue &operator=(const MPSCQueue &) = delete;
+
+  void push(T value) {
+    Node *node = new Node();
+    node->value = std::move(value);
+
+    Node *prev = head.exchange(node, std::memory_order_acq_rel);
+    prev->next.store(node, std::memory_order_release);
+  }
+
+  bool pop(T &result) {
+    Node *next = tail->next.load(std::memory_order_acquire);
+    if (next == nullptr) {
+      return false;
+    }
+
+    result = std::move(next->value);
+    delete tail;
+    tail = next;
+    return true;
+  }
+
+  bool empty() const {
+    return tail->next.load(std::memory_order_acquire) == nullptr;
+  }
+
+private:
+  struct Node {
+    std::atomic<Node *> next = nullptr;
+    T value;
+  };
+
+  std::atomic<Node *> head;
+  Node *tail;
+};
@@ -0,0 +1,92 @@
+#include "ring_buffer.hpp"
+#include <algorithm>
+#include <cstring>
+
+void PCMRingBuffer::reset(size_t capacity__) {
+  if (capacity__ != cap) {
+    data = std::make_unique<char[]>(capacity__);
+    cap = capacity__;
+  }
+
+  head.store(0, std::memory_order_relaxed);
+  tail.store(0, std::memory_order_relaxed);
+}
+
+void PCMRingBuffer::grow(size_t capacity__) {
+  if (capacity__ <= cap) {
+    return;
+  }
+
+  std::unique_ptr<char[]> bigger = std::make_unique<char[]>(capacity__);
+  const size_t t = tail.load(std::memory_order_relaxed);
+  const size_t h = head.load(std::memory_order_relaxed);
+
+  // Bytes stay at counter % capacity, so they move in up to three pieces.
+  for (size_t at = t; at < h;) {
+    const size_t from = at % cap;
+    const size_t to = at % capacity__;
+    const size_t n = std::min({h - at, cap - from, capacity__ - to});
+    std::memcpy(bigger.get() + to, data.get() + from, n);
+    at += n;
+  }
+
+  data = std::move(bigger);
+  cap = capacity__;
+}
+
+size_t PCMRingBuffer::write(const char *buf, size_t count) {
+  const size_t h = head.load(std::memory_order_relaxed);
+  const size_t t = tail.load(std::memory_order_acquire);
+
+  size_t n = std::min(count, cap - (h - t));
+  if (n == 0)
+    return 0;
+
+  size_t pos = h % cap;
+  size_t first = std::min(n, cap - pos);
+
+  std::memcpy(data.get() + pos, buf, first);
+  std::memcpy(data.get(), buf + first, n - first);
+
+  head.store(h + n, std::memory_order_release);
+  return n;
+}
+
+size_t PCMRingBuffer::read(char *buf, size_t count) {
+  const size_t t = tail.load(std::memory_order_relaxed);
+  const size_t h = head.load(std::memory_order_acquire);
+
+  size_t n = std::min(count, h - t);
+  if (n == 0)
+    return 0;
+
+  size_t pos = t % cap;
+  size_t first = std::min(n, cap - pos);
+
+  std::memcpy(buf, data.get() + pos, first);
+  std::memcpy(buf + first, data.get(), n - first);
+
+  tail.store(t + n, std::memory_order_release);
+  return n;
+}
+
+void PCMRingBuffer::discard() {
+  tail.store(head.load(std::memory_order_acquire), std::memory_order_release);
+}
+
+size_t PCMRingBuffer::readable() const {
+  const size_t t = tail.load(std::memory_order_acquire);
+  return head.load(std::memory_order_acquire) - t;
+}
+
+size_t PCMRingBuffer::writable() const { return cap - readable(); }
+
+size_t PCMRingBuffer::capacity() const { return cap; }
+
+size_t PCMRingBuffer::read_position() const {
+  return tail.load(std::memory_order_acquire);
+}
+
+size_t PCMRingBuffer::write_position() const {
+  return head.load(std::memory_order_acquire);
+}
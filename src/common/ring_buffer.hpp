@@ -0,0 +1,36 @@
+#pragma once
+#include <atomic>
+#include <cstddef>
+#include <memory>
+
+// Single-producer/single-consumer byte ring used to hand decoded PCM from the
+// decoder thread to the output thread without locking. write() may only be
+// called from the producer thread, read() and discard() only from the
+// consumer thread. reset() and grow() must not race with either side.
+class PCMRingBuffer {
+public:
+  PCMRingBuffer() = default;
+
+  void reset(size_t capacity__);
+  // Enlarges the ring, keeping what it holds and both positions.
+  void grow(size_t capacity__);
+
+  size_t write(const char *buf, size_t count);
+  size_t read(char *buf, size_t count);
+  void discard();
+
+  size_t readable() const;
+  size_t writable() const;
+  size_t capacity() const;
+
+  size_t read_position() const;
+  size_t write_position() const;
+
+private:
+  std::unique_ptr<char[]> data = nullptr;
+  size_t cap = 0;
+
+  // Monotonic byte counters, the ring position is counter % cap.
+  std::atomic<size_t> head = 0;
+  std::atomic<size_t> tail = 0;
+};
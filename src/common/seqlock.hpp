@@ -0,0 +1,57 @@
+#pragma once
+#include <array>
+#include <atomic>
+#include <cstdint>
+#include <cstring>
+#include <type_traits>
+
+// Sequence lock for publishing a small trivially copyable value from a
+// single writer thread to any number of readers. Readers never block the
+// writer, they retry if a write raced with their copy.
+template <typename T> class SeqLock {
+  static_assert(std::is_trivially_copyable<T>::value,
+                "SeqLock value must be trivially copyable");
+
+public:
+  SeqLock() { store(T{}); }
+
+  void store(const T &value) {
+    std::array<uint64_t, word_count> tmp{};
+    std::memcpy(tmp.data(), &value, sizeof(T));
+
+    const uint32_t s = seq.load(std::memory_order_relaxed);
+    seq.store(s + 1, std::memory_order_relaxed);
+    std::atomic_thread_fence(std::memory_order_release);
+
+    for (size_t i = 0; i < word_count; i++) {
+      words[i].store(tmp[i], std::memory_order_relaxed);
+    }
+
+    seq.store(s + 2, std::memory_order_release);
+  }
+
+  T load() const {
+    std::array<uint64_t, word_count> tmp;
+    uint32_t before, after;
+
+    do {
+      before = seq.load(std::memory_order_acquire);
+      for (size_t i = 0; i < word_count; i++) {
+        tmp[i] = words[i].load(std::memory_order_relaxed);
+      }
+      std::atomic_thread_fence(std::memory_order_acquire);
+      after = seq.load(std::memory_order_relaxed);
+    } while (before != after || (before & 1));
+
+    T value;
+    std::memcpy(&value, tmp.data(), sizeof(T));
+    return value;
+  }
+
+private:
+  static constexpr size_t word_count =
+      (sizeof(T) + sizeof(uint64_t) - 1) / sizeof(uint64_t);
+
+  std::atomic<uint32_t> seq = 0;
+  std::array<std::atomic<uint64_t>, word_count> words{};
+};
@@ -0,0 +1,85 @@
+#include "stmt_cache.hpp"
+
+StmtCache::StmtCache(size_t capacity__)
+    : capacity(capacity__), hits(0), misses(0) {}
+
+StmtCache::~StmtCache() { clear(); }
+
+int StmtCache::prepare(sqlite3 *conn, const std::string &sql,
+                       sqlite3_stmt *&result) {
+  result = nullptr;
+
+  {
+    std::lock_guard<std::mutex> lock(mutex);
+    auto found = idle_by_sql.find(sql);
+    if (found != idle_by_sql.end()) {
+      result = found->second->second;
+      idle.erase(found->second);
+      idle_by_sql.erase(found);
+      in_use.emplace(result, sql);
+      hits++;
+      return SQLITE_OK;
+    }
+    misses++;
+  }
+
+  // Kept across many steps, which PERSISTENT tells SQLite to allocate for.
+  int rc = sqlite3_prepare_v3(conn, sql.c_str(), -1, SQLITE_PREPARE_PERSISTENT,
+                              &result, nullptr);
+  if (rc != SQLITE_OK || !result) {
+    sqlite3_finalize(result);
+    result = nullptr;
+    return rc != SQLITE_OK ? rc : SQLITE_ERROR;
+  }
+
+  std::lock_guard<std::mutex> lock(mutex);
+  in_use.emplace(result, sql);
+  return SQLITE_OK;
+}
+
+void StmtCache::finalize(sqlite3_stmt *stmt) {
+  if (!stmt)
+    return;
+
+  std::lock_guard<std::mutex> lock(mutex);
+  auto found = in_use.find(stmt);
+  if (found == in_use.end()) {
+    sqlite3_finalize(stmt);
+    return;
+  }
+
+  std::string sql = std::move(found->second);
+  in_use.erase(found);
+
+  // A second copy from concurrent use is not worth keeping.
+  if (capacity == 0 || idle_by_sql.count(sql)) {
+    sqlite3_finalize(stmt);
+    return;
+  }
+
+  sqlite3_reset(stmt);
+  sqlite3_clear_bindings(stmt);
+
+  idle.emplace_front(sql, stmt);
+  idle_by_sql.emplace(std::move(sql), idle.begin());
+
+  if (idle.size() > capacity) {
+    sqlite3_finalize(idle.back().second);
+    idle_by_sql.erase(idle.back().first);
+    idle.pop_back();
+  }
+}
+
+void StmtCache::clear() {
+  std::lock_guard<std::mutex> lock(mutex);
+  for (Entry &entry : idle) {
+    sqlite3_finalize(entry.second);
+  }
+  idle.clear();
+  idle_by_sql.clear();
+}
+
+StmtCacheStats StmtCache::get_stats() {
+  std::lock_guard<std::mutex> lock(mutex);
+  return StmtCacheStats{hits, misses, idle.size()};
+}
@@ -0,0 +1,52 @@
+#pragma once
+#include <cstdint>
+#include <list>
+#include <mutex>
+#include <sqlite3.h>
+#include <string>
+#include <unordered_map>
+#include <utility>
+
+struct StmtCacheStats {
+  std::uint64_t hits = 0;
+  std::uint64_t misses = 0;
+  size_t cached = 0;
+};
+
+// Prepared statements of one connection, keyed by their SQL text.
+//
+// prepare() hands out an idle statement for that SQL, or prepares a new one,
+// and the caller owns it until finalize() gives it back: it is then reset,
+// its bindings cleared, and kept for the next prepare(). So one query running
+// twice at once gets two statements. At most `capacity` idle statements are
+// kept, the least recently returned are finalized first.
+class StmtCache {
+public:
+  explicit StmtCache(size_t capacity__ = 64);
+  ~StmtCache();
+
+  StmtCache(const StmtCache &) = delete;
+  StmtCache &operator=(const StmtCache &) = delete;
+
+  // Same result codes as sqlite3_prepare_v3, `result` is nullptr on error.
+  int prepare(sqlite3 *conn, const std::string &sql, sqlite3_stmt *&result);
+  // Takes back a statement from prepare(), nullptr is ignored.
+  void finalize(sqlite3_stmt *stmt);
+  // Finalizes the idle statements. Must run before the connection is closed,
+  // with none handed out.
+  void clear();
+
+  StmtCacheStats get_stats();
+
+private:
+  using Entry = std::pair<std::string, sqlite3_stmt *>;
+
+  size_t capacity;
+  std::mutex mutex;
+  // Most recently returned first.
+  std::list<Entry> idle;
+  std::unordered_map<std::string, std::list<Entry>::iterator> idle_by_sql;
+  std::unordered_map<sqlite3_stmt *, std::string> in_use;
+  std::uint64_t hits;
+  std::uint64_t misses;
+};
@@ -1,6 +1,8 @@
 #pragma once
+#include <cstdint>
 #include <filesystem>
 #include <string>
+#include <unordered_map>
 #include <vector>
 
 namespace Enum {
@@ -14,6 +16,9 @@ enum class FileType {
 
 enum class OutputType {
   ALSA = 0,
+  NULL_SINK,
+  WAV_FILE,
+  RAW_FILE,
 };
 
 enum class DecoderType {
@@ -21,12 +26,35 @@ enum class DecoderType {
   UNKNOWN,
 };
 
+enum class PlaybackState {
+  STOPPED = 0,
+  PLAYING,
+  PAUSED,
+};
+
 enum class OutputDeviceType {
   DEFAULT = 0,
   PULSE,
   UNKNOWN,
 };
 
+enum class OutputAccess {
+  RW = 0,
+  MMAP,
+};
+
+enum class LatencyProfile {
+  DEFAULT = 0,
+  LOW_LATENCY,
+  POWER_SAVING,
+};
+
+enum class ScanState {
+  RUNNING = 0,
+  CANCELLED,
+  FINISHED,
+};
+
 }; // namespace Enum
 
 namespace Entity {
@@ -58,6 +86,8 @@ struct File {
   int bitrate;
   unsigned int filesize;
   Enum::FileType filetype;
+  // 0 until computed, see file_fingerprint().
+  std::uint64_t fingerprint = 0;
 
   File() = default;
   File(int id__, int dir_id__, std::filesystem::path filename__,
@@ -84,6 +114,7 @@ struct FileMainProps {
   std::int64_t modified_time;
   unsigned int filesize;
   Enum::FileType filetype;
+  std::uint64_t fingerprint = 0;
 
   FileMainProps() = default;
   FileMainProps(int id__, int dir_id__, std::filesystem::path filename__,
@@ -96,15 +127,60 @@ struct FileMainProps {
         filetype(filetype__) {}
 };
 
-struct UnreadFile {
-  std::filesystem::path fullpath;
-  std::filesystem::path fulldir_path;
-  std::filesystem::path filename;
+// Stored files by directory, then filename. The snapshot a scan is diffed
+// against, grouped so a listed directory's leftovers are found directly.
+using FileMainPropsMap =
+    std::unordered_map<std::string,
+                       std::unordered_map<std::string, FileMainProps>>;
+
+// Directory metadata recorded by the last scan that listed it.
+struct ScannedDir {
   int dir_id;
-  std::int64_t created_time;
+  std::filesystem::path path;
+  std::int64_t modified_time_ns;
+  std::uint64_t entry_count;
+
+  ScannedDir() = default;
+  ScannedDir(int dir_id__, std::filesystem::path path__,
+             std::int64_t modified_time_ns__, std::uint64_t entry_count__)
+      : dir_id(dir_id__), path(path__), modified_time_ns(modified_time_ns__),
+        entry_count(entry_count__) {}
+};
+
+// Progress of the last scan of a root. A RUNNING entry at startup means
+// the process died mid-scan, the next scan resumes from its checkpoint.
+struct ScanJournal {
+  int dir_id;
+  Enum::ScanState state;
+  std::int64_t started_time;
+  std::int64_t checkpoint_time;
+  std::uint64_t files_written;
+  std::uint64_t dirs_done;
+
+  ScanJournal() = default;
+  ScanJournal(int dir_id__, Enum::ScanState state__,
+              std::int64_t started_time__, std::int64_t checkpoint_time__,
+              std::uint64_t files_written__, std::uint64_t dirs_done__)
+      : dir_id(dir_id__), state(state__), started_time(started_time__),
+        checkpoint_time(checkpoint_time__), files_written(files_written__),
+        dirs_done(dirs_done__) {}
+};
+
+// Seek index of a file at one mtime and size. No offsets marks a file the
+// index could not be built for, it is not retried until the file changes.
+struct FrameIndex {
+  int file_id;
   std::int64_t modified_time;
   unsigned int filesize;
-  Enum::FileType filetype;
+  std::int64_t step;
+  std::vector<std::int64_t> offsets;
+
+  FrameIndex() = default;
+  FrameIndex(int file_id__, std::int64_t modified_time__,
+             unsigned int filesize__, std::int64_t step__,
+             std::vector<std::int64_t> offsets__)
+      : file_id(file_id__), modified_time(modified_time__),
+        filesize(filesize__), step(step__), offsets(offsets__) {}
 };
 
 struct Track {
@@ -172,6 +248,30 @@ struct FormatInfo {
   int is_bigendian;
 };
 
+// Device buffer geometry requested for a latency profile.
+struct LatencyParams {
+  unsigned int buffer_us;
+  unsigned int period_us;
+};
+
+// Buffer geometry the device actually accepted, in frames at `rate`.
+struct BufferInfo {
+  unsigned int rate;
+  std::uint64_t buffer_frames;
+  std::uint64_t period_frames;
+};
+
+constexpr LatencyParams latency_params(Enum::LatencyProfile profile) {
+  switch (profile) {
+  case Enum::LatencyProfile::LOW_LATENCY:
+    return {20 * 1000, 5 * 1000};
+  case Enum::LatencyProfile::POWER_SAVING:
+    return {2000 * 1000, 500 * 1000};
+  default:
+    return {300 * 1000, 50 * 1000};
+  }
+}
+
 }; // namespace Audio
 
 inline std::ostream &operator<<(std::ostream &os, const Entity::File &f) {
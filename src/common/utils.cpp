@@ -60,3 +60,13 @@ std::int64_t get_file_mtime_epoch(const std::filesystem::path &path) {
              sctp.time_since_epoch())
       .count();
 }
+
+bool is_path_within(const std::filesystem::path &path,
+                    const std::filesystem::path &root) {
+  const std::string &p = path.native();
+  const std::string &r = root.native();
+  if (r.empty() || p.compare(0, r.size(), r) != 0) {
+    return false;
+  }
+  return p.size() == r.size() || r.back() == '/' || p[r.size()] == '/';
+}
@@ -16,3 +16,7 @@ std::optional<std::string> read_nullable_string_column(sqlite3_stmt *stmt,
 std::optional<int> read_nullable_int_column(sqlite3_stmt *stmt, int index);
 
 std::int64_t get_file_mtime_epoch(const std::filesystem::path &path);
+
+// True if `path` is `root` or lies below it, compared lexically.
+bool is_path_within(const std::filesystem::path &path,
+                    const std::filesystem::path &root);
@@ -4,37 +4,237 @@
 #include "common/utils.hpp"
 #include <algorithm>
 #include <array>
+#include <cstring>
 #include <filesystem>
 #include <iostream>
 #include <sqlite3.h>
 #include <string>
 
-DB::DB(const std::string &db_name) : db(nullptr) {
-  if (sqlite3_open(db_name.c_str(), &db) != SQLITE_OK) {
+// Enough for the UI, the watcher and the indexer to query at once.
+static constexpr int reader_count = 4;
+// How long a connection retries on a lock held by another process.
+static constexpr int busy_timeout_ms = 5000;
+
+DB::DB(const std::string &db_name) : db_name(db_name) {
+  if (!writer.open(db_name, SQLITE_OPEN_READWRITE | SQLITE_OPEN_CREATE)) {
+    return;
+  }
+
+  // Without WAL, as for in-memory databases, every call uses the writer.
+  bool wal = enable_wal();
+
+  if (setup_tables() != DBRetCode::SetupTablesRes::Success) {
+    std::cerr << "Could not create database tables: "
+              << sqlite3_errmsg(writer.db) << "\n";
+
+    writer.close();
+    return;
+  }
+
+  if (wal) {
+    open_readers();
+  }
+}
+
+DB::~DB() {
+  readers.clear();
+  writer.close();
+}
+
+bool DB::is_initialized() { return writer.db != nullptr; }
+
+StmtCacheStats DB::get_stmt_cache_stats() {
+  StmtCacheStats result = writer.stmts.get_stats();
+  for (const std::unique_ptr<Connection> &reader : readers) {
+    StmtCacheStats stats = reader->stmts.get_stats();
+    result.hits += stats.hits;
+    result.misses += stats.misses;
+    result.cached += stats.cached;
+  }
+  return result;
+}
+
+DB::Connection::~Connection() { close(); }
+
+// Each connection is only used by the thread holding its lease, so SQLite's
+// own locking is not needed.
+bool DB::Connection::open(const std::string &path, int flags) {
+  if (sqlite3_open_v2(path.c_str(), &db, flags | SQLITE_OPEN_NOMUTEX,
+                      nullptr) != SQLITE_OK) {
     std::cerr << "Cannot open database: " << sqlite3_errmsg(db) << "\n";
+    sqlite3_close(db);
     db = nullptr;
+    return false;
   }
 
+  sqlite3_busy_timeout(db, busy_timeout_ms);
+  return true;
+}
+
+void DB::Connection::close() {
   if (db) {
-    if (setup_tables() != DBRetCode::SetupTablesRes::Success) {
-      std::cerr << "Could not create database tables: " << sqlite3_errmsg(db)
-                << "\n";
+    stmts.clear();
+    sqlite3_close(db);
+    db = nullptr;
+  }
+}
 
-      sqlite3_close(db);
-      db = nullptr;
-    }
+int DB::Connection::prepare(const std::string &sql, sqlite3_stmt *&result) {
+  return stmts.prepare(db, sql, result);
+}
+
+void DB::Connection::finalize(sqlite3_stmt *stmt) { stmts.finalize(stmt); }
+
+DB::Lease::Lease(DB &owner__, Access access)
+    : owner(owner__), conn(nullptr) {
+  if (access == Access::Read && !owner.readers.empty()) {
+    std::unique_lock<std::mutex> lock(owner.readers_mtx);
+    owner.readers_cv.wait(lock, [this]() {
+      return !owner.idle_readers.empty();
+    });
+    conn = owner.idle_readers.back();
+    owner.idle_readers.pop_back();
+    return;
   }
+
+  write_lock = std::unique_lock<std::mutex>(owner.write_mtx);
+  conn = &owner.writer;
 }
 
-DB::~DB() {
-  if (db)
-    sqlite3_close(db);
+DB::Lease::~Lease() {
+  if (write_lock.owns_lock()) {
+    return;
+  }
+
+  {
+    std::lock_guard<std::mutex> lock(owner.readers_mtx);
+    owner.idle_readers.push_back(conn);
+  }
+  owner.readers_cv.notify_one();
+}
+
+// WAL lets the readers go on while the writer holds a transaction, and
+// NORMAL sync is still safe with it, only a power loss can drop the last
+// commits. Reports whether the database uses WAL.
+bool DB::enable_wal() {
+  sqlite3_stmt *stmt = nullptr;
+  if (writer.prepare("PRAGMA journal_mode=WAL;", stmt) != SQLITE_OK) {
+    PRINT_SQLITE_ERR(writer.db);
+    return false;
+  }
+
+  bool wal = false;
+  if (sqlite3_step(stmt) == SQLITE_ROW) {
+    const unsigned char *mode = sqlite3_column_text(stmt, 0);
+    wal = mode && std::strcmp(reinterpret_cast<const char *>(mode), "wal") == 0;
+  }
+  writer.finalize(stmt);
+
+  return wal && writer.exec("PRAGMA synchronous=NORMAL;");
 }
 
-bool DB::is_initialized() { return db != nullptr; }
+// A reader that cannot be opened is left out, fewer queries run at once.
+void DB::open_readers() {
+  for (int i = 0; i < reader_count; i++) {
+    auto reader = std::make_unique<Connection>();
+    if (!reader->open(db_name, SQLITE_OPEN_READONLY)) {
+      continue;
+    }
+
+    idle_readers.push_back(reader.get());
+    readers.push_back(std::move(reader));
+  }
+}
 
+// Schema changes, oldest first. schema_version holds how many of them a
+// database has applied, the rest run when it is opened, each in one
+// transaction with its version bump. A released step is never edited,
+// changes get a new one.
 DBRetCode::SetupTablesRes DB::setup_tables() {
-  const std::array<std::string, 2> sqls{
+  using Migration = bool (DB::*)();
+  const std::array<Migration, 2> migrations{&DB::migrate_base_tables,
+                                            &DB::migrate_query_indexes};
+
+  if (!writer.exec("CREATE TABLE IF NOT EXISTS schema_version ("
+                   "version INTEGER NOT NULL"
+                   ");")) {
+    return DBRetCode::SetupTablesRes::SqlError;
+  }
+
+  int version = 0;
+  if (!get_schema_version(version)) {
+    return DBRetCode::SetupTablesRes::SqlError;
+  }
+
+  if (version > (int)migrations.size()) {
+    std::cerr << "Database schema version " << version
+              << " is newer than this build supports ("
+              << migrations.size() << ")" << '\n';
+    return DBRetCode::SetupTablesRes::UnknownVersion;
+  }
+
+  for (; version < (int)migrations.size(); version++) {
+    if (!writer.exec("BEGIN IMMEDIATE;")) {
+      return DBRetCode::SetupTablesRes::SqlError;
+    }
+
+    if (!(this->*migrations[version])() || !set_schema_version(version + 1) ||
+        !writer.exec("COMMIT;")) {
+      writer.exec("ROLLBACK;");
+      return DBRetCode::SetupTablesRes::SqlError;
+    }
+  }
+
+  return DBRetCode::SetupTablesRes::Success;
+}
+
+// 0 for a database that has no version yet.
+bool DB::get_schema_version(int &result) {
+  const std::string q = "SELECT MAX(version) FROM schema_version;";
+  sqlite3_stmt *stmt = nullptr;
+  if (writer.prepare(q, stmt) != SQLITE_OK) {
+    PRINT_SQLITE_ERR(writer.db);
+    return false;
+  }
+
+  if (sqlite3_step(stmt) != SQLITE_ROW) {
+    PRINT_SQLITE_ERR(writer.db);
+    writer.finalize(stmt);
+    return false;
+  }
+
+  result = sqlite3_column_int(stmt, 0);
+  writer.finalize(stmt);
+  return true;
+}
+
+bool DB::set_schema_version(int version) {
+  if (!writer.exec("DELETE FROM schema_version;")) {
+    return false;
+  }
+
+  const std::string sql = "INSERT INTO schema_version (version) VALUES (?);";
+  sqlite3_stmt *stmt = nullptr;
+  if (writer.prepare(sql, stmt) != SQLITE_OK) {
+    PRINT_SQLITE_ERR(writer.db);
+    return false;
+  }
+
+  if (sqlite3_bind_int(stmt, 1, version) != SQLITE_OK ||
+      sqlite3_step(stmt) != SQLITE_DONE) {
+    PRINT_SQLITE_ERR(writer.db);
+    writer.finalize(stmt);
+    return false;
+  }
+
+  writer.finalize(stmt);
+  return true;
+}
+
+// Version 1: the tables. Databases from before versioning may miss the
+// later additions to them, which are checked for and added.
+bool DB::migrate_base_tables() {
+  const std::array<std::string, 5> sqls{
       "CREATE TABLE IF NOT EXISTS directories ("
       "id INTEGER PRIMARY KEY AUTOINCREMENT,"
       "path TEXT UNIQUE"
@@ -59,59 +259,194 @@ DBRetCode::SetupTablesRes DB::setup_tables() {
       "bitrate INTEGER NOT NULL,"
       "filesize INTEGER NOT NULL,"
       "filetype INTEGER NOT NULL,"
+      "fingerprint INTEGER NOT NULL DEFAULT 0,"
+      "FOREIGN KEY(dir_id) REFERENCES directories(id)"
+      ");",
+
+      "CREATE TABLE IF NOT EXISTS frame_indexes ("
+      "file_id INTEGER PRIMARY KEY,"
+      "modified_time INTEGER NOT NULL,"
+      "filesize INTEGER NOT NULL,"
+      "step INTEGER NOT NULL,"
+      "offsets BLOB NOT NULL,"
+      "FOREIGN KEY(file_id) REFERENCES files(id)"
+      ");",
+
+      "CREATE TABLE IF NOT EXISTS scanned_dirs ("
+      "path TEXT PRIMARY KEY,"
+      "dir_id INTEGER NOT NULL,"
+      "modified_time_ns INTEGER NOT NULL,"
+      "entry_count INTEGER NOT NULL,"
+      "FOREIGN KEY(dir_id) REFERENCES directories(id)"
+      ");",
+
+      "CREATE TABLE IF NOT EXISTS scan_journal ("
+      "dir_id INTEGER PRIMARY KEY,"
+      "state INTEGER NOT NULL,"
+      "started_time INTEGER NOT NULL,"
+      "checkpoint_time INTEGER NOT NULL,"
+      "files_written INTEGER NOT NULL,"
+      "dirs_done INTEGER NOT NULL,"
       "FOREIGN KEY(dir_id) REFERENCES directories(id)"
       ");"};
 
   for (const std::string &sql : sqls) {
-    sqlite3_stmt *stmt = nullptr;
-    if (sqlite3_prepare_v2(db, sql.c_str(), -1, &stmt, nullptr) != SQLITE_OK) {
-      PRINT_SQLITE_ERR(db);
-      return DBRetCode::SetupTablesRes::SqlError;
+    if (!writer.exec(sql)) {
+      return false;
     }
+  }
 
-    int rc = sqlite3_step(stmt);
-    if (rc != SQLITE_DONE) {
-      PRINT_SQLITE_ERR(db);
-      sqlite3_finalize(stmt);
-      return DBRetCode::SetupTablesRes::SqlError;
+  return add_files_path_index() && add_files_fingerprint();
+}
+
+// Version 2: indexes for what the library views and scans look up. Albums
+// and tracks are filtered on artist or albumartist, then album, and sorted
+// by disc and track; the artist list counts albums from the artist index
+// alone. A root's rows are read by dir_id, or by dir_id and a path range.
+bool DB::migrate_query_indexes() {
+  const std::array<std::string, 3> sqls{
+      "CREATE INDEX IF NOT EXISTS files_dir_idx "
+      "ON files(dir_id, fulldir_path, filename);",
+
+      "CREATE INDEX IF NOT EXISTS files_artist_idx "
+      "ON files(artist, album, disc_number, track_number);",
+
+      "CREATE INDEX IF NOT EXISTS files_albumartist_idx "
+      "ON files(albumartist, album, disc_number, track_number);"};
+
+  for (const std::string &sql : sqls) {
+    if (!writer.exec(sql)) {
+      return false;
     }
+  }
 
-    sqlite3_finalize(stmt);
+  return true;
+}
+
+// Upserts match files on their path, which needs a unique index. Databases
+// created before it existed may hold duplicate rows, those are folded into
+// the oldest one first.
+bool DB::add_files_path_index() {
+  const std::string check_sql = "SELECT COUNT(*) FROM sqlite_master WHERE "
+                                "type = 'index' AND name = 'files_path_idx';";
+  sqlite3_stmt *check_stmt = nullptr;
+  if (writer.prepare(check_sql, check_stmt) != SQLITE_OK) {
+    PRINT_SQLITE_ERR(writer.db);
+    return false;
   }
 
-  return DBRetCode::SetupTablesRes::Success;
+  int rc = sqlite3_step(check_stmt);
+  if (rc != SQLITE_ROW) {
+    PRINT_SQLITE_ERR(writer.db);
+    writer.finalize(check_stmt);
+    return false;
+  }
+
+  int count = sqlite3_column_int(check_stmt, 0);
+  writer.finalize(check_stmt);
+
+  if (count > 0) {
+    return true;
+  }
+
+  const std::array<std::string, 3> sqls{
+      "DELETE FROM files WHERE id NOT IN ("
+      "SELECT MIN(id) FROM files GROUP BY fulldir_path, filename"
+      ");",
+
+      "DELETE FROM frame_indexes WHERE file_id NOT IN (SELECT id FROM files);",
+
+      "CREATE UNIQUE INDEX IF NOT EXISTS files_path_idx "
+      "ON files(fulldir_path, filename);"};
+
+  for (const std::string &sql : sqls) {
+    if (!writer.exec(sql)) {
+      return false;
+    }
+  }
+
+  return true;
+}
+
+// Databases created before fingerprints existed get the column, with 0 for
+// every row: those are filled in as files are rewritten.
+bool DB::add_files_fingerprint() {
+  const std::string check_sql = "SELECT COUNT(*) FROM "
+                                "pragma_table_info('files') "
+                                "WHERE name = 'fingerprint';";
+  sqlite3_stmt *check_stmt = nullptr;
+  if (writer.prepare(check_sql, check_stmt) != SQLITE_OK) {
+    PRINT_SQLITE_ERR(writer.db);
+    return false;
+  }
+
+  int rc = sqlite3_step(check_stmt);
+  if (rc != SQLITE_ROW) {
+    PRINT_SQLITE_ERR(writer.db);
+    writer.finalize(check_stmt);
+    return false;
+  }
+
+  int count = sqlite3_column_int(check_stmt, 0);
+  writer.finalize(check_stmt);
+
+  if (count == 0 && !writer.exec("ALTER TABLE files ADD COLUMN "
+                                 "fingerprint INTEGER NOT NULL DEFAULT 0;")) {
+    return false;
+  }
+
+  return writer.exec("CREATE INDEX IF NOT EXISTS files_fingerprint_idx "
+                     "ON files(dir_id, fingerprint);");
+}
+
+bool DB::Connection::exec(const std::string &sql) {
+  sqlite3_stmt *stmt = nullptr;
+  if (prepare(sql, stmt) != SQLITE_OK) {
+    PRINT_SQLITE_ERR(db);
+    return false;
+  }
+
+  int rc = sqlite3_step(stmt);
+  finalize(stmt);
+
+  if (rc != SQLITE_DONE) {
+    PRINT_SQLITE_ERR(db);
+    return false;
+  }
+
+  return true;
 }
 
 DBRetCode::AddDirRes DB::add_directory(const std::filesystem::path &path,
                                        int &result_id) {
-  if (!db)
+  Lease conn(*this, Access::Write);
+  if (!conn)
     return DBRetCode::AddDirRes::SqlError;
 
   const std::string check_sql =
       "SELECT COUNT(*) FROM directories WHERE path = ?;";
   sqlite3_stmt *check_stmt = nullptr;
-  if (sqlite3_prepare_v2(db, check_sql.c_str(), -1, &check_stmt, nullptr) !=
-      SQLITE_OK) {
-    PRINT_SQLITE_ERR(db);
+  if (conn->prepare(check_sql, check_stmt) != SQLITE_OK) {
+    PRINT_SQLITE_ERR(conn->db);
     return DBRetCode::AddDirRes::SqlError;
   }
 
   if (sqlite3_bind_text(check_stmt, 1, path.c_str(), -1, SQLITE_STATIC) !=
       SQLITE_OK) {
-    PRINT_SQLITE_ERR(db);
-    sqlite3_finalize(check_stmt);
+    PRINT_SQLITE_ERR(conn->db);
+    conn->finalize(check_stmt);
     return DBRetCode::AddDirRes::SqlError;
   }
 
   int rc = sqlite3_step(check_stmt);
   if (rc != SQLITE_ROW) {
-    PRINT_SQLITE_ERR(db);
-    sqlite3_finalize(check_stmt);
+    PRINT_SQLITE_ERR(conn->db);
+    conn->finalize(check_stmt);
     return DBRetCode::AddDirRes::SqlError;
   }
 
   int count = sqlite3_column_int(check_stmt, 0);
-  sqlite3_finalize(check_stmt);
+  conn->finalize(check_stmt);
 
   if (count > 0) {
     return DBRetCode::AddDirRes::PathAlreadyExists;
@@ -119,44 +454,44 @@ DBRetCode::AddDirRes DB::add_directory(const std::filesystem::path &path,
 
   const std::string insert_sql = "INSERT INTO directories (path) VALUES (?);";
   sqlite3_stmt *insert_stmt = nullptr;
-  if (sqlite3_prepare_v2(db, insert_sql.c_str(), -1, &insert_stmt, nullptr) !=
-      SQLITE_OK) {
-    PRINT_SQLITE_ERR(db);
+  if (conn->prepare(insert_sql, insert_stmt) != SQLITE_OK) {
+    PRINT_SQLITE_ERR(conn->db);
     return DBRetCode::AddDirRes::SqlError;
   }
 
   if (sqlite3_bind_text(insert_stmt, 1, path.c_str(), -1, SQLITE_STATIC) !=
       SQLITE_OK) {
-    PRINT_SQLITE_ERR(db);
-    sqlite3_finalize(insert_stmt);
+    PRINT_SQLITE_ERR(conn->db);
+    conn->finalize(insert_stmt);
     return DBRetCode::AddDirRes::SqlError;
   }
 
   rc = sqlite3_step(insert_stmt);
 
-  sqlite3_finalize(insert_stmt);
+  conn->finalize(insert_stmt);
 
   if (rc != SQLITE_DONE) {
-    PRINT_SQLITE_ERR(db);
+    PRINT_SQLITE_ERR(conn->db);
     return DBRetCode::AddDirRes::SqlError;
   }
 
-  result_id = static_cast<int>(sqlite3_last_insert_rowid(db));
+  result_id = static_cast<int>(sqlite3_last_insert_rowid(conn->db));
 
   return DBRetCode::AddDirRes::Success;
 }
 
 DBRetCode::GetDirRes
 DB::get_directories_map(std::map<int, Entity::Directory> &result) {
-  if (!db)
+  Lease conn(*this, Access::Read);
+  if (!conn)
     return DBRetCode::GetDirRes::SqlError;
 
   result.clear();
 
   const std::string q = "SELECT * FROM directories;";
   sqlite3_stmt *stmt = nullptr;
-  if (sqlite3_prepare_v2(db, q.c_str(), -1, &stmt, nullptr) != SQLITE_OK) {
-    PRINT_SQLITE_ERR(db);
+  if (conn->prepare(q, stmt) != SQLITE_OK) {
+    PRINT_SQLITE_ERR(conn->db);
     return DBRetCode::GetDirRes::SqlError;
   }
 
@@ -169,43 +504,43 @@ DB::get_directories_map(std::map<int, Entity::Directory> &result) {
     result[id] = Entity::Directory{id, path};
   }
 
-  sqlite3_finalize(stmt);
+  conn->finalize(stmt);
 
   return DBRetCode::GetDirRes::Success;
 }
 
 DBRetCode::GetDirRes
 DB::get_directories_list(std::vector<Entity::Directory> &result) {
-  if (!db)
+  Lease conn(*this, Access::Read);
+  if (!conn)
     return DBRetCode::GetDirRes::SqlError;
 
   result.clear();
 
   const std::string count_q = "SELECT COUNT(*) FROM directories;";
   sqlite3_stmt *count_stmt = nullptr;
-  if (sqlite3_prepare_v2(db, count_q.c_str(), -1, &count_stmt, nullptr) !=
-      SQLITE_OK) {
-    PRINT_SQLITE_ERR(db);
+  if (conn->prepare(count_q, count_stmt) != SQLITE_OK) {
+    PRINT_SQLITE_ERR(conn->db);
     return DBRetCode::GetDirRes::SqlError;
   }
 
   int rc = sqlite3_step(count_stmt);
   if (rc != SQLITE_ROW) {
-    PRINT_SQLITE_ERR(db);
-    sqlite3_finalize(count_stmt);
+    PRINT_SQLITE_ERR(conn->db);
+    conn->finalize(count_stmt);
     return DBRetCode::GetDirRes::SqlError;
   }
 
   int count = sqlite3_column_int(count_stmt, 0);
 
-  sqlite3_finalize(count_stmt);
+  conn->finalize(count_stmt);
 
   result.reserve(count);
 
   const std::string q = "SELECT * FROM directories;";
   sqlite3_stmt *stmt = nullptr;
-  if (sqlite3_prepare_v2(db, q.c_str(), -1, &stmt, nullptr) != SQLITE_OK) {
-    PRINT_SQLITE_ERR(db);
+  if (conn->prepare(q, stmt) != SQLITE_OK) {
+    PRINT_SQLITE_ERR(conn->db);
     return DBRetCode::GetDirRes::SqlError;
   }
 
@@ -218,31 +553,32 @@ DB::get_directories_list(std::vector<Entity::Directory> &result) {
     result.emplace_back(id, std::move(path));
   }
 
-  sqlite3_finalize(stmt);
+  conn->finalize(stmt);
 
   return DBRetCode::GetDirRes::Success;
 }
 
 DBRetCode::GetDirRes DB::get_directory(int id, Entity::Directory &result) {
-  if (!db)
+  Lease conn(*this, Access::Read);
+  if (!conn)
     return DBRetCode::GetDirRes::SqlError;
 
   const std::string q = "SELECT * FROM directories WHERE id = ?;";
   sqlite3_stmt *stmt = nullptr;
-  if (sqlite3_prepare_v2(db, q.c_str(), -1, &stmt, nullptr) != SQLITE_OK) {
-    PRINT_SQLITE_ERR(db);
+  if (conn->prepare(q, stmt) != SQLITE_OK) {
+    PRINT_SQLITE_ERR(conn->db);
     return DBRetCode::GetDirRes::SqlError;
   }
 
   if (sqlite3_bind_int(stmt, 1, id) != SQLITE_OK) {
-    PRINT_SQLITE_ERR(db);
-    sqlite3_finalize(stmt);
+    PRINT_SQLITE_ERR(conn->db);
+    conn->finalize(stmt);
     return DBRetCode::GetDirRes::SqlError;
   }
 
   int rc = sqlite3_step(stmt);
   if (rc != SQLITE_ROW) {
-    sqlite3_finalize(stmt);
+    conn->finalize(stmt);
 
     return DBRetCode::GetDirRes::NotFound;
   }
@@ -251,81 +587,88 @@ DBRetCode::GetDirRes DB::get_directory(int id, Entity::Directory &result) {
   const unsigned char *path_text = sqlite3_column_text(stmt, 1);
   result.path = path_text ? reinterpret_cast<const char *>(path_text) : "";
 
-  sqlite3_finalize(stmt);
+  conn->finalize(stmt);
 
   return DBRetCode::GetDirRes::Success;
 }
 
 DBRetCode::RmvDirRes DB::remove_directory(int id) {
-  if (!db)
+  Lease conn(*this, Access::Write);
+  if (!conn)
     return DBRetCode::RmvDirRes::SqlError;
 
-  const std::string sql = "DELETE FROM directories WHERE id = ?;";
-  sqlite3_stmt *stmt = nullptr;
-  if (sqlite3_prepare_v2(db, sql.c_str(), -1, &stmt, nullptr) != SQLITE_OK) {
-    PRINT_SQLITE_ERR(db);
-    return DBRetCode::RmvDirRes::SqlError;
-  }
+  const std::array<std::string, 3> sqls{
+      "DELETE FROM scanned_dirs WHERE dir_id = ?;",
+      "DELETE FROM scan_journal WHERE dir_id = ?;",
+      "DELETE FROM directories WHERE id = ?;"};
 
-  if (sqlite3_bind_int(stmt, 1, id) != SQLITE_OK) {
-    PRINT_SQLITE_ERR(db);
-    sqlite3_finalize(stmt);
-    return DBRetCode::RmvDirRes::SqlError;
-  }
+  for (const std::string &sql : sqls) {
+    sqlite3_stmt *stmt = nullptr;
+    if (conn->prepare(sql, stmt) != SQLITE_OK) {
+      PRINT_SQLITE_ERR(conn->db);
+      return DBRetCode::RmvDirRes::SqlError;
+    }
 
-  int rc = sqlite3_step(stmt);
-  sqlite3_finalize(stmt);
+    if (sqlite3_bind_int(stmt, 1, id) != SQLITE_OK) {
+      PRINT_SQLITE_ERR(conn->db);
+      conn->finalize(stmt);
+      return DBRetCode::RmvDirRes::SqlError;
+    }
 
-  if (rc != SQLITE_DONE) {
-    PRINT_SQLITE_ERR(db);
-    return DBRetCode::RmvDirRes::SqlError;
+    int rc = sqlite3_step(stmt);
+    conn->finalize(stmt);
+
+    if (rc != SQLITE_DONE) {
+      PRINT_SQLITE_ERR(conn->db);
+      return DBRetCode::RmvDirRes::SqlError;
+    }
   }
 
   return DBRetCode::RmvDirRes::Success;
 }
 
 DBRetCode::AddFileRes DB::add_file(const Entity::File &file, int &result_id) {
-  if (!db)
+  Lease conn(*this, Access::Write);
+  if (!conn)
     return DBRetCode::AddFileRes::SqlError;
 
   const std::string check_sql = "SELECT COUNT(*) FROM files WHERE dir_id = ? "
                                 "AND fulldir_path = ? AND filename = ?;";
   sqlite3_stmt *check_stmt = nullptr;
-  if (sqlite3_prepare_v2(db, check_sql.c_str(), -1, &check_stmt, nullptr) !=
-      SQLITE_OK) {
-    PRINT_SQLITE_ERR(db);
+  if (conn->prepare(check_sql, check_stmt) != SQLITE_OK) {
+    PRINT_SQLITE_ERR(conn->db);
     return DBRetCode::AddFileRes::SqlError;
   }
 
   if (sqlite3_bind_int(check_stmt, 1, file.dir_id) != SQLITE_OK) {
-    PRINT_SQLITE_ERR(db);
-    sqlite3_finalize(check_stmt);
+    PRINT_SQLITE_ERR(conn->db);
+    conn->finalize(check_stmt);
     return DBRetCode::AddFileRes::SqlError;
   }
 
   if (sqlite3_bind_text(check_stmt, 2, file.fulldir_path.c_str(), -1,
                         SQLITE_STATIC) != SQLITE_OK) {
-    PRINT_SQLITE_ERR(db);
-    sqlite3_finalize(check_stmt);
+    PRINT_SQLITE_ERR(conn->db);
+    conn->finalize(check_stmt);
     return DBRetCode::AddFileRes::SqlError;
   }
 
   if (sqlite3_bind_text(check_stmt, 3, file.filename.c_str(), -1,
                         SQLITE_STATIC) != SQLITE_OK) {
-    PRINT_SQLITE_ERR(db);
-    sqlite3_finalize(check_stmt);
+    PRINT_SQLITE_ERR(conn->db);
+    conn->finalize(check_stmt);
     return DBRetCode::AddFileRes::SqlError;
   }
 
   int rc = sqlite3_step(check_stmt);
   if (rc != SQLITE_ROW) {
-    PRINT_SQLITE_ERR(db);
-    sqlite3_finalize(check_stmt);
+    PRINT_SQLITE_ERR(conn->db);
+    conn->finalize(check_stmt);
     return DBRetCode::AddFileRes::SqlError;
   }
 
   int count = sqlite3_column_int(check_stmt, 0);
-  sqlite3_finalize(check_stmt);
+  conn->finalize(check_stmt);
 
   if (count > 0) {
     return DBRetCode::AddFileRes::FileAlreadyExists;
@@ -339,9 +682,8 @@ DBRetCode::AddFileRes DB::add_file(const Entity::File &file, int &result_id) {
       "filesize, filetype, created_time, modified_time"
       ") VALUES (?,?,?,?,?,?,?,?,?,?,?,?,?,?,?,?,?);";
   sqlite3_stmt *insert_stmt = nullptr;
-  if (sqlite3_prepare_v2(db, insert_sql.c_str(), -1, &insert_stmt, nullptr) !=
-      SQLITE_OK) {
-    PRINT_SQLITE_ERR(db);
+  if (conn->prepare(insert_sql, insert_stmt) != SQLITE_OK) {
+    PRINT_SQLITE_ERR(conn->db);
     return DBRetCode::AddFileRes::SqlError;
   }
 
@@ -371,69 +713,181 @@ DBRetCode::AddFileRes DB::add_file(const Entity::File &file, int &result_id) {
       sqlite3_bind_int(insert_stmt, idx++, (int)file.filetype) != SQLITE_OK ||
       sqlite3_bind_int(insert_stmt, idx++, file.created_time) != SQLITE_OK ||
       sqlite3_bind_int(insert_stmt, idx++, file.modified_time) != SQLITE_OK) {
-    PRINT_SQLITE_ERR(db);
-    sqlite3_finalize(insert_stmt);
+    PRINT_SQLITE_ERR(conn->db);
+    conn->finalize(insert_stmt);
     return DBRetCode::AddFileRes::SqlError;
   }
 
   rc = sqlite3_step(insert_stmt);
 
-  sqlite3_finalize(insert_stmt);
+  conn->finalize(insert_stmt);
 
   if (rc != SQLITE_DONE) {
-    PRINT_SQLITE_ERR(db);
+    PRINT_SQLITE_ERR(conn->db);
     return DBRetCode::AddFileRes::SqlError;
   }
 
-  result_id = static_cast<int>(sqlite3_last_insert_rowid(db));
+  result_id = static_cast<int>(sqlite3_last_insert_rowid(conn->db));
 
   return DBRetCode::AddFileRes::Success;
 }
 
+DBRetCode::UpsertFilesRes
+DB::upsert_files(const std::vector<Entity::File> &files, int batch_size,
+                 std::vector<int> &result_ids) {
+  Lease conn(*this, Access::Write);
+  if (!conn)
+    return DBRetCode::UpsertFilesRes::SqlError;
+
+  result_ids.clear();
+  result_ids.reserve(files.size());
+
+  if (batch_size <= 0) {
+    batch_size = files.size();
+  }
+
+  const std::string sql =
+      "INSERT INTO files ("
+      "dir_id, fulldir_path, filename, title, album,"
+      "artist, albumartist, track_number,"
+      "disc_number, year, genre, length, bitrate,"
+      "filesize, filetype, created_time, modified_time, fingerprint"
+      ") VALUES (?,?,?,?,?,?,?,?,?,?,?,?,?,?,?,?,?,?) "
+      "ON CONFLICT(fulldir_path, filename) DO UPDATE SET "
+      "modified_time = excluded.modified_time, title = excluded.title, "
+      "album = excluded.album, artist = excluded.artist, "
+      "albumartist = excluded.albumartist, "
+      "track_number = excluded.track_number, "
+      "disc_number = excluded.disc_number, year = excluded.year, "
+      "genre = excluded.genre, length = excluded.length, "
+      "bitrate = excluded.bitrate, filesize = excluded.filesize, "
+      "fingerprint = excluded.fingerprint "
+      "RETURNING id;";
+  sqlite3_stmt *stmt = nullptr;
+  if (conn->prepare(sql, stmt) != SQLITE_OK) {
+    PRINT_SQLITE_ERR(conn->db);
+    return DBRetCode::UpsertFilesRes::SqlError;
+  }
+
+  int in_batch = 0;
+
+  for (const Entity::File &file : files) {
+    if (in_batch == 0 && !conn->exec("BEGIN IMMEDIATE;")) {
+      conn->finalize(stmt);
+      return DBRetCode::UpsertFilesRes::SqlError;
+    }
+
+    int idx = 1;
+
+    if (sqlite3_bind_int(stmt, idx++, file.dir_id) != SQLITE_OK ||
+        sqlite3_bind_text(stmt, idx++, file.fulldir_path.c_str(), -1,
+                          SQLITE_STATIC) != SQLITE_OK ||
+        sqlite3_bind_text(stmt, idx++, file.filename.c_str(), -1,
+                          SQLITE_STATIC) != SQLITE_OK ||
+        sqlite3_bind_text(stmt, idx++, file.title.c_str(), -1,
+                          SQLITE_STATIC) != SQLITE_OK ||
+        sqlite3_bind_text(stmt, idx++, file.album.c_str(), -1,
+                          SQLITE_STATIC) != SQLITE_OK ||
+        sqlite3_bind_text(stmt, idx++, file.artist.c_str(), -1,
+                          SQLITE_STATIC) != SQLITE_OK ||
+        sqlite3_bind_text(stmt, idx++, file.albumartist.c_str(), -1,
+                          SQLITE_STATIC) != SQLITE_OK ||
+        sqlite3_bind_int(stmt, idx++, file.track_number) != SQLITE_OK ||
+        sqlite3_bind_int(stmt, idx++, file.disc_number) != SQLITE_OK ||
+        sqlite3_bind_int(stmt, idx++, file.year) != SQLITE_OK ||
+        sqlite3_bind_text(stmt, idx++, file.genre.c_str(), -1,
+                          SQLITE_STATIC) != SQLITE_OK ||
+        sqlite3_bind_int(stmt, idx++, file.length) != SQLITE_OK ||
+        sqlite3_bind_int(stmt, idx++, file.bitrate) != SQLITE_OK ||
+        sqlite3_bind_int(stmt, idx++, file.filesize) != SQLITE_OK ||
+        sqlite3_bind_int(stmt, idx++, (int)file.filetype) != SQLITE_OK ||
+        sqlite3_bind_int(stmt, idx++, file.created_time) != SQLITE_OK ||
+        sqlite3_bind_int(stmt, idx++, file.modified_time) != SQLITE_OK ||
+        sqlite3_bind_int64(stmt, idx++, (sqlite3_int64)file.fingerprint) !=
+            SQLITE_OK) {
+      PRINT_SQLITE_ERR(conn->db);
+      conn->finalize(stmt);
+      conn->exec("ROLLBACK;");
+      return DBRetCode::UpsertFilesRes::SqlError;
+    }
+
+    int rc = sqlite3_step(stmt);
+    if (rc != SQLITE_ROW) {
+      PRINT_SQLITE_ERR(conn->db);
+      conn->finalize(stmt);
+      conn->exec("ROLLBACK;");
+      return DBRetCode::UpsertFilesRes::SqlError;
+    }
+
+    result_ids.push_back(sqlite3_column_int(stmt, 0));
+
+    sqlite3_reset(stmt);
+    sqlite3_clear_bindings(stmt);
+
+    if (++in_batch == batch_size) {
+      in_batch = 0;
+      if (!conn->exec("COMMIT;")) {
+        conn->finalize(stmt);
+        conn->exec("ROLLBACK;");
+        return DBRetCode::UpsertFilesRes::SqlError;
+      }
+    }
+  }
+
+  conn->finalize(stmt);
+
+  if (in_batch > 0 && !conn->exec("COMMIT;")) {
+    conn->exec("ROLLBACK;");
+    return DBRetCode::UpsertFilesRes::SqlError;
+  }
+
+  return DBRetCode::UpsertFilesRes::Success;
+}
+
 DBRetCode::GetFileRes
 DB::get_dir_files_list(int dir_id, std::vector<Entity::File> &result) {
-  if (!db)
+  Lease conn(*this, Access::Read);
+  if (!conn)
     return DBRetCode::GetFileRes::SqlError;
 
   result.clear();
 
   const std::string count_q = "SELECT COUNT(*) FROM files WHERE dir_id = ?;";
   sqlite3_stmt *count_stmt = nullptr;
-  if (sqlite3_prepare_v2(db, count_q.c_str(), -1, &count_stmt, nullptr) !=
-      SQLITE_OK) {
-    PRINT_SQLITE_ERR(db);
+  if (conn->prepare(count_q, count_stmt) != SQLITE_OK) {
+    PRINT_SQLITE_ERR(conn->db);
     return DBRetCode::GetFileRes::SqlError;
   }
 
   if (sqlite3_bind_int(count_stmt, 1, dir_id) != SQLITE_OK) {
-    PRINT_SQLITE_ERR(db);
-    sqlite3_finalize(count_stmt);
+    PRINT_SQLITE_ERR(conn->db);
+    conn->finalize(count_stmt);
     return DBRetCode::GetFileRes::SqlError;
   }
 
   int rc = sqlite3_step(count_stmt);
   if (rc != SQLITE_ROW) {
-    PRINT_SQLITE_ERR(db);
-    sqlite3_finalize(count_stmt);
+    PRINT_SQLITE_ERR(conn->db);
+    conn->finalize(count_stmt);
     return DBRetCode::GetFileRes::SqlError;
   }
 
   int count = sqlite3_column_int(count_stmt, 0);
 
-  sqlite3_finalize(count_stmt);
+  conn->finalize(count_stmt);
 
   result.reserve(count);
 
   const std::string q = "SELECT * FROM files WHERE dir_id = ?;";
   sqlite3_stmt *stmt = nullptr;
-  if (sqlite3_prepare_v2(db, q.c_str(), -1, &stmt, nullptr) != SQLITE_OK) {
-    PRINT_SQLITE_ERR(db);
+  if (conn->prepare(q, stmt) != SQLITE_OK) {
+    PRINT_SQLITE_ERR(conn->db);
     return DBRetCode::GetFileRes::SqlError;
   }
 
   if (sqlite3_bind_int(stmt, 1, dir_id) != SQLITE_OK) {
-    PRINT_SQLITE_ERR(db);
-    sqlite3_finalize(stmt);
+    PRINT_SQLITE_ERR(conn->db);
+    conn->finalize(stmt);
     return DBRetCode::GetFileRes::SqlError;
   }
 
@@ -472,28 +926,29 @@ DB::get_dir_files_list(int dir_id, std::vector<Entity::File> &result) {
                         filesize, filetype);
   }
 
-  sqlite3_finalize(stmt);
+  conn->finalize(stmt);
 
   return DBRetCode::GetFileRes::Success;
 }
 
 DBRetCode::GetFileRes
 DB::get_dir_files_map(int dir_id, std::map<int, Entity::File> &result) {
-  if (!db)
+  Lease conn(*this, Access::Read);
+  if (!conn)
     return DBRetCode::GetFileRes::SqlError;
 
   result.clear();
 
   const std::string q = "SELECT * FROM files WHERE dir_id = ?;";
   sqlite3_stmt *stmt = nullptr;
-  if (sqlite3_prepare_v2(db, q.c_str(), -1, &stmt, nullptr) != SQLITE_OK) {
-    PRINT_SQLITE_ERR(db);
+  if (conn->prepare(q, stmt) != SQLITE_OK) {
+    PRINT_SQLITE_ERR(conn->db);
     return DBRetCode::GetFileRes::SqlError;
   }
 
   if (sqlite3_bind_int(stmt, 1, dir_id) != SQLITE_OK) {
-    PRINT_SQLITE_ERR(db);
-    sqlite3_finalize(stmt);
+    PRINT_SQLITE_ERR(conn->db);
+    conn->finalize(stmt);
     return DBRetCode::GetFileRes::SqlError;
   }
 
@@ -532,81 +987,214 @@ DB::get_dir_files_map(int dir_id, std::map<int, Entity::File> &result) {
         year,  genre,  length,   bitrate,      filesize,     filetype};
   }
 
-  sqlite3_finalize(stmt);
+  conn->finalize(stmt);
 
   return DBRetCode::GetFileRes::Success;
 }
 
 DBRetCode::GetFileRes DB::get_dir_files_main_props(
-    int dir_id,
-    std::map<std::filesystem::path, Entity::FileMainProps> &result) {
-  if (!db)
+    int dir_id, Entity::FileMainPropsMap &result) {
+  Lease conn(*this, Access::Read);
+  if (!conn)
     return DBRetCode::GetFileRes::SqlError;
 
   result.clear();
 
   const std::string q = "SELECT "
                         "id, dir_id, filename, fulldir_path, created_time,"
-                        "modified_time, filesize, filetype"
+                        "modified_time, filesize, filetype, fingerprint"
                         " FROM files WHERE dir_id = ?;";
   sqlite3_stmt *stmt = nullptr;
-  if (sqlite3_prepare_v2(db, q.c_str(), -1, &stmt, nullptr) != SQLITE_OK) {
-    PRINT_SQLITE_ERR(db);
+  if (conn->prepare(q, stmt) != SQLITE_OK) {
+    PRINT_SQLITE_ERR(conn->db);
     return DBRetCode::GetFileRes::SqlError;
   }
 
   if (sqlite3_bind_int(stmt, 1, dir_id) != SQLITE_OK) {
-    PRINT_SQLITE_ERR(db);
-    sqlite3_finalize(stmt);
+    PRINT_SQLITE_ERR(conn->db);
+    conn->finalize(stmt);
+    return DBRetCode::GetFileRes::SqlError;
+  }
+
+  while (sqlite3_step(stmt) == SQLITE_ROW) {
+    int idx = 0;
+
+    int id = sqlite3_column_int(stmt, idx++);
+    int dir_id = sqlite3_column_int(stmt, idx++);
+    std::filesystem::path filename =
+        convert_unsigned_char_ptr_to_string(sqlite3_column_text(stmt, idx++));
+    std::filesystem::path fulldir_path =
+        convert_unsigned_char_ptr_to_string(sqlite3_column_text(stmt, idx++));
+    std::int64_t created_time = sqlite3_column_int(stmt, idx++);
+    std::int64_t modified_time = sqlite3_column_int(stmt, idx++);
+    unsigned int filesize = sqlite3_column_int(stmt, idx++);
+    Enum::FileType filetype = (Enum::FileType)sqlite3_column_int(stmt, idx++);
+
+    Entity::FileMainProps &props =
+        result[fulldir_path.native()][filename.native()];
+    props = Entity::FileMainProps{id,           dir_id,        filename,
+                                  fulldir_path, created_time, modified_time,
+                                  filesize,     filetype};
+    props.fingerprint = (std::uint64_t)sqlite3_column_int64(stmt, idx++);
+  }
+
+  conn->finalize(stmt);
+
+  return DBRetCode::GetFileRes::Success;
+}
+
+DBRetCode::GetFileRes DB::get_files_main_props_in(
+    int dir_id, const std::filesystem::path &fulldir_path, bool recursive,
+    Entity::FileMainPropsMap &result) {
+  Lease conn(*this, Access::Read);
+  if (!conn)
+    return DBRetCode::GetFileRes::SqlError;
+
+  result.clear();
+
+  // Subdirectories sort between "<path>/" and "<path>0", '0' being the
+  // character after '/', which keeps the lookup on the path index.
+  const std::string q = "SELECT "
+                        "id, dir_id, filename, fulldir_path, created_time,"
+                        "modified_time, filesize, filetype, fingerprint"
+                        " FROM files WHERE dir_id = ? AND (fulldir_path = ?"
+                        " OR (fulldir_path >= ? AND fulldir_path < ?));";
+  sqlite3_stmt *stmt = nullptr;
+  if (conn->prepare(q, stmt) != SQLITE_OK) {
+    PRINT_SQLITE_ERR(conn->db);
+    return DBRetCode::GetFileRes::SqlError;
+  }
+
+  const std::string dir = fulldir_path.string();
+  // With an empty range only the directory itself matches.
+  const std::string lower = recursive ? dir + "/" : dir;
+  const std::string upper = recursive ? dir + "0" : dir;
+
+  int param = 1;
+  if (sqlite3_bind_int(stmt, param++, dir_id) != SQLITE_OK ||
+      sqlite3_bind_text(stmt, param++, dir.c_str(), -1, SQLITE_STATIC) !=
+          SQLITE_OK ||
+      sqlite3_bind_text(stmt, param++, lower.c_str(), -1, SQLITE_STATIC) !=
+          SQLITE_OK ||
+      sqlite3_bind_text(stmt, param++, upper.c_str(), -1, SQLITE_STATIC) !=
+          SQLITE_OK) {
+    PRINT_SQLITE_ERR(conn->db);
+    conn->finalize(stmt);
+    return DBRetCode::GetFileRes::SqlError;
+  }
+
+  int rc;
+  while ((rc = sqlite3_step(stmt)) == SQLITE_ROW) {
+    int idx = 0;
+
+    int id = sqlite3_column_int(stmt, idx++);
+    int dir_id = sqlite3_column_int(stmt, idx++);
+    std::filesystem::path filename =
+        convert_unsigned_char_ptr_to_string(sqlite3_column_text(stmt, idx++));
+    std::filesystem::path fulldir_path =
+        convert_unsigned_char_ptr_to_string(sqlite3_column_text(stmt, idx++));
+    std::int64_t created_time = sqlite3_column_int(stmt, idx++);
+    std::int64_t modified_time = sqlite3_column_int(stmt, idx++);
+    unsigned int filesize = sqlite3_column_int(stmt, idx++);
+    Enum::FileType filetype = (Enum::FileType)sqlite3_column_int(stmt, idx++);
+
+    Entity::FileMainProps &props =
+        result[fulldir_path.native()][filename.native()];
+    props = Entity::FileMainProps{id,           dir_id,        filename,
+                                  fulldir_path, created_time, modified_time,
+                                  filesize,     filetype};
+    props.fingerprint = (std::uint64_t)sqlite3_column_int64(stmt, idx++);
+  }
+
+  conn->finalize(stmt);
+
+  if (rc != SQLITE_DONE) {
+    PRINT_SQLITE_ERR(conn->db);
+    return DBRetCode::GetFileRes::SqlError;
+  }
+
+  return DBRetCode::GetFileRes::Success;
+}
+
+DBRetCode::GetFileRes DB::get_files_by_fingerprint(
+    int dir_id, unsigned int filesize, std::uint64_t fingerprint,
+    std::vector<Entity::FileMainProps> &result) {
+  Lease conn(*this, Access::Read);
+  if (!conn)
+    return DBRetCode::GetFileRes::SqlError;
+
+  result.clear();
+
+  const std::string q = "SELECT "
+                        "id, dir_id, filename, fulldir_path, created_time,"
+                        "modified_time, filesize, filetype, fingerprint"
+                        " FROM files WHERE dir_id = ? AND fingerprint = ?"
+                        " AND filesize = ?;";
+  sqlite3_stmt *stmt = nullptr;
+  if (conn->prepare(q, stmt) != SQLITE_OK) {
+    PRINT_SQLITE_ERR(conn->db);
+    return DBRetCode::GetFileRes::SqlError;
+  }
+
+  if (sqlite3_bind_int(stmt, 1, dir_id) != SQLITE_OK ||
+      sqlite3_bind_int64(stmt, 2, (sqlite3_int64)fingerprint) != SQLITE_OK ||
+      sqlite3_bind_int(stmt, 3, filesize) != SQLITE_OK) {
+    PRINT_SQLITE_ERR(conn->db);
+    conn->finalize(stmt);
     return DBRetCode::GetFileRes::SqlError;
   }
 
-  while (sqlite3_step(stmt) == SQLITE_ROW) {
+  int rc;
+  while ((rc = sqlite3_step(stmt)) == SQLITE_ROW) {
     int idx = 0;
 
-    int id = sqlite3_column_int(stmt, idx++);
-    int dir_id = sqlite3_column_int(stmt, idx++);
-    std::filesystem::path filename =
+    Entity::FileMainProps props;
+    props.id = sqlite3_column_int(stmt, idx++);
+    props.dir_id = sqlite3_column_int(stmt, idx++);
+    props.filename =
         convert_unsigned_char_ptr_to_string(sqlite3_column_text(stmt, idx++));
-    std::filesystem::path fulldir_path =
+    props.fulldir_path =
         convert_unsigned_char_ptr_to_string(sqlite3_column_text(stmt, idx++));
-    std::int64_t created_time = sqlite3_column_int(stmt, idx++);
-    std::int64_t modified_time = sqlite3_column_int(stmt, idx++);
-    unsigned int filesize = sqlite3_column_int(stmt, idx++);
-    Enum::FileType filetype = (Enum::FileType)sqlite3_column_int(stmt, idx++);
+    props.created_time = sqlite3_column_int(stmt, idx++);
+    props.modified_time = sqlite3_column_int(stmt, idx++);
+    props.filesize = sqlite3_column_int(stmt, idx++);
+    props.filetype = (Enum::FileType)sqlite3_column_int(stmt, idx++);
+    props.fingerprint = (std::uint64_t)sqlite3_column_int64(stmt, idx++);
 
-    std::filesystem::path fullpath = get_file_fullpath(fulldir_path, filename);
-
-    result[fullpath] = Entity::FileMainProps{
-        id,           dir_id,        filename, fulldir_path,
-        created_time, modified_time, filesize, filetype};
+    result.push_back(std::move(props));
   }
 
-  sqlite3_finalize(stmt);
+  conn->finalize(stmt);
+
+  if (rc != SQLITE_DONE) {
+    PRINT_SQLITE_ERR(conn->db);
+    return DBRetCode::GetFileRes::SqlError;
+  }
 
   return DBRetCode::GetFileRes::Success;
 }
 
 DBRetCode::GetFileRes DB::get_file(int id, Entity::File &result) {
-  if (!db)
+  Lease conn(*this, Access::Read);
+  if (!conn)
     return DBRetCode::GetFileRes::SqlError;
 
   const std::string q = "SELECT * FROM files WHERE id = ?;";
   sqlite3_stmt *stmt = nullptr;
-  if (sqlite3_prepare_v2(db, q.c_str(), -1, &stmt, nullptr) != SQLITE_OK) {
-    PRINT_SQLITE_ERR(db);
+  if (conn->prepare(q, stmt) != SQLITE_OK) {
+    PRINT_SQLITE_ERR(conn->db);
     return DBRetCode::GetFileRes::SqlError;
   }
 
   if (sqlite3_bind_int(stmt, 1, id) != SQLITE_OK) {
-    PRINT_SQLITE_ERR(db);
-    sqlite3_finalize(stmt);
+    PRINT_SQLITE_ERR(conn->db);
+    conn->finalize(stmt);
     return DBRetCode::GetFileRes::SqlError;
   }
 
   int rc = sqlite3_step(stmt);
   if (rc != SQLITE_ROW) {
-    sqlite3_finalize(stmt);
+    conn->finalize(stmt);
 
     return DBRetCode::GetFileRes::NotFound;
   }
@@ -639,7 +1227,7 @@ DBRetCode::GetFileRes DB::get_file(int id, Entity::File &result) {
   result.filesize = sqlite3_column_int(stmt, idx++);
   result.filetype = (Enum::FileType)sqlite3_column_int(stmt, idx++);
 
-  sqlite3_finalize(stmt);
+  conn->finalize(stmt);
 
   return DBRetCode::GetFileRes::Success;
 }
@@ -647,34 +1235,35 @@ DBRetCode::GetFileRes DB::get_file(int id, Entity::File &result) {
 DBRetCode::GetFileRes DB::get_file_by_path(std::filesystem::path fulldir_path,
                                            std::filesystem::path filename,
                                            Entity::File &result) {
-  if (!db)
+  Lease conn(*this, Access::Read);
+  if (!conn)
     return DBRetCode::GetFileRes::SqlError;
 
   const std::string q =
       "SELECT * FROM files WHERE fulldir_path = ? AND filename = ?;";
   sqlite3_stmt *stmt = nullptr;
-  if (sqlite3_prepare_v2(db, q.c_str(), -1, &stmt, nullptr) != SQLITE_OK) {
-    PRINT_SQLITE_ERR(db);
+  if (conn->prepare(q, stmt) != SQLITE_OK) {
+    PRINT_SQLITE_ERR(conn->db);
     return DBRetCode::GetFileRes::SqlError;
   }
 
   if (sqlite3_bind_text(stmt, 1, fulldir_path.c_str(), -1, SQLITE_STATIC) !=
       SQLITE_OK) {
-    PRINT_SQLITE_ERR(db);
-    sqlite3_finalize(stmt);
+    PRINT_SQLITE_ERR(conn->db);
+    conn->finalize(stmt);
     return DBRetCode::GetFileRes::SqlError;
   }
 
   if (sqlite3_bind_text(stmt, 2, filename.c_str(), -1, SQLITE_STATIC) !=
       SQLITE_OK) {
-    PRINT_SQLITE_ERR(db);
-    sqlite3_finalize(stmt);
+    PRINT_SQLITE_ERR(conn->db);
+    conn->finalize(stmt);
     return DBRetCode::GetFileRes::SqlError;
   }
 
   int rc = sqlite3_step(stmt);
   if (rc != SQLITE_ROW) {
-    sqlite3_finalize(stmt);
+    conn->finalize(stmt);
 
     return DBRetCode::GetFileRes::NotFound;
   }
@@ -707,7 +1296,7 @@ DBRetCode::GetFileRes DB::get_file_by_path(std::filesystem::path fulldir_path,
   result.filesize = sqlite3_column_int(stmt, idx++);
   result.filetype = (Enum::FileType)sqlite3_column_int(stmt, idx++);
 
-  sqlite3_finalize(stmt);
+  conn->finalize(stmt);
 
   return DBRetCode::GetFileRes::Success;
 }
@@ -716,7 +1305,7 @@ DBRetCode::GetFileRes DB::get_file_by_path(int dir_id,
                                            std::filesystem::path subdir_path,
                                            std::filesystem::path filename,
                                            Entity::File &result) {
-  if (!db)
+  if (!is_initialized())
     return DBRetCode::GetFileRes::SqlError;
 
   Entity::Directory dir;
@@ -732,7 +1321,8 @@ DBRetCode::GetFileRes DB::get_file_by_path(int dir_id,
 
 DBRetCode::GetFileRes DB::get_batch_files(const std::vector<int> &ids,
                                           std::vector<Entity::File> &result) {
-  if (!db)
+  Lease conn(*this, Access::Read);
+  if (!conn)
     return DBRetCode::GetFileRes::SqlError;
 
   const unsigned int ids_size = ids.size();
@@ -751,15 +1341,15 @@ DBRetCode::GetFileRes DB::get_batch_files(const std::vector<int> &ids,
   const std::string q =
       fmt::format("SELECT * FROM files WHERE id IN ({});", qparams);
   sqlite3_stmt *stmt = nullptr;
-  if (sqlite3_prepare_v2(db, q.c_str(), -1, &stmt, nullptr) != SQLITE_OK) {
-    PRINT_SQLITE_ERR(db);
+  if (conn->prepare(q, stmt) != SQLITE_OK) {
+    PRINT_SQLITE_ERR(conn->db);
     return DBRetCode::GetFileRes::SqlError;
   }
 
   for (int i = 0; i < ids_size; i++) {
     if (sqlite3_bind_int(stmt, i + 1, ids[i]) != SQLITE_OK) {
-      PRINT_SQLITE_ERR(db);
-      sqlite3_finalize(stmt);
+      PRINT_SQLITE_ERR(conn->db);
+      conn->finalize(stmt);
       return DBRetCode::GetFileRes::SqlError;
     }
   }
@@ -799,13 +1389,17 @@ DBRetCode::GetFileRes DB::get_batch_files(const std::vector<int> &ids,
                         filesize, filetype);
   }
 
-  sqlite3_finalize(stmt);
+  conn->finalize(stmt);
 
   return DBRetCode::GetFileRes::Success;
 }
 
 DBRetCode::UpdateFileRes DB::update_file(int id,
                                          const Entity::File &updated_file) {
+  Lease conn(*this, Access::Write);
+  if (!conn)
+    return DBRetCode::UpdateFileRes::SqlError;
+
   const std::string sql =
       "UPDATE files SET "
       "modified_time = ?, title = ?, album = ?, "
@@ -813,8 +1407,8 @@ DBRetCode::UpdateFileRes DB::update_file(int id,
       "year = ?, genre = ?, length = ?, bitrate = ?, filesize = ? "
       "WHERE id = ?;";
   sqlite3_stmt *stmt = nullptr;
-  if (sqlite3_prepare_v2(db, sql.c_str(), -1, &stmt, nullptr) != SQLITE_OK) {
-    PRINT_SQLITE_ERR(db);
+  if (conn->prepare(sql, stmt) != SQLITE_OK) {
+    PRINT_SQLITE_ERR(conn->db);
     return DBRetCode::UpdateFileRes::SqlError;
   }
 
@@ -838,17 +1432,70 @@ DBRetCode::UpdateFileRes DB::update_file(int id,
       sqlite3_bind_int(stmt, idx++, updated_file.bitrate) != SQLITE_OK ||
       sqlite3_bind_int(stmt, idx++, updated_file.filesize) != SQLITE_OK ||
       sqlite3_bind_int(stmt, idx++, id) != SQLITE_OK) {
-    PRINT_SQLITE_ERR(db);
-    sqlite3_finalize(stmt);
+    PRINT_SQLITE_ERR(conn->db);
+    conn->finalize(stmt);
     return DBRetCode::UpdateFileRes::SqlError;
   }
 
   int rc = sqlite3_step(stmt);
 
-  sqlite3_finalize(stmt);
+  conn->finalize(stmt);
 
   if (rc != SQLITE_DONE) {
-    PRINT_SQLITE_ERR(db);
+    PRINT_SQLITE_ERR(conn->db);
+    return DBRetCode::UpdateFileRes::SqlError;
+  }
+
+  return DBRetCode::UpdateFileRes::Success;
+}
+
+DBRetCode::UpdateFileRes
+DB::relocate_files(const std::vector<Entity::File> &files) {
+  Lease conn(*this, Access::Write);
+  if (!conn)
+    return DBRetCode::UpdateFileRes::SqlError;
+
+  if (files.empty())
+    return DBRetCode::UpdateFileRes::Success;
+
+  const std::string sql = "UPDATE files SET dir_id = ?, fulldir_path = ?, "
+                          "filename = ?, fingerprint = ? WHERE id = ?;";
+  sqlite3_stmt *stmt = nullptr;
+  if (conn->prepare(sql, stmt) != SQLITE_OK) {
+    PRINT_SQLITE_ERR(conn->db);
+    return DBRetCode::UpdateFileRes::SqlError;
+  }
+
+  if (!conn->exec("BEGIN IMMEDIATE;")) {
+    conn->finalize(stmt);
+    return DBRetCode::UpdateFileRes::SqlError;
+  }
+
+  for (const Entity::File &file : files) {
+    int idx = 1;
+    if (sqlite3_bind_int(stmt, idx++, file.dir_id) != SQLITE_OK ||
+        sqlite3_bind_text(stmt, idx++, file.fulldir_path.c_str(), -1,
+                          SQLITE_STATIC) != SQLITE_OK ||
+        sqlite3_bind_text(stmt, idx++, file.filename.c_str(), -1,
+                          SQLITE_STATIC) != SQLITE_OK ||
+        sqlite3_bind_int64(stmt, idx++, (sqlite3_int64)file.fingerprint) !=
+            SQLITE_OK ||
+        sqlite3_bind_int(stmt, idx++, file.id) != SQLITE_OK ||
+        sqlite3_step(stmt) != SQLITE_DONE) {
+      PRINT_SQLITE_ERR(conn->db);
+      conn->finalize(stmt);
+      conn->exec("ROLLBACK;");
+      return DBRetCode::UpdateFileRes::SqlError;
+    }
+
+    sqlite3_reset(stmt);
+    sqlite3_clear_bindings(stmt);
+  }
+
+  conn->finalize(stmt);
+
+  if (!conn->exec("COMMIT;")) {
+    conn->exec("ROLLBACK;");
     return DBRetCode::UpdateFileRes::SqlError;
   }
 
@@ -856,27 +1503,89 @@ DBRetCode::UpdateFileRes DB::update_file(int id,
 }
 
 DBRetCode::RmvFileRes DB::remove_file(int id) {
-  if (!db)
+  Lease conn(*this, Access::Write);
+  if (!conn)
     return DBRetCode::RmvFileRes::SqlError;
 
-  const std::string sql = "DELETE FROM files WHERE id = ?;";
-  sqlite3_stmt *stmt = nullptr;
-  if (sqlite3_prepare_v2(db, sql.c_str(), -1, &stmt, nullptr) != SQLITE_OK) {
-    PRINT_SQLITE_ERR(db);
+  const std::array<std::string, 2> sqls{
+      "DELETE FROM frame_indexes WHERE file_id = ?;",
+      "DELETE FROM files WHERE id = ?;"};
+
+  for (const std::string &sql : sqls) {
+    sqlite3_stmt *stmt = nullptr;
+    if (conn->prepare(sql, stmt) != SQLITE_OK) {
+      PRINT_SQLITE_ERR(conn->db);
+      return DBRetCode::RmvFileRes::SqlError;
+    }
+
+    if (sqlite3_bind_int(stmt, 1, id) != SQLITE_OK) {
+      PRINT_SQLITE_ERR(conn->db);
+      conn->finalize(stmt);
+      return DBRetCode::RmvFileRes::SqlError;
+    }
+
+    int rc = sqlite3_step(stmt);
+    conn->finalize(stmt);
+
+    if (rc != SQLITE_DONE) {
+      PRINT_SQLITE_ERR(conn->db);
+      return DBRetCode::RmvFileRes::SqlError;
+    }
+  }
+
+  return DBRetCode::RmvFileRes::Success;
+}
+
+DBRetCode::RmvFileRes DB::remove_files(const std::vector<int> &ids) {
+  Lease conn(*this, Access::Write);
+  if (!conn)
     return DBRetCode::RmvFileRes::SqlError;
+
+  if (ids.empty())
+    return DBRetCode::RmvFileRes::Success;
+
+  const std::array<std::string, 2> sqls{
+      "DELETE FROM frame_indexes WHERE file_id = ?;",
+      "DELETE FROM files WHERE id = ?;"};
+
+  std::array<sqlite3_stmt *, 2> stmts{nullptr, nullptr};
+  auto finalize_all = [&]() {
+    for (sqlite3_stmt *stmt : stmts) {
+      conn->finalize(stmt);
+    }
+  };
+
+  for (size_t i = 0; i < sqls.size(); i++) {
+    if (conn->prepare(sqls[i], stmts[i]) != SQLITE_OK) {
+      PRINT_SQLITE_ERR(conn->db);
+      finalize_all();
+      return DBRetCode::RmvFileRes::SqlError;
+    }
   }
 
-  if (sqlite3_bind_int(stmt, 1, id) != SQLITE_OK) {
-    PRINT_SQLITE_ERR(db);
-    sqlite3_finalize(stmt);
+  if (!conn->exec("BEGIN IMMEDIATE;")) {
+    finalize_all();
     return DBRetCode::RmvFileRes::SqlError;
   }
 
-  int rc = sqlite3_step(stmt);
-  sqlite3_finalize(stmt);
+  for (int id : ids) {
+    for (sqlite3_stmt *stmt : stmts) {
+      if (sqlite3_bind_int(stmt, 1, id) != SQLITE_OK ||
+          sqlite3_step(stmt) != SQLITE_DONE) {
+        PRINT_SQLITE_ERR(conn->db);
+        finalize_all();
+        conn->exec("ROLLBACK;");
+        return DBRetCode::RmvFileRes::SqlError;
+      }
 
-  if (rc != SQLITE_DONE) {
-    PRINT_SQLITE_ERR(db);
+      sqlite3_reset(stmt);
+    }
+  }
+
+  finalize_all();
+
+  if (!conn->exec("COMMIT;")) {
+    conn->exec("ROLLBACK;");
     return DBRetCode::RmvFileRes::SqlError;
   }
 
@@ -886,6 +1595,10 @@ DBRetCode::RmvFileRes DB::remove_file(int id) {
 DBRetCode::GetDistinctArtistsRes
 DB::get_distinct_artists(std::vector<Entity::Artist> &artists,
                          const DBGetOpt::ArtistsOptions &opts) {
+  Lease conn(*this, Access::Read);
+  if (!conn)
+    return DBRetCode::GetDistinctArtistsRes::SqlError;
+
   artists.clear();
 
   std::string colname =
@@ -909,22 +1622,21 @@ DB::get_distinct_artists(std::vector<Entity::Artist> &artists,
 
   std::string count_q = fmt::format("SELECT COUNT({}) FROM files;", colname);
   sqlite3_stmt *count_stmt = nullptr;
-  if (sqlite3_prepare_v2(db, count_q.c_str(), -1, &count_stmt, nullptr) !=
-      SQLITE_OK) {
-    PRINT_SQLITE_ERR(db);
+  if (conn->prepare(count_q, count_stmt) != SQLITE_OK) {
+    PRINT_SQLITE_ERR(conn->db);
     return DBRetCode::GetDistinctArtistsRes::SqlError;
   }
 
   int rc = sqlite3_step(count_stmt);
   if (rc != SQLITE_ROW) {
-    PRINT_SQLITE_ERR(db);
-    sqlite3_finalize(count_stmt);
+    PRINT_SQLITE_ERR(conn->db);
+    conn->finalize(count_stmt);
     return DBRetCode::GetDistinctArtistsRes::SqlError;
   }
 
   int count = sqlite3_column_int(count_stmt, 0);
 
-  sqlite3_finalize(count_stmt);
+  conn->finalize(count_stmt);
 
   artists.reserve(count);
 
@@ -932,8 +1644,8 @@ DB::get_distinct_artists(std::vector<Entity::Artist> &artists,
                               "FROM files GROUP BY a ORDER BY {};",
                               colname, orderby);
   sqlite3_stmt *stmt = nullptr;
-  if (sqlite3_prepare_v2(db, q.c_str(), -1, &stmt, nullptr) != SQLITE_OK) {
-    PRINT_SQLITE_ERR(db);
+  if (conn->prepare(q, stmt) != SQLITE_OK) {
+    PRINT_SQLITE_ERR(conn->db);
     return DBRetCode::GetDistinctArtistsRes::SqlError;
   }
 
@@ -947,7 +1659,7 @@ DB::get_distinct_artists(std::vector<Entity::Artist> &artists,
     artists.emplace_back(name, album_count);
   }
 
-  sqlite3_finalize(stmt);
+  conn->finalize(stmt);
 
   return DBRetCode::GetDistinctArtistsRes::Success;
 }
@@ -955,6 +1667,10 @@ DB::get_distinct_artists(std::vector<Entity::Artist> &artists,
 DBRetCode::GetArtistAlbumsRes
 DB::get_artist_albums(Entity::Artist &artist,
                       const DBGetOpt::AlbumsOptions &opts) {
+  Lease conn(*this, Access::Read);
+  if (!conn)
+    return DBRetCode::GetArtistAlbumsRes::SqlError;
+
   artist.albums.clear();
 
   std::string colname =
@@ -996,38 +1712,37 @@ DB::get_artist_albums(Entity::Artist &artist,
   std::string count_q = fmt::format(
       "SELECT COUNT(DISTINCT(album)) FROM files WHERE {};", colname);
   sqlite3_stmt *count_stmt = nullptr;
-  if (sqlite3_prepare_v2(db, count_q.c_str(), -1, &count_stmt, nullptr) !=
-      SQLITE_OK) {
-    PRINT_SQLITE_ERR(db);
+  if (conn->prepare(count_q, count_stmt) != SQLITE_OK) {
+    PRINT_SQLITE_ERR(conn->db);
     return DBRetCode::GetArtistAlbumsRes::SqlError;
   }
 
   if (sqlite3_bind_text(count_stmt, 1, artist.name.c_str(), -1,
                         SQLITE_STATIC) != SQLITE_OK) {
-    PRINT_SQLITE_ERR(db);
-    sqlite3_finalize(count_stmt);
+    PRINT_SQLITE_ERR(conn->db);
+    conn->finalize(count_stmt);
     return DBRetCode::GetArtistAlbumsRes::SqlError;
   }
 
   if (opts.use_albumartist) {
     if (sqlite3_bind_text(count_stmt, 2, artist.name.c_str(), -1,
                           SQLITE_STATIC) != SQLITE_OK) {
-      PRINT_SQLITE_ERR(db);
-      sqlite3_finalize(count_stmt);
+      PRINT_SQLITE_ERR(conn->db);
+      conn->finalize(count_stmt);
       return DBRetCode::GetArtistAlbumsRes::SqlError;
     }
   }
 
   int rc = sqlite3_step(count_stmt);
   if (rc != SQLITE_ROW) {
-    PRINT_SQLITE_ERR(db);
-    sqlite3_finalize(count_stmt);
+    PRINT_SQLITE_ERR(conn->db);
+    conn->finalize(count_stmt);
     return DBRetCode::GetArtistAlbumsRes::SqlError;
   }
 
   int count = sqlite3_column_int(count_stmt, 0);
 
-  sqlite3_finalize(count_stmt);
+  conn->finalize(count_stmt);
 
   artist.albums.reserve(count);
 
@@ -1035,23 +1750,23 @@ DB::get_artist_albums(Entity::Artist &artist,
                               "FROM files WHERE {} GROUP BY album ORDER BY {};",
                               colname, orderby);
   sqlite3_stmt *stmt = nullptr;
-  if (sqlite3_prepare_v2(db, q.c_str(), -1, &stmt, nullptr) != SQLITE_OK) {
-    PRINT_SQLITE_ERR(db);
+  if (conn->prepare(q, stmt) != SQLITE_OK) {
+    PRINT_SQLITE_ERR(conn->db);
     return DBRetCode::GetArtistAlbumsRes::SqlError;
   }
 
   if (sqlite3_bind_text(stmt, 1, artist.name.c_str(), -1, SQLITE_STATIC) !=
       SQLITE_OK) {
-    PRINT_SQLITE_ERR(db);
-    sqlite3_finalize(stmt);
+    PRINT_SQLITE_ERR(conn->db);
+    conn->finalize(stmt);
     return DBRetCode::GetArtistAlbumsRes::SqlError;
   }
 
   if (opts.use_albumartist) {
     if (sqlite3_bind_text(stmt, 2, artist.name.c_str(), -1, SQLITE_STATIC) !=
         SQLITE_OK) {
-      PRINT_SQLITE_ERR(db);
-      sqlite3_finalize(stmt);
+      PRINT_SQLITE_ERR(conn->db);
+      conn->finalize(stmt);
       return DBRetCode::GetArtistAlbumsRes::SqlError;
     }
   }
@@ -1071,7 +1786,7 @@ DB::get_artist_albums(Entity::Artist &artist,
     artist.albums.emplace_back(album_name, genre, year, track_count);
   }
 
-  sqlite3_finalize(stmt);
+  conn->finalize(stmt);
 
   return DBRetCode::GetArtistAlbumsRes::Success;
 }
@@ -1079,6 +1794,10 @@ DB::get_artist_albums(Entity::Artist &artist,
 DBRetCode::GetAlbumTracksRes
 DB::get_album_tracks(const Entity::Artist &artist, Entity::Album &album,
                      const DBGetOpt::TrackOptions &opts) {
+  Lease conn(*this, Access::Read);
+  if (!conn)
+    return DBRetCode::GetAlbumTracksRes::SqlError;
+
   album.tracks.clear();
 
   std::string colname =
@@ -1092,8 +1811,8 @@ DB::get_album_tracks(const Entity::Artist &artist, Entity::Album &album,
                   "ASC, track_number ASC;",
                   colname);
   sqlite3_stmt *stmt = nullptr;
-  if (sqlite3_prepare_v2(db, q.c_str(), -1, &stmt, nullptr) != SQLITE_OK) {
-    PRINT_SQLITE_ERR(db);
+  if (conn->prepare(q, stmt) != SQLITE_OK) {
+    PRINT_SQLITE_ERR(conn->db);
     return DBRetCode::GetAlbumTracksRes::SqlError;
   }
 
@@ -1101,24 +1820,24 @@ DB::get_album_tracks(const Entity::Artist &artist, Entity::Album &album,
 
   if (sqlite3_bind_text(stmt, bind_idx++, artist.name.c_str(), -1,
                         SQLITE_STATIC) != SQLITE_OK) {
-    PRINT_SQLITE_ERR(db);
-    sqlite3_finalize(stmt);
+    PRINT_SQLITE_ERR(conn->db);
+    conn->finalize(stmt);
     return DBRetCode::GetAlbumTracksRes::SqlError;
   }
 
   if (opts.use_albumartist) {
     if (sqlite3_bind_text(stmt, bind_idx++, artist.name.c_str(), -1,
                           SQLITE_STATIC) != SQLITE_OK) {
-      PRINT_SQLITE_ERR(db);
-      sqlite3_finalize(stmt);
+      PRINT_SQLITE_ERR(conn->db);
+      conn->finalize(stmt);
       return DBRetCode::GetAlbumTracksRes::SqlError;
     }
   }
 
   if (sqlite3_bind_text(stmt, bind_idx++, album.title.c_str(), -1,
                         SQLITE_STATIC) != SQLITE_OK) {
-    PRINT_SQLITE_ERR(db);
-    sqlite3_finalize(stmt);
+    PRINT_SQLITE_ERR(conn->db);
+    conn->finalize(stmt);
     return DBRetCode::GetAlbumTracksRes::SqlError;
   }
 
@@ -1145,11 +1864,160 @@ DB::get_album_tracks(const Entity::Artist &artist, Entity::Album &album,
                               filesize, filetype);
   }
 
-  sqlite3_finalize(stmt);
+  conn->finalize(stmt);
 
   return DBRetCode::GetAlbumTracksRes::Success;
 }
 
+DBRetCode::GetFrameIndexRes
+DB::get_frame_index(int file_id, std::int64_t modified_time,
+                    unsigned int filesize, Entity::FrameIndex &result) {
+  Lease conn(*this, Access::Read);
+  if (!conn)
+    return DBRetCode::GetFrameIndexRes::SqlError;
+
+  const std::string q = "SELECT step, offsets FROM frame_indexes WHERE "
+                        "file_id = ? AND modified_time = ? AND filesize = ?;";
+  sqlite3_stmt *stmt = nullptr;
+  if (conn->prepare(q, stmt) != SQLITE_OK) {
+    PRINT_SQLITE_ERR(conn->db);
+    return DBRetCode::GetFrameIndexRes::SqlError;
+  }
+
+  int idx = 1;
+
+  if (sqlite3_bind_int(stmt, idx++, file_id) != SQLITE_OK ||
+      sqlite3_bind_int64(stmt, idx++, modified_time) != SQLITE_OK ||
+      sqlite3_bind_int64(stmt, idx++, filesize) != SQLITE_OK) {
+    PRINT_SQLITE_ERR(conn->db);
+    conn->finalize(stmt);
+    return DBRetCode::GetFrameIndexRes::SqlError;
+  }
+
+  int rc = sqlite3_step(stmt);
+  if (rc != SQLITE_ROW) {
+    conn->finalize(stmt);
+
+    return DBRetCode::GetFrameIndexRes::NotFound;
+  }
+
+  result.file_id = file_id;
+  result.modified_time = modified_time;
+  result.filesize = filesize;
+  result.step = sqlite3_column_int64(stmt, 0);
+
+  const void *blob = sqlite3_column_blob(stmt, 1);
+  int blob_size = sqlite3_column_bytes(stmt, 1);
+
+  result.offsets.resize(blob_size / sizeof(std::int64_t));
+  if (blob && blob_size > 0) {
+    std::memcpy(result.offsets.data(), blob,
+                result.offsets.size() * sizeof(std::int64_t));
+  }
+
+  conn->finalize(stmt);
+
+  return DBRetCode::GetFrameIndexRes::Success;
+}
+
+DBRetCode::SetFrameIndexRes
+DB::set_frame_index(const Entity::FrameIndex &index) {
+  Lease conn(*this, Access::Write);
+  if (!conn)
+    return DBRetCode::SetFrameIndexRes::SqlError;
+
+  const std::string sql =
+      "INSERT OR REPLACE INTO frame_indexes ("
+      "file_id, modified_time, filesize, step, offsets"
+      ") VALUES (?,?,?,?,?);";
+  sqlite3_stmt *stmt = nullptr;
+  if (conn->prepare(sql, stmt) != SQLITE_OK) {
+    PRINT_SQLITE_ERR(conn->db);
+    return DBRetCode::SetFrameIndexRes::SqlError;
+  }
+
+  int idx = 1;
+
+  if (sqlite3_bind_int(stmt, idx++, index.file_id) != SQLITE_OK ||
+      sqlite3_bind_int64(stmt, idx++, index.modified_time) != SQLITE_OK ||
+      sqlite3_bind_int64(stmt, idx++, index.filesize) != SQLITE_OK ||
+      sqlite3_bind_int64(stmt, idx++, index.step) != SQLITE_OK ||
+      // A null pointer would bind NULL, a failure marker stores no bytes.
+      (index.offsets.empty()
+           ? sqlite3_bind_zeroblob(stmt, idx++, 0)
+           : sqlite3_bind_blob(stmt, idx++, index.offsets.data(),
+                               index.offsets.size() * sizeof(std::int64_t),
+                               SQLITE_STATIC)) != SQLITE_OK) {
+    PRINT_SQLITE_ERR(conn->db);
+    conn->finalize(stmt);
+    return DBRetCode::SetFrameIndexRes::SqlError;
+  }
+
+  int rc = sqlite3_step(stmt);
+
+  conn->finalize(stmt);
+
+  if (rc != SQLITE_DONE) {
+    PRINT_SQLITE_ERR(conn->db);
+    return DBRetCode::SetFrameIndexRes::SqlError;
+  }
+
+  return DBRetCode::SetFrameIndexRes::Success;
+}
+
+DBRetCode::GetFileRes
+DB::get_unindexed_files(Enum::FileType filetype, int min_length,
+                        std::vector<Entity::FileMainProps> &result) {
+  Lease conn(*this, Access::Read);
+  if (!conn)
+    return DBRetCode::GetFileRes::SqlError;
+
+  result.clear();
+
+  const std::string q =
+      "SELECT "
+      "f.id, f.dir_id, f.filename, f.fulldir_path, f.created_time,"
+      "f.modified_time, f.filesize, f.filetype"
+      " FROM files f LEFT JOIN frame_indexes i ON i.file_id = f.id"
+      " AND i.modified_time = f.modified_time AND i.filesize = f.filesize"
+      " WHERE f.filetype = ? AND f.length >= ? AND i.file_id IS NULL"
+      " ORDER BY f.length DESC;";
+  sqlite3_stmt *stmt = nullptr;
+  if (conn->prepare(q, stmt) != SQLITE_OK) {
+    PRINT_SQLITE_ERR(conn->db);
+    return DBRetCode::GetFileRes::SqlError;
+  }
+
+  if (sqlite3_bind_int(stmt, 1, (int)filetype) != SQLITE_OK ||
+      sqlite3_bind_int(stmt, 2, min_length) != SQLITE_OK) {
+    PRINT_SQLITE_ERR(conn->db);
+    conn->finalize(stmt);
+    return DBRetCode::GetFileRes::SqlError;
+  }
+
+  while (sqlite3_step(stmt) == SQLITE_ROW) {
+    int idx = 0;
+
+    int id = sqlite3_column_int(stmt, idx++);
+    int dir_id = sqlite3_column_int(stmt, idx++);
+    std::filesystem::path filename =
+        convert_unsigned_char_ptr_to_string(sqlite3_column_text(stmt, idx++));
+    std::filesystem::path fulldir_path =
+        convert_unsigned_char_ptr_to_string(sqlite3_column_text(stmt, idx++));
+    std::int64_t created_time = sqlite3_column_int(stmt, idx++);
+    std::int64_t modified_time = sqlite3_column_int(stmt, idx++);
+    unsigned int filesize = sqlite3_column_int(stmt, idx++);
+    Enum::FileType filetype = (Enum::FileType)sqlite3_column_int(stmt, idx++);
+
+    result.emplace_back(id, dir_id, filename, fulldir_path, created_time,
+                        modified_time, filesize, filetype);
+  }
+
+  conn->finalize(stmt);
+
+  return DBRetCode::GetFileRes::Success;
+}
+
 Enum::FileType DB::get_filetype(const std::filesystem::path &path) {
   std::string ext = path.extension().string();
   std::transform(ext.begin(), ext.end(), ext.begin(), ::tolower);
@@ -1177,3 +2045,283 @@ DB::get_file_fullpath(const std::filesystem::path fulldir_path,
       fmt::format("{}/{}", fulldir_path.c_str(), filename.c_str());
   return fullpath;
 }
+
+DBRetCode::GetScannedDirsRes DB::get_scanned_dirs(
+    int dir_id, std::map<std::filesystem::path, Entity::ScannedDir> &result) {
+  Lease conn(*this, Access::Read);
+  if (!conn)
+    return DBRetCode::GetScannedDirsRes::SqlError;
+
+  result.clear();
+
+  const std::string q = "SELECT path, modified_time_ns, entry_count FROM "
+                        "scanned_dirs WHERE dir_id = ?;";
+  sqlite3_stmt *stmt = nullptr;
+  if (conn->prepare(q, stmt) != SQLITE_OK) {
+    PRINT_SQLITE_ERR(conn->db);
+    return DBRetCode::GetScannedDirsRes::SqlError;
+  }
+
+  if (sqlite3_bind_int(stmt, 1, dir_id) != SQLITE_OK) {
+    PRINT_SQLITE_ERR(conn->db);
+    conn->finalize(stmt);
+    return DBRetCode::GetScannedDirsRes::SqlError;
+  }
+
+  int rc;
+  while ((rc = sqlite3_step(stmt)) == SQLITE_ROW) {
+    std::filesystem::path path =
+        convert_unsigned_char_ptr_to_string(sqlite3_column_text(stmt, 0));
+
+    result[path] = Entity::ScannedDir(dir_id, path,
+                                      sqlite3_column_int64(stmt, 1),
+                                      sqlite3_column_int64(stmt, 2));
+  }
+
+  conn->finalize(stmt);
+
+  if (rc != SQLITE_DONE) {
+    PRINT_SQLITE_ERR(conn->db);
+    return DBRetCode::GetScannedDirsRes::SqlError;
+  }
+
+  return DBRetCode::GetScannedDirsRes::Success;
+}
+
+DBRetCode::SetScannedDirsRes
+DB::set_scanned_dirs(int dir_id, const std::vector<Entity::ScannedDir> &dirs) {
+  Lease conn(*this, Access::Write);
+  if (!conn)
+    return DBRetCode::SetScannedDirsRes::SqlError;
+
+  if (!conn->exec("BEGIN IMMEDIATE;")) {
+    return DBRetCode::SetScannedDirsRes::SqlError;
+  }
+
+  const std::string delete_sql = "DELETE FROM scanned_dirs WHERE dir_id = ?;";
+  sqlite3_stmt *delete_stmt = nullptr;
+  if (conn->prepare(delete_sql, delete_stmt) != SQLITE_OK) {
+    PRINT_SQLITE_ERR(conn->db);
+    conn->exec("ROLLBACK;");
+    return DBRetCode::SetScannedDirsRes::SqlError;
+  }
+
+  if (sqlite3_bind_int(delete_stmt, 1, dir_id) != SQLITE_OK ||
+      sqlite3_step(delete_stmt) != SQLITE_DONE) {
+    PRINT_SQLITE_ERR(conn->db);
+    conn->finalize(delete_stmt);
+    conn->exec("ROLLBACK;");
+    return DBRetCode::SetScannedDirsRes::SqlError;
+  }
+
+  conn->finalize(delete_stmt);
+
+  const std::string insert_sql =
+      "INSERT OR REPLACE INTO scanned_dirs "
+      "(path, dir_id, modified_time_ns, entry_count) VALUES (?,?,?,?);";
+  sqlite3_stmt *insert_stmt = nullptr;
+  if (conn->prepare(insert_sql, insert_stmt) != SQLITE_OK) {
+    PRINT_SQLITE_ERR(conn->db);
+    conn->exec("ROLLBACK;");
+    return DBRetCode::SetScannedDirsRes::SqlError;
+  }
+
+  for (const Entity::ScannedDir &dir : dirs) {
+    int idx = 1;
+
+    if (sqlite3_bind_text(insert_stmt, idx++, dir.path.c_str(), -1,
+                          SQLITE_STATIC) != SQLITE_OK ||
+        sqlite3_bind_int(insert_stmt, idx++, dir_id) != SQLITE_OK ||
+        sqlite3_bind_int64(insert_stmt, idx++, dir.modified_time_ns) !=
+            SQLITE_OK ||
+        sqlite3_bind_int64(insert_stmt, idx++, dir.entry_count) != SQLITE_OK ||
+        sqlite3_step(insert_stmt) != SQLITE_DONE) {
+      PRINT_SQLITE_ERR(conn->db);
+      conn->finalize(insert_stmt);
+      conn->exec("ROLLBACK;");
+      return DBRetCode::SetScannedDirsRes::SqlError;
+    }
+
+    sqlite3_reset(insert_stmt);
+    sqlite3_clear_bindings(insert_stmt);
+  }
+
+  conn->finalize(insert_stmt);
+
+  if (!conn->exec("COMMIT;")) {
+    conn->exec("ROLLBACK;");
+    return DBRetCode::SetScannedDirsRes::SqlError;
+  }
+
+  return DBRetCode::SetScannedDirsRes::Success;
+}
+
+DBRetCode::GetScanJournalRes
+DB::get_scan_journal(int dir_id, Entity::ScanJournal &result) {
+  Lease conn(*this, Access::Read);
+  if (!conn)
+    return DBRetCode::GetScanJournalRes::SqlError;
+
+  const std::string q =
+      "SELECT state, started_time, checkpoint_time, files_written, dirs_done "
+      "FROM scan_journal WHERE dir_id = ?;";
+  sqlite3_stmt *stmt = nullptr;
+  if (conn->prepare(q, stmt) != SQLITE_OK) {
+    PRINT_SQLITE_ERR(conn->db);
+    return DBRetCode::GetScanJournalRes::SqlError;
+  }
+
+  if (sqlite3_bind_int(stmt, 1, dir_id) != SQLITE_OK) {
+    PRINT_SQLITE_ERR(conn->db);
+    conn->finalize(stmt);
+    return DBRetCode::GetScanJournalRes::SqlError;
+  }
+
+  int rc = sqlite3_step(stmt);
+  if (rc == SQLITE_DONE) {
+    conn->finalize(stmt);
+    return DBRetCode::GetScanJournalRes::NotFound;
+  }
+
+  if (rc != SQLITE_ROW) {
+    PRINT_SQLITE_ERR(conn->db);
+    conn->finalize(stmt);
+    return DBRetCode::GetScanJournalRes::SqlError;
+  }
+
+  int idx = 0;
+  result.dir_id = dir_id;
+  result.state = (Enum::ScanState)sqlite3_column_int(stmt, idx++);
+  result.started_time = sqlite3_column_int64(stmt, idx++);
+  result.checkpoint_time = sqlite3_column_int64(stmt, idx++);
+  result.files_written = sqlite3_column_int64(stmt, idx++);
+  result.dirs_done = sqlite3_column_int64(stmt, idx++);
+
+  conn->finalize(stmt);
+
+  return DBRetCode::GetScanJournalRes::Success;
+}
+
+static const std::string set_scan_journal_sql =
+    "INSERT OR REPLACE INTO scan_journal (dir_id, state, started_time, "
+    "checkpoint_time, files_written, dirs_done) VALUES (?,?,?,?,?,?);";
+
+static int bind_scan_journal(sqlite3_stmt *stmt,
+                             const Entity::ScanJournal &journal) {
+  int idx = 1;
+  int rc = sqlite3_bind_int(stmt, idx++, journal.dir_id);
+  if (rc == SQLITE_OK)
+    rc = sqlite3_bind_int(stmt, idx++, (int)journal.state);
+  if (rc == SQLITE_OK)
+    rc = sqlite3_bind_int64(stmt, idx++, journal.started_time);
+  if (rc == SQLITE_OK)
+    rc = sqlite3_bind_int64(stmt, idx++, journal.checkpoint_time);
+  if (rc == SQLITE_OK)
+    rc = sqlite3_bind_int64(stmt, idx++, journal.files_written);
+  if (rc == SQLITE_OK)
+    rc = sqlite3_bind_int64(stmt, idx++, journal.dirs_done);
+  return rc;
+}
+
+static int bind_scanned_dir(sqlite3_stmt *stmt, const Entity::ScannedDir &dir) {
+  int idx = 1;
+  int rc = sqlite3_bind_text(stmt, idx++, dir.path.c_str(), -1, SQLITE_STATIC);
+  if (rc == SQLITE_OK)
+    rc = sqlite3_bind_int(stmt, idx++, dir.dir_id);
+  if (rc == SQLITE_OK)
+    rc = sqlite3_bind_int64(stmt, idx++, dir.modified_time_ns);
+  if (rc == SQLITE_OK)
+    rc = sqlite3_bind_int64(stmt, idx++, dir.entry_count);
+  return rc;
+}
+
+DBRetCode::SetScanJournalRes
+DB::set_scan_journal(const Entity::ScanJournal &journal) {
+  Lease conn(*this, Access::Write);
+  if (!conn)
+    return DBRetCode::SetScanJournalRes::SqlError;
+
+  sqlite3_stmt *stmt = nullptr;
+  if (conn->prepare(set_scan_journal_sql, stmt) != SQLITE_OK) {
+    PRINT_SQLITE_ERR(conn->db);
+    return DBRetCode::SetScanJournalRes::SqlError;
+  }
+
+  if (bind_scan_journal(stmt, journal) != SQLITE_OK ||
+      sqlite3_step(stmt) != SQLITE_DONE) {
+    PRINT_SQLITE_ERR(conn->db);
+    conn->finalize(stmt);
+    return DBRetCode::SetScanJournalRes::SqlError;
+  }
+
+  conn->finalize(stmt);
+
+  return DBRetCode::SetScanJournalRes::Success;
+}
+
+// Runs `sql` once per row with the parameters `bind` sets, reusing the
+// statement.
+template <typename T, typename Bind>
+bool DB::step_each(const std::string &sql, const std::vector<T> &rows,
+                   Bind bind) {
+  if (rows.empty())
+    return true;
+
+  sqlite3_stmt *stmt = nullptr;
+  if (writer.prepare(sql, stmt) != SQLITE_OK) {
+    PRINT_SQLITE_ERR(writer.db);
+    return false;
+  }
+
+  for (const T &row : rows) {
+    if (bind(stmt, row) != SQLITE_OK || sqlite3_step(stmt) != SQLITE_DONE) {
+      PRINT_SQLITE_ERR(writer.db);
+      writer.finalize(stmt);
+      return false;
+    }
+
+    sqlite3_reset(stmt);
+  }
+
+  writer.finalize(stmt);
+  return true;
+}
+
+DBRetCode::SaveCheckpointRes
+DB::save_scan_checkpoint(const std::vector<int> &removed_ids,
+                         const std::vector<Entity::ScannedDir> &done_dirs,
+                         const std::vector<Entity::ScannedDir> &new_dirs,
+                         const std::vector<Entity::ScanJournal> &journals) {
+  Lease conn(*this, Access::Write);
+  if (!conn)
+    return DBRetCode::SaveCheckpointRes::SqlError;
+
+  if (!conn->exec("BEGIN IMMEDIATE;")) {
+    return DBRetCode::SaveCheckpointRes::SqlError;
+  }
+
+  auto bind_id = [](sqlite3_stmt *stmt, int id) {
+    return sqlite3_bind_int(stmt, 1, id);
+  };
+
+  const bool ok =
+      step_each("DELETE FROM frame_indexes WHERE file_id = ?;",
+                removed_ids, bind_id) &&
+      step_each("DELETE FROM files WHERE id = ?;", removed_ids, bind_id) &&
+      step_each("INSERT OR REPLACE INTO scanned_dirs "
+                "(path, dir_id, modified_time_ns, entry_count) "
+                "VALUES (?,?,?,?);",
+                done_dirs, bind_scanned_dir) &&
+      step_each("INSERT OR IGNORE INTO scanned_dirs "
+                "(path, dir_id, modified_time_ns, entry_count) "
+                "VALUES (?,?,?,?);",
+                new_dirs, bind_scanned_dir) &&
+      step_each(set_scan_journal_sql, journals, bind_scan_journal);
+
+  if (!ok || !conn->exec("COMMIT;")) {
+    conn->exec("ROLLBACK;");
+    return DBRetCode::SaveCheckpointRes::SqlError;
+  }
+
+  return DBRetCode::SaveCheckpointRes::Success;
+}
@@ -1,9 +1,14 @@
 #pragma once
+#include "common/stmt_cache.hpp"
 #include "common/types.hpp"
+#include <condition_variable>
 #include <filesystem>
 #include <map>
+#include <memory>
+#include <mutex>
 #include <sqlite3.h>
 #include <string>
+#include <vector>
 
 namespace DBRetCode {
 
@@ -18,10 +23,18 @@ enum class AddFileRes {
 enum class GetFileRes { Success = 0, SqlError, NotFound, CannotGetDir };
 enum class UpdateFileRes { Success = 0, SqlError, NotFound };
 enum class RmvFileRes { Success = 0, SqlError };
-enum class SetupTablesRes { Success = 0, SqlError };
+enum class SetupTablesRes { Success = 0, SqlError, UnknownVersion };
 enum class GetDistinctArtistsRes { Success = 0, SqlError };
 enum class GetArtistAlbumsRes { Success = 0, SqlError };
 enum class GetAlbumTracksRes { Success = 0, SqlError };
+enum class GetFrameIndexRes { Success = 0, SqlError, NotFound };
+enum class SetFrameIndexRes { Success = 0, SqlError };
+enum class UpsertFilesRes { Success = 0, SqlError };
+enum class GetScannedDirsRes { Success = 0, SqlError };
+enum class SetScannedDirsRes { Success = 0, SqlError };
+enum class GetScanJournalRes { Success = 0, NotFound, SqlError };
+enum class SetScanJournalRes { Success = 0, SqlError };
+enum class SaveCheckpointRes { Success = 0, SqlError };
 
 }; // namespace DBRetCode
 
@@ -57,12 +70,16 @@ struct TrackOptions {
 
 }; // namespace DBGetOpt
 
+// Safe to share between threads. Changes go through one writer connection,
+// one call at a time; queries run on a small pool of read-only connections,
+// which in WAL mode see the last commit without waiting for the writer.
 class DB {
 public:
   DB(const std::string &db_name);
   ~DB();
 
   bool is_initialized();
+  StmtCacheStats get_stmt_cache_stats();
 
   DBRetCode::AddDirRes add_directory(const std::filesystem::path &path,
                                      int &result_id);
@@ -88,8 +105,16 @@ public:
   DBRetCode::GetFileRes get_dir_files_map(int dir_id,
                                           std::map<int, Entity::File> &result);
   DBRetCode::GetFileRes get_dir_files_main_props(
-      int dir_id,
-      std::map<std::filesystem::path, Entity::FileMainProps> &result);
+      int dir_id, Entity::FileMainPropsMap &result);
+  // Files directly in fulldir_path, or anywhere below it with `recursive`.
+  DBRetCode::GetFileRes get_files_main_props_in(
+      int dir_id, const std::filesystem::path &fulldir_path, bool recursive,
+      Entity::FileMainPropsMap &result);
+  // Rows under dir_id that may hold the same content, see file_fingerprint().
+  DBRetCode::GetFileRes
+  get_files_by_fingerprint(int dir_id, unsigned int filesize,
+                           std::uint64_t fingerprint,
+                           std::vector<Entity::FileMainProps> &result);
   DBRetCode::GetFileRes get_file_by_path(int dir_id,
                                          std::filesystem::path subdir_path,
                                          std::filesystem::path filename,
@@ -99,7 +124,21 @@ public:
                                          Entity::File &result);
   DBRetCode::UpdateFileRes update_file(int id,
                                        const Entity::File &updated_file);
+  // Moves rows to the dir_id, fulldir_path and filename of each file and
+  // stores its fingerprint, keeping ids and tags. One transaction.
+  DBRetCode::UpdateFileRes
+  relocate_files(const std::vector<Entity::File> &files);
   DBRetCode::RmvFileRes remove_file(int id);
+  // Removes all of them, with their seek indexes, in one transaction.
+  DBRetCode::RmvFileRes remove_files(const std::vector<int> &ids);
+
+  // Inserts or updates (matched on fulldir_path + filename) every file with
+  // one reused statement, committing once per `batch_size` rows. result_ids
+  // receives the row id of each file in input order. On error, batches
+  // committed before the failing one are kept.
+  DBRetCode::UpsertFilesRes
+  upsert_files(const std::vector<Entity::File> &files, int batch_size,
+               std::vector<int> &result_ids);
 
   DBRetCode::GetDistinctArtistsRes
   get_distinct_artists(std::vector<Entity::Artist> &artists,
@@ -111,9 +150,100 @@ public:
   get_album_tracks(const Entity::Artist &artist, Entity::Album &album,
                    const DBGetOpt::TrackOptions &opts);
 
+  DBRetCode::GetFrameIndexRes get_frame_index(int file_id,
+                                              std::int64_t modified_time,
+                                              unsigned int filesize,
+                                              Entity::FrameIndex &result);
+  DBRetCode::SetFrameIndexRes set_frame_index(const Entity::FrameIndex &index);
+  DBRetCode::GetScannedDirsRes get_scanned_dirs(
+      int dir_id,
+      std::map<std::filesystem::path, Entity::ScannedDir> &result);
+  // Replaces everything recorded for dir_id in one transaction.
+  DBRetCode::SetScannedDirsRes
+  set_scanned_dirs(int dir_id, const std::vector<Entity::ScannedDir> &dirs);
+
+  DBRetCode::GetScanJournalRes get_scan_journal(int dir_id,
+                                                Entity::ScanJournal &result);
+  DBRetCode::SetScanJournalRes
+  set_scan_journal(const Entity::ScanJournal &journal);
+  // One transaction: drops removed_ids, records done_dirs, adds new_dirs
+  // unless they already have a row, and updates the journals.
+  DBRetCode::SaveCheckpointRes
+  save_scan_checkpoint(const std::vector<int> &removed_ids,
+                       const std::vector<Entity::ScannedDir> &done_dirs,
+                       const std::vector<Entity::ScannedDir> &new_dirs,
+                       const std::vector<Entity::ScanJournal> &journals);
+
+  // Files with neither an index nor a failure marker for their current
+  // mtime and size, longest first.
+  DBRetCode::GetFileRes
+  get_unindexed_files(Enum::FileType filetype, int min_length,
+                      std::vector<Entity::FileMainProps> &result);
+
 private:
-  sqlite3 *db;
+  // One sqlite3 handle and the statements prepared on it. Every statement
+  // goes through prepare()/finalize(), so the ones run again skip parsing
+  // and planning.
+  struct Connection {
+    sqlite3 *db = nullptr;
+    StmtCache stmts;
+
+    ~Connection();
+    bool open(const std::string &path, int flags);
+    void close();
+    int prepare(const std::string &sql, sqlite3_stmt *&result);
+    void finalize(sqlite3_stmt *stmt);
+    bool exec(const std::string &sql);
+  };
+
+  enum class Access { Read, Write };
+
+  // The connection one call runs on. Write gets the writer and holds
+  // write_mtx until the lease ends, Read waits for a free reader and gives it
+  // back at the end, or takes the writer when there are no readers.
+  class Lease {
+  public:
+    Lease(DB &owner__, Access access);
+    ~Lease();
+
+    Lease(const Lease &) = delete;
+    Lease &operator=(const Lease &) = delete;
+
+    explicit operator bool() const { return conn && conn->db; }
+    Connection *operator->() const { return conn; }
+
+  private:
+    DB &owner;
+    Connection *conn;
+    std::unique_lock<std::mutex> write_lock;
+  };
+
   std::string db_name;
 
+  // Scans and every other change, one call at a time.
+  Connection writer;
+  std::mutex write_mtx;
+
+  // Read-only connections for the queries. In WAL mode they read the last
+  // commit while the writer works, so browsing does not wait for a scan.
+  std::vector<std::unique_ptr<Connection>> readers;
+  std::vector<Connection *> idle_readers;
+  std::mutex readers_mtx;
+  std::condition_variable readers_cv;
+
+  bool enable_wal();
+  void open_readers();
+
+  // The helpers below run on the writer, from the constructor or with a
+  // write lease held.
   DBRetCode::SetupTablesRes setup_tables();
+  bool get_schema_version(int &result);
+  bool set_schema_version(int version);
+  bool migrate_base_tables();
+  bool migrate_query_indexes();
+  bool add_files_path_index();
+  bool add_files_fingerprint();
+  template <typename T, typename Bind>
+  bool step_each(const std::string &sql, const std::vector<T> &rows,
+                 Bind bind);
 };
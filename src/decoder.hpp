@@ -2,6 +2,7 @@
 #include "common/types.hpp"
 #include <filesystem>
 #include <mpg123.h>
+#include <vector>
 
 namespace DecoderRetCode {
 
@@ -42,6 +43,13 @@ enum class SeekRes {
   Error,
 };
 
+enum class IndexRes {
+  Success = 0,
+  EmptyHandle,
+  NotSupported,
+  Error,
+};
+
 }; // namespace DecoderRetCode
 
 class Decoder {
@@ -63,6 +71,18 @@ public:
 
   virtual int64_t tell() = 0;
 
+  // Sample-domain positioning, in PCM frames at the decoded stream rate.
+  virtual DecoderRetCode::SeekRes seek_frame(int64_t frame) = 0;
+  virtual int64_t tell_frame() = 0;
+  virtual int64_t length_frames() = 0;
+
+  // Seek index (frame byte offsets every `step` frames). build_index scans
+  // the whole open stream, set_index installs a previously built one.
+  virtual DecoderRetCode::IndexRes build_index(std::vector<int64_t> &offsets,
+                                               int64_t &step) = 0;
+  virtual DecoderRetCode::IndexRes
+  set_index(const std::vector<int64_t> &offsets, int64_t step) = 0;
+
   virtual DecoderRetCode::GetFmtRes get_format(Audio::FormatInfo &afi) = 0;
   virtual DecoderRetCode::SetFmtRes
   set_format(const Audio::FormatInfo &afi) = 0;
@@ -88,6 +108,15 @@ public:
 
   int64_t tell() override;
 
+  DecoderRetCode::SeekRes seek_frame(int64_t frame) override;
+  int64_t tell_frame() override;
+  int64_t length_frames() override;
+
+  DecoderRetCode::IndexRes build_index(std::vector<int64_t> &offsets,
+                                       int64_t &step) override;
+  DecoderRetCode::IndexRes set_index(const std::vector<int64_t> &offsets,
+                                     int64_t step) override;
+
   DecoderRetCode::GetFmtRes get_format(Audio::FormatInfo &afi) override;
   DecoderRetCode::SetFmtRes set_format(const Audio::FormatInfo &afi) override;
 
@@ -18,6 +18,16 @@ MPG123Decoder::MPG123Decoder() {
   }
 
   handle = h;
+
+  if (handle) {
+    // Trim encoder delay and padding (LAME/Info tag) so consecutive tracks
+    // can be spliced without a gap.
+    mpg123_param(handle, MPG123_ADD_FLAGS, MPG123_GAPLESS, 0);
+
+    // Let the seek index grow with the stream instead of thinning out, so a
+    // full scan of a long file keeps per-frame granularity.
+    mpg123_param(handle, MPG123_INDEX_SIZE, -1000, 0);
+  }
 }
 
 MPG123Decoder::~MPG123Decoder() {
@@ -142,11 +152,10 @@ DecoderRetCode::SeekRes MPG123Decoder::seek(double offset, int whence) {
     return DecoderRetCode::SeekRes::EmptyHandle;
   }
 
-  int rc;
-
-  rc = mpg123_seek(handle, offset, whence);
+  // mpg123_seek returns the resulting offset, negative values are errors.
+  off_t rc = mpg123_seek(handle, offset, whence);
 
-  if (rc != MPG123_OK) {
+  if (rc < 0) {
     return DecoderRetCode::SeekRes::Error;
   }
 
@@ -161,6 +170,79 @@ int64_t MPG123Decoder::tell() {
   return mpg123_tell(handle);
 }
 
+DecoderRetCode::SeekRes MPG123Decoder::seek_frame(int64_t frame) {
+  if (handle == nullptr) {
+    return DecoderRetCode::SeekRes::EmptyHandle;
+  }
+
+  // mpg123 offsets are in samples per channel, which is one PCM frame.
+  off_t rc = mpg123_seek(handle, frame, SEEK_SET);
+  if (rc < 0) {
+    return DecoderRetCode::SeekRes::Error;
+  }
+
+  return DecoderRetCode::SeekRes::Success;
+}
+
+int64_t MPG123Decoder::tell_frame() {
+  if (handle == nullptr) {
+    return -1;
+  }
+
+  return mpg123_tell(handle);
+}
+
+int64_t MPG123Decoder::length_frames() {
+  if (handle == nullptr) {
+    return -1;
+  }
+
+  return mpg123_length(handle);
+}
+
+DecoderRetCode::IndexRes
+MPG123Decoder::build_index(std::vector<int64_t> &offsets, int64_t &step) {
+  if (handle == nullptr) {
+    return DecoderRetCode::IndexRes::EmptyHandle;
+  }
+
+  int rc = mpg123_scan(handle);
+  if (rc != MPG123_OK) {
+    return DecoderRetCode::IndexRes::Error;
+  }
+
+  off_t *index_offsets = nullptr;
+  off_t index_step = 0;
+  size_t fill = 0;
+
+  rc = mpg123_index(handle, &index_offsets, &index_step, &fill);
+  if (rc != MPG123_OK) {
+    return DecoderRetCode::IndexRes::Error;
+  }
+
+  offsets.assign(index_offsets, index_offsets + fill);
+  step = index_step;
+
+  return DecoderRetCode::IndexRes::Success;
+}
+
+DecoderRetCode::IndexRes
+MPG123Decoder::set_index(const std::vector<int64_t> &offsets, int64_t step) {
+  if (handle == nullptr) {
+    return DecoderRetCode::IndexRes::EmptyHandle;
+  }
+
+  std::vector<off_t> index_offsets(offsets.begin(), offsets.end());
+
+  int rc = mpg123_set_index(handle, index_offsets.data(), step,
+                            index_offsets.size());
+  if (rc != MPG123_OK) {
+    return DecoderRetCode::IndexRes::Error;
+  }
+
+  return DecoderRetCode::IndexRes::Success;
+}
+
 Enum::DecoderType MPG123Decoder::get_decoder_type() const {
   return Enum::DecoderType::MPG123;
 }
@@ -1,12 +1,23 @@
 #include "library.hpp"
+#include "common/bounded_queue.hpp"
+#include "common/dir_walker.hpp"
+#include "common/fingerprint.hpp"
+#include "common/mpeg_tags.hpp"
 #include "common/types.hpp"
 #include "common/utils.hpp"
 #include "db.hpp"
+#include "decoder.hpp"
 #include <algorithm>
+#include <chrono>
+#include <condition_variable>
 #include <filesystem>
-#include <forward_list>
+#include <functional>
 #include <iostream>
+#include <mutex>
+#include <set>
 #include <string>
+#include <tuple>
+#include <unordered_set>
 #include <taglib/audioproperties.h>
 #include <taglib/fileref.h>
 #include <taglib/tag.h>
@@ -20,107 +31,919 @@ Library::Library(DB *db__) {
   }
 }
 
-Library::~Library() {}
+Library::~Library() { stop_frame_index_job(); }
 
 bool Library::is_initialized() { return db != nullptr; }
 
+// Rows written per transaction while populating the database.
+static constexpr int upsert_batch_size = 500;
+
+// Walked files waiting for a tag reader and read ones waiting for the
+// writer. Together with one batch this is all a scan holds besides the
+// stored snapshot, however many files changed.
+static constexpr size_t tag_read_queue_size = 1024;
+static constexpr size_t write_queue_size = 2 * upsert_batch_size;
+
+static std::int64_t now_epoch() {
+  return std::chrono::duration_cast<std::chrono::seconds>(
+             std::chrono::system_clock::now().time_since_epoch())
+      .count();
+}
+
+// Moves the stored row of a file out of the snapshot, false if it has none.
+static bool take_saved_file(Entity::FileMainPropsMap &saved_files,
+                            const std::filesystem::path &fulldir_path,
+                            const std::filesystem::path &filename,
+                            Entity::FileMainProps &result) {
+  auto saved_dir = saved_files.find(fulldir_path.native());
+  if (saved_dir == saved_files.end()) {
+    return false;
+  }
+
+  auto saved = saved_dir->second.find(filename.native());
+  if (saved == saved_dir->second.end()) {
+    return false;
+  }
+
+  result = std::move(saved->second);
+  saved_dir->second.erase(saved);
+  return true;
+}
+
+// Rows whose file is gone from its path, matched against the new files a
+// scan finds by fingerprint. A match is a move: the row keeps its id and
+// tags and only gets the new path. Rows that may still be matched are
+// removed once the scan is done, the others right away.
+//
+// A new file with the size and mtime of a stored row may be a move. It is
+// only matched once the walk has reported every missing row, and only
+// fingerprinted if one of those still fits. Other new files go straight to
+// the tag readers, so a batch of new rips is not read on the walking thread.
+class MovedFiles {
+public:
+  struct Deferred {
+    WalkEntry entry;
+    int dir_id;
+  };
+
+  explicit MovedFiles(DB *db__) : db(db__) {}
+
+  // Set per root; matching new files is only worth it when the stored rows
+  // have fingerprints.
+  bool enabled = false;
+  // A scan sees every row of its roots by the end of the walk. update_paths
+  // only loads the paths that changed and also asks the DB.
+  bool lookup_db = false;
+
+  // Rows of a scanned root, set before its walk. Without lookup_db only
+  // these can be the source of a move.
+  void track_rows(const Entity::FileMainPropsMap &saved_files) {
+    for (const auto &[fulldir_path, files] : saved_files) {
+      for (const auto &[name, f] : files) {
+        if (f.fingerprint != 0) {
+          stored.emplace(f.dir_id, f.filesize, f.modified_time);
+        }
+      }
+    }
+  }
+
+  bool may_be_moved(const WalkEntry &entry, int dir_id) {
+    return lookup_db || stored.count({dir_id, (unsigned int)entry.size,
+                                      entry.modified_time}) > 0;
+  }
+
+  // `entry` is not in the snapshot, it is matched by resolve_moves().
+  void defer(const WalkEntry &entry, int dir_id) {
+    deferred_dirs.insert(entry.fulldir_path.native());
+    deferred.push_back(Deferred{entry, dir_id});
+  }
+
+  // Such a directory is not checkpointed, its new files are not written yet.
+  bool has_deferred(const std::filesystem::path &dir) {
+    return deferred_dirs.count(dir.native()) > 0;
+  }
+
+  std::vector<Deferred> take_deferred() {
+    candidates.clear();
+    for (const auto &[fingerprint, row] : unmatched) {
+      candidates.emplace(row.dir_id, row.filesize, row.modified_time);
+    }
+
+    deferred_dirs.clear();
+    return std::move(deferred);
+  }
+
+  // False when no missing row has the size and mtime of `entry`, it then
+  // needs no fingerprint to tell.
+  bool may_match(const WalkEntry &entry, int dir_id) {
+    return lookup_db ||
+           candidates.count({dir_id, (unsigned int)entry.size,
+                             entry.modified_time}) > 0;
+  }
+
+  // `row` is not at its path anymore. True when it is kept for matching,
+  // otherwise its id goes to removed_ids unless it has moved already.
+  bool missing(const Entity::FileMainProps &row,
+               std::vector<int> &removed_ids) {
+    if (claimed.count(row.id)) {
+      return false;
+    }
+
+    if (row.fingerprint == 0) {
+      removed_ids.push_back(row.id);
+      return false;
+    }
+
+    unmatched.emplace(row.fingerprint, row);
+    return true;
+  }
+
+  // Finds the row a new file was moved from among the rows reported
+  // missing. With lookup_db any stored row with the same fingerprint whose
+  // path is gone qualifies too. A row whose file is still there was copied,
+  // not moved.
+  bool match(const WalkEntry &entry, int dir_id, std::uint64_t fingerprint,
+             Entity::FileMainPropsMap &saved_files,
+             Entity::FileMainProps &result) {
+    auto same_file = [&](const Entity::FileMainProps &row) {
+      return row.dir_id == dir_id && row.filesize == entry.size &&
+             row.modified_time == entry.modified_time &&
+             !claimed.count(row.id);
+    };
+
+    auto range = unmatched.equal_range(fingerprint);
+    for (auto it = range.first; it != range.second; ++it) {
+      if (same_file(it->second)) {
+        result = std::move(it->second);
+        unmatched.erase(it);
+        claimed.insert(result.id);
+        return true;
+      }
+    }
+
+    if (!lookup_db) {
+      return false;
+    }
+
+    std::vector<Entity::FileMainProps> stored;
+    if (db->get_files_by_fingerprint(dir_id, entry.size, fingerprint,
+                                     stored) !=
+        DBRetCode::GetFileRes::Success) {
+      return false;
+    }
+
+    for (Entity::FileMainProps &row : stored) {
+      std::error_code ec;
+      if (!same_file(row) ||
+          std::filesystem::exists(row.fulldir_path / row.filename, ec) ||
+          ec) {
+        continue;
+      }
+
+      Entity::FileMainProps taken;
+      take_saved_file(saved_files, row.fulldir_path, row.filename, taken);
+      result = std::move(row);
+      claimed.insert(result.id);
+      return true;
+    }
+
+    return false;
+  }
+
+  // Missing rows that can't have moved but are removed with the others.
+  void remove_later(const std::vector<int> &ids) {
+    later.insert(later.end(), ids.begin(), ids.end());
+  }
+
+  // Rows nothing was moved from.
+  void collect_unmatched(std::vector<int> &removed_ids) {
+    for (const auto &[fingerprint, row] : unmatched) {
+      removed_ids.push_back(row.id);
+    }
+    removed_ids.insert(removed_ids.end(), later.begin(), later.end());
+    unmatched.clear();
+    later.clear();
+  }
+
+private:
+  DB *db;
+  std::unordered_multimap<std::uint64_t, Entity::FileMainProps> unmatched;
+  std::unordered_set<int> claimed;
+  std::vector<int> later;
+  std::vector<Deferred> deferred;
+  std::unordered_set<std::string> deferred_dirs;
+  // dir_id, size and mtime of the tracked rows and of those in `unmatched`.
+  std::set<std::tuple<int, unsigned int, std::int64_t>> stored;
+  std::set<std::tuple<int, unsigned int, std::int64_t>> candidates;
+};
+
+static bool has_fingerprints(const Entity::FileMainPropsMap &saved_files) {
+  for (const auto &[fulldir_path, files] : saved_files) {
+    for (const auto &[name, f] : files) {
+      if (f.fingerprint != 0) {
+        return true;
+      }
+    }
+  }
+  return false;
+}
+
+// A file whose tags are read by a worker. `file` arrives with everything but
+// the tags filled in, the worker completes it in place. A `relocate` job
+// only points an existing row at the file and fills in its fingerprint,
+// `update` then means the path is unchanged.
+struct TagReadJob {
+  std::filesystem::path fullpath;
+  Entity::File file;
+  bool update;
+  bool relocate = false;
+  bool ok;
+};
+
+// walk -> tag read -> DB write. The scanning thread pushes the files its
+// walk finds changed, a pool of workers reads their tags and a single
+// writer upserts them in batches, so rows show up while the walk is still
+// running. Queues between the stages are bounded, a slow stage holds the
+// ones before it back.
+//
+// After every batch the writer also saves a checkpoint: the directories
+// that are listed and have all their files written, the rows they no
+// longer hold and the journal of each root. A scan that is interrupted
+// skips those directories next time.
+class ScanPipeline {
+public:
+  ScanPipeline(DB *db__, int thread_count,
+               std::function<bool(TagReadJob &)> read_tags__)
+      : db(db__), read_tags(read_tags__), to_read(tag_read_queue_size),
+        to_write(write_queue_size) {
+    if (thread_count <= 0) {
+      thread_count = std::max(1u, std::thread::hardware_concurrency());
+    }
+
+    live_readers = thread_count;
+    for (int t = 0; t < thread_count; t++) {
+      readers.emplace_back([this]() { read_loop(); });
+    }
+    writer = std::thread([this]() { write_loop(); });
+  }
+
+  ~ScanPipeline() {
+    to_read.cancel();
+    to_write.cancel();
+    join();
+  }
+
+  ScanPipeline(const ScanPipeline &) = delete;
+  ScanPipeline &operator=(const ScanPipeline &) = delete;
+
+  // Roots whose journal is saved with each checkpoint.
+  void track_root(const Entity::ScanJournal &journal) {
+    std::lock_guard<std::mutex> lock(progress_mtx);
+    journals[journal.dir_id] = journal;
+  }
+
+  const Entity::ScanJournal get_journal(int dir_id) {
+    std::lock_guard<std::mutex> lock(progress_mtx);
+    return journals[dir_id];
+  }
+
+  // False once the pipeline has failed, the caller may stop feeding it.
+  bool push(TagReadJob job) {
+    {
+      std::lock_guard<std::mutex> lock(progress_mtx);
+      dirs[job.file.fulldir_path.native()].outstanding++;
+    }
+    return to_read.push(std::move(job));
+  }
+
+  // `dir` has been listed, `removed_ids` are its rows that were not found
+  // and `subdirs` the subdirectories the walk will visit later.
+  void dir_listed(const Entity::ScannedDir &dir,
+                  std::vector<Entity::ScannedDir> subdirs,
+                  std::vector<int> removed_ids) {
+    std::lock_guard<std::mutex> lock(progress_mtx);
+    DirProgress &progress = dirs[dir.path.native()];
+    progress.listed = true;
+    progress.dir = dir;
+    progress.subdirs = std::move(subdirs);
+    progress.removed_ids = std::move(removed_ids);
+
+    if (progress.outstanding == 0) {
+      complete_dir(dir.path.native());
+    }
+  }
+
+  // Drops the files no reader has taken yet, the ones already read are
+  // still written.
+  void cancel() { to_read.cancel(); }
+
+  // Waits for everything pushed so far to be written.
+  LibRetCode::ScanRes finish() {
+    to_read.close();
+    join();
+
+    std::cout << added << " files added, " << updated << " files updated, "
+              << moved << " files moved" << '\n';
+    return res;
+  }
+
+private:
+  struct DirProgress {
+    size_t outstanding = 0;
+    bool listed = false;
+    Entity::ScannedDir dir;
+    std::vector<Entity::ScannedDir> subdirs;
+    std::vector<int> removed_ids;
+  };
+
+  DB *db;
+  std::function<bool(TagReadJob &)> read_tags;
+
+  BoundedQueue<TagReadJob> to_read;
+  BoundedQueue<TagReadJob> to_write;
+  std::vector<std::thread> readers;
+  std::atomic<int> live_readers = 0;
+  std::thread writer;
+
+  // Written by the writer thread.
+  int added = 0;
+  int updated = 0;
+  int moved = 0;
+  LibRetCode::ScanRes res = LibRetCode::ScanRes::Success;
+
+  // Shared between the scanning and the writer thread.
+  std::mutex progress_mtx;
+  std::unordered_map<std::string, DirProgress> dirs;
+  std::map<int, Entity::ScanJournal> journals;
+  std::vector<int> checkpoint_removed;
+  std::vector<Entity::ScannedDir> checkpoint_done;
+  std::vector<Entity::ScannedDir> checkpoint_new;
+
+  void join() {
+    for (std::thread &t : readers) {
+      if (t.joinable()) {
+        t.join();
+      }
+    }
+    if (writer.joinable()) {
+      writer.join();
+    }
+  }
+
+  // Called with progress_mtx held.
+  void complete_dir(const std::string &key) {
+    auto it = dirs.find(key);
+    DirProgress &progress = it->second;
+
+    checkpoint_removed.insert(checkpoint_removed.end(),
+                              progress.removed_ids.begin(),
+                              progress.removed_ids.end());
+    checkpoint_new.insert(checkpoint_new.end(), progress.subdirs.begin(),
+                          progress.subdirs.end());
+    checkpoint_done.push_back(progress.dir);
+
+    auto journal = journals.find(progress.dir.dir_id);
+    if (journal != journals.end()) {
+      journal->second.dirs_done++;
+    }
+
+    dirs.erase(it);
+  }
+
+  // Marks the files of a committed batch as written and saves what became
+  // complete with them.
+  bool checkpoint(const std::vector<TagReadJob> &written) {
+    std::vector<int> removed_ids;
+    std::vector<Entity::ScannedDir> done_dirs;
+    std::vector<Entity::ScannedDir> new_dirs;
+    std::vector<Entity::ScanJournal> root_journals;
+
+    {
+      std::lock_guard<std::mutex> lock(progress_mtx);
+      for (const TagReadJob &job : written) {
+        auto journal = journals.find(job.file.dir_id);
+        if (job.ok && journal != journals.end()) {
+          journal->second.files_written++;
+        }
+
+        auto it = dirs.find(job.file.fulldir_path.native());
+        if (it == dirs.end()) {
+          continue;
+        }
+
+        DirProgress &progress = it->second;
+        progress.outstanding--;
+        if (progress.outstanding > 0) {
+          continue;
+        }
+
+        if (progress.listed) {
+          complete_dir(it->first);
+        } else {
+          // Written before its listing finished, dir_listed() completes it.
+          dirs.erase(it);
+        }
+      }
+
+      removed_ids.swap(checkpoint_removed);
+      done_dirs.swap(checkpoint_done);
+      new_dirs.swap(checkpoint_new);
+      for (auto &[dir_id, journal] : journals) {
+        journal.checkpoint_time = now_epoch();
+        root_journals.push_back(journal);
+      }
+    }
+
+    if (removed_ids.empty() && done_dirs.empty() && new_dirs.empty() &&
+        root_journals.empty()) {
+      return true;
+    }
+
+    return db->save_scan_checkpoint(removed_ids, done_dirs, new_dirs,
+                                    root_journals) ==
+           DBRetCode::SaveCheckpointRes::Success;
+  }
+
+  void read_loop() {
+    TagReadJob job;
+    while (to_read.pop(job)) {
+      job.ok = read_tags(job);
+      if (!to_write.push(std::move(job))) {
+        break;
+      }
+    }
+
+    if (--live_readers == 0) {
+      to_write.close();
+    }
+  }
+
+  void fail(LibRetCode::ScanRes error) {
+    res = error;
+    to_read.cancel();
+    to_write.cancel();
+  }
+
+  void write_loop() {
+    std::vector<TagReadJob> written;
+    std::vector<Entity::File> batch;
+    std::vector<Entity::File> relocated;
+    std::vector<int> batch_ids;
+    int batch_added = 0;
+    int batch_updated = 0;
+    int batch_moved = 0;
+    batch.reserve(upsert_batch_size);
+
+    TagReadJob job;
+    bool more = true;
+    while (more) {
+      more = to_write.pop(job);
+      if (more) {
+        if (!job.ok) {
+          std::cerr << "Could not read metadata of " << job.fullpath << '\n';
+        } else if (job.relocate) {
+          relocated.push_back(job.file);
+          if (!job.update) {
+            batch_moved++;
+          }
+        } else {
+          batch.push_back(job.file);
+          if (job.update) {
+            batch_updated++;
+          } else {
+            batch_added++;
+          }
+        }
+        written.push_back(std::move(job));
+
+        if (written.size() < (size_t)upsert_batch_size) {
+          continue;
+        }
+      }
+
+      if (!batch.empty() &&
+          db->upsert_files(batch, upsert_batch_size, batch_ids) !=
+              DBRetCode::UpsertFilesRes::Success) {
+        fail(batch_added > 0 ? LibRetCode::ScanRes::AddingUnreadFilesError
+                             : LibRetCode::ScanRes::UpdatingFilesError);
+        return;
+      }
+
+      if (db->relocate_files(relocated) !=
+          DBRetCode::UpdateFileRes::Success) {
+        fail(LibRetCode::ScanRes::UpdatingFilesError);
+        return;
+      }
+
+      if (!checkpoint(written)) {
+        fail(LibRetCode::ScanRes::SqlError);
+        return;
+      }
+
+      if (batch.empty() && relocated.empty()) {
+        written.clear();
+        continue;
+      }
+
+      added += batch_added;
+      updated += batch_updated;
+      moved += batch_moved;
+      written.clear();
+      batch.clear();
+      relocated.clear();
+      batch_added = 0;
+      batch_updated = 0;
+      batch_moved = 0;
+
+      std::cout << "Added " << added << ", updated " << updated
+                << ", moved " << moved << " files..." << '\n';
+    }
+  }
+};
+
 LibRetCode::ScanRes Library::full_scan() {
+  const std::uint64_t generation = cancel_generation;
+  std::lock_guard<std::mutex> lock(scan_mtx);
+
   std::vector<Entity::Directory> directories;
   if (db->get_directories_list(directories) != DBRetCode::GetDirRes::Success) {
     return LibRetCode::ScanRes::CannotGetDirs;
   }
 
-  std::forward_list<Entity::UnreadFile> unread_files;
-  int unread_file_count = 0;
+  return scan_directories(directories, generation);
+}
+
+LibRetCode::ScanRes Library::partial_scan(int dir_id) {
+  const std::uint64_t generation = cancel_generation;
+  std::lock_guard<std::mutex> lock(scan_mtx);
+
+  Entity::Directory dir;
+  if (db->get_directory(dir_id, dir) != DBRetCode::GetDirRes::Success) {
+    return LibRetCode::ScanRes::CannotGetDir;
+  }
+
+  return scan_directories({dir}, generation);
+}
+
+// Also cancels scans still waiting for scan_mtx, they see the generation
+// move past the one they were requested in.
+void Library::cancel_scan() {
+  cancel_generation++;
+  scan_cancel = true;
+}
 
-  std::forward_list<Entity::File> update_needed_files;
-  int update_needed_file_count = 0;
+LibRetCode::ScanRes
+Library::scan_directories(const std::vector<Entity::Directory> &directories,
+                          std::uint64_t generation) {
+  // Cleared before the check, so a cancel_scan() racing with it is kept
+  // either way.
+  scan_cancel = false;
+  if (cancel_generation != generation) {
+    scan_cancel = true;
+  }
 
-  std::map<std::filesystem::path, Entity::FileMainProps> saved_files;
+  ScanPipeline pipeline(db, tag_read_threads, read_tags_fn());
+  MovedFiles moved(db);
+
+  Entity::FileMainPropsMap saved_files;
+  std::map<int, std::vector<Entity::ScannedDir>> scanned_dirs;
+  std::vector<int> removed_ids;
+  LibRetCode::ScanRes res = LibRetCode::ScanRes::Success;
 
   for (const auto &dir : directories) {
+    Entity::ScanJournal journal;
+    DBRetCode::GetScanJournalRes journal_res =
+        db->get_scan_journal(dir.id, journal);
+    if (journal_res == DBRetCode::GetScanJournalRes::SqlError) {
+      return LibRetCode::ScanRes::SqlError;
+    }
+
+    if (journal_res == DBRetCode::GetScanJournalRes::Success &&
+        journal.state != Enum::ScanState::FINISHED) {
+      std::cout << "Resuming scan of " << dir.path << " ("
+                << journal.files_written << " files written)" << '\n';
+    } else {
+      journal = Entity::ScanJournal(dir.id, Enum::ScanState::RUNNING,
+                                    now_epoch(), now_epoch(), 0, 0);
+    }
+
+    journal.state = Enum::ScanState::RUNNING;
+    if (db->set_scan_journal(journal) !=
+        DBRetCode::SetScanJournalRes::Success) {
+      return LibRetCode::ScanRes::SqlError;
+    }
+    pipeline.track_root(journal);
+
     if (db->get_dir_files_main_props(dir.id, saved_files) !=
         DBRetCode::GetFileRes::Success) {
       return LibRetCode::ScanRes::SqlError;
     }
 
-    if (scan_dir_changed_files(dir, saved_files, unread_files,
-                               unread_file_count, update_needed_files,
-                               update_needed_file_count) !=
-        LibRetCode::ScanRes::Success) {
-      return LibRetCode::ScanRes::GettingUnreadFilesError;
+    moved.enabled = has_fingerprints(saved_files);
+    moved.track_rows(saved_files);
+
+    std::unordered_set<std::string> unchanged_dirs;
+    std::vector<std::filesystem::path> unreadable_dirs;
+    res = scan_dir_changed_files(dir, saved_files, pipeline, moved,
+                                 scanned_dirs[dir.id], unchanged_dirs,
+                                 unreadable_dirs);
+    if (res != LibRetCode::ScanRes::Success) {
+      break;
     }
 
-    for (const auto &[k, f] : saved_files) {
-      std::filesystem::path fullpath =
-          db->get_file_fullpath(f.fulldir_path, f.filename);
-      if (!std::filesystem::exists(fullpath)) {
-        if (db->remove_file(f.id) != DBRetCode::RmvFileRes::Success) {
-          return LibRetCode::ScanRes::SqlError;
-        }
-      }
+    collect_removed_files(saved_files, unchanged_dirs, unreadable_dirs, moved,
+                          removed_ids);
+    resolve_moves(moved, saved_files, pipeline);
+  }
+
+  if (res == LibRetCode::ScanRes::Cancelled) {
+    pipeline.cancel();
+  }
+
+  LibRetCode::ScanRes pipeline_res = pipeline.finish();
+  if (res == LibRetCode::ScanRes::Cancelled) {
+    for (const auto &[dir_id, dirs] : scanned_dirs) {
+      Entity::ScanJournal journal = pipeline.get_journal(dir_id);
+      journal.state = Enum::ScanState::CANCELLED;
+      db->set_scan_journal(journal);
     }
+    return res;
+  }
+
+  if (res != LibRetCode::ScanRes::Success) {
+    return res;
+  }
+
+  if (pipeline_res != LibRetCode::ScanRes::Success) {
+    return pipeline_res;
   }
 
-  std::cout << unread_file_count << " unread file found" << '\n';
-  std::cout << update_needed_file_count << " update needed file found" << '\n';
+  moved.collect_unmatched(removed_ids);
+  if (db->remove_files(removed_ids) != DBRetCode::RmvFileRes::Success) {
+    return LibRetCode::ScanRes::SqlError;
+  }
+
+  // The full list replaces the checkpointed one, dropping directories that
+  // are gone.
+  for (const auto &[dir_id, dirs] : scanned_dirs) {
+    if (db->set_scanned_dirs(dir_id, dirs) !=
+        DBRetCode::SetScannedDirsRes::Success) {
+      return LibRetCode::ScanRes::SqlError;
+    }
 
-  if (populate_files_into_db(unread_files, unread_file_count,
-                             update_needed_files, update_needed_file_count) !=
-      LibRetCode::ScanRes::Success) {
-    return LibRetCode::ScanRes::AddingUnreadFilesError;
+    Entity::ScanJournal journal = pipeline.get_journal(dir_id);
+    journal.state = Enum::ScanState::FINISHED;
+    journal.checkpoint_time = now_epoch();
+    if (db->set_scan_journal(journal) !=
+        DBRetCode::SetScanJournalRes::Success) {
+      return LibRetCode::ScanRes::SqlError;
+    }
   }
 
+  start_frame_index_job();
+
   return LibRetCode::ScanRes::Success;
 }
 
-LibRetCode::ScanRes Library::partial_scan(int dir_id) {
-  Entity::Directory dir;
-  if (db->get_directory(dir_id, dir) != DBRetCode::GetDirRes::Success) {
-    return LibRetCode::ScanRes::CannotGetDir;
+LibRetCode::ScanRes
+Library::update_paths(int dir_id, const std::set<std::filesystem::path> &files,
+                      const std::set<std::filesystem::path> &trees) {
+  std::lock_guard<std::mutex> lock(scan_mtx);
+
+  ScanPipeline pipeline(db, tag_read_threads, read_tags_fn());
+  // The snapshots below are small, a move needs a lookup either way.
+  MovedFiles moved(db);
+  moved.enabled = true;
+  moved.lookup_db = true;
+
+  Entity::FileMainPropsMap saved_files;
+  const std::unordered_set<std::string> no_unchanged_dirs;
+  std::vector<std::filesystem::path> unreadable_dirs;
+  std::vector<int> removed_ids;
+
+  WalkDirHooks hooks;
+  hooks.on_dir = [&](const WalkDirInfo &info) {
+    if (info.unreadable) {
+      unreadable_dirs.push_back(info.path);
+    }
+  };
+
+  std::filesystem::path last_tree;
+  for (const std::filesystem::path &tree : trees) {
+    // Sorted, so a tree inside the previous one follows it directly.
+    if (!last_tree.empty() && is_path_within(tree, last_tree)) {
+      continue;
+    }
+    last_tree = tree;
+
+    if (db->get_files_main_props_in(dir_id, tree, true, saved_files) !=
+        DBRetCode::GetFileRes::Success) {
+      return LibRetCode::ScanRes::SqlError;
+    }
+
+    WalkRetCode::WalkRes walk_res = walk_audio_files(
+        tree,
+        [&](const WalkEntry &entry) {
+          check_scanned_file(entry, dir_id, saved_files, pipeline, moved);
+        },
+        &hooks);
+
+    // A tree that is gone can't be opened, everything below it is removed.
+    // One that is still there but unreadable keeps its rows.
+    std::error_code ec;
+    if (walk_res == WalkRetCode::WalkRes::CannotOpenDir &&
+        (std::filesystem::exists(tree, ec) || ec)) {
+      unreadable_dirs.push_back(tree);
+    }
+
+    collect_removed_files(saved_files, no_unchanged_dirs, unreadable_dirs,
+                          moved, removed_ids);
   }
 
-  std::forward_list<Entity::UnreadFile> unread_files;
-  int unread_file_count = 0;
+  auto in_tree = [&](const std::filesystem::path &file) {
+    for (std::filesystem::path p = file.parent_path();
+         p.has_relative_path(); p = p.parent_path()) {
+      if (trees.count(p)) {
+        return true;
+      }
+    }
+    return false;
+  };
+
+  std::map<std::filesystem::path, std::vector<std::filesystem::path>>
+      files_by_dir;
+  for (const std::filesystem::path &file : files) {
+    if (!in_tree(file)) {
+      files_by_dir[file.parent_path()].push_back(file);
+    }
+  }
 
-  std::forward_list<Entity::File> update_needed_files;
-  int update_needed_file_count = 0;
+  for (const auto &[fulldir_path, dir_files] : files_by_dir) {
+    if (db->get_files_main_props_in(dir_id, fulldir_path, false,
+                                    saved_files) !=
+        DBRetCode::GetFileRes::Success) {
+      return LibRetCode::ScanRes::SqlError;
+    }
 
-  std::map<std::filesystem::path, Entity::FileMainProps> saved_files;
+    for (const std::filesystem::path &file : dir_files) {
+      WalkEntry entry;
+      if (stat_audio_file(file, entry)) {
+        check_scanned_file(entry, dir_id, saved_files, pipeline, moved);
+        continue;
+      }
 
-  if (db->get_dir_files_main_props(dir.id, saved_files) !=
-      DBRetCode::GetFileRes::Success) {
+      Entity::FileMainProps saved;
+      if (take_saved_file(saved_files, fulldir_path, file.filename(),
+                          saved)) {
+        moved.missing(saved, removed_ids);
+      }
+    }
+  }
+
+  resolve_moves(moved, saved_files, pipeline);
+
+  LibRetCode::ScanRes res = pipeline.finish();
+  if (res != LibRetCode::ScanRes::Success) {
+    return res;
+  }
+
+  moved.collect_unmatched(removed_ids);
+  if (db->remove_files(removed_ids) != DBRetCode::RmvFileRes::Success) {
     return LibRetCode::ScanRes::SqlError;
   }
 
-  if (scan_dir_changed_files(dir, saved_files, unread_files, unread_file_count,
-                             update_needed_files, update_needed_file_count) !=
-      LibRetCode::ScanRes::Success) {
-    return LibRetCode::ScanRes::GettingUnreadFilesError;
+  start_frame_index_job();
+
+  return LibRetCode::ScanRes::Success;
+}
+
+LibRetCode::BuildIndexesRes Library::build_frame_indexes(int min_length) {
+  std::vector<Entity::FileMainProps> files;
+  if (db->get_unindexed_files(Enum::FileType::MP3, min_length, files) !=
+      DBRetCode::GetFileRes::Success) {
+    return LibRetCode::BuildIndexesRes::SqlError;
+  }
+
+  std::unique_ptr<Decoder> decoder =
+      DecoderFactory::create(Enum::FileType::MP3);
+  if (!decoder || !decoder->is_initialized()) {
+    return LibRetCode::BuildIndexesRes::Success;
   }
 
-  for (const auto &[k, f] : saved_files) {
+  for (const Entity::FileMainProps &f : files) {
+    if (index_job_cancel) {
+      return LibRetCode::BuildIndexesRes::Cancelled;
+    }
+
     std::filesystem::path fullpath =
         db->get_file_fullpath(f.fulldir_path, f.filename);
-    if (!std::filesystem::exists(fullpath)) {
-      if (db->remove_file(f.id) != DBRetCode::RmvFileRes::Success) {
-        return LibRetCode::ScanRes::SqlError;
-      }
+
+    Entity::FrameIndex index;
+    index.file_id = f.id;
+    index.modified_time = f.modified_time;
+    index.filesize = f.filesize;
+    index.step = 0;
+
+    bool built = false;
+    if (decoder->open(fullpath) == DecoderRetCode::OpenRes::Success) {
+      built = decoder->build_index(index.offsets, index.step) ==
+              DecoderRetCode::IndexRes::Success;
+      decoder->close();
+    }
+
+    // Saved without offsets, so a broken file is not scanned again after
+    // every scan until it changes.
+    if (!built) {
+      std::cerr << "Could not build seek index of " << fullpath << '\n';
+      index.offsets.clear();
+      index.step = 0;
+    }
+
+    if (db->set_frame_index(index) != DBRetCode::SetFrameIndexRes::Success) {
+      return LibRetCode::BuildIndexesRes::SqlError;
     }
   }
 
-  std::cout << unread_file_count << " unread file found" << '\n';
-  std::cout << update_needed_file_count << " update needed file found" << '\n';
+  return LibRetCode::BuildIndexesRes::Success;
+}
 
-  if (populate_files_into_db(unread_files, unread_file_count,
-                             update_needed_files, update_needed_file_count) !=
-      LibRetCode::ScanRes::Success) {
-    return LibRetCode::ScanRes::AddingUnreadFilesError;
+// Hands new work to the index worker, starting it the first time. A run in
+// progress is not interrupted, the worker queries again once it is done and
+// picks up the files it has not indexed yet.
+void Library::start_frame_index_job() {
+  std::lock_guard<std::mutex> ctl_lock(index_ctl_mtx);
+  std::lock_guard<std::mutex> lock(index_mtx);
+  if (frame_index_min_length <= 0) {
+    return;
   }
 
-  return LibRetCode::ScanRes::Success;
+  index_pending = true;
+  if (!index_thrd.joinable()) {
+    index_exit = false;
+    index_job_cancel = false;
+    index_thrd = std::thread([this]() { index_loop(); });
+  }
+  index_cv.notify_one();
+}
+
+void Library::stop_frame_index_job() {
+  std::lock_guard<std::mutex> ctl_lock(index_ctl_mtx);
+  {
+    std::lock_guard<std::mutex> lock(index_mtx);
+    index_exit = true;
+    index_pending = false;
+    index_job_cancel = true;
+  }
+  index_cv.notify_all();
+
+  if (index_thrd.joinable()) {
+    index_thrd.join();
+  }
+}
+
+void Library::index_loop() {
+  while (true) {
+    int min_length;
+    {
+      std::unique_lock<std::mutex> lock(index_mtx);
+      index_cv.wait(lock, [this]() { return index_exit || index_pending; });
+      if (index_exit) {
+        return;
+      }
+      index_pending = false;
+      min_length = frame_index_min_length;
+    }
+
+    build_frame_indexes(min_length);
+  }
+}
+
+void Library::set_frame_index_min_length(int seconds) {
+  std::lock_guard<std::mutex> lock(index_mtx);
+  frame_index_min_length = seconds;
+}
+
+void Library::set_tag_read_threads(int count) { tag_read_threads = count; }
+
+std::function<bool(TagReadJob &)> Library::read_tags_fn() {
+  return [this](TagReadJob &job) {
+    if (job.file.fingerprint == 0 &&
+        !file_fingerprint(job.fullpath, job.file.filesize,
+                          job.file.fingerprint)) {
+      return false;
+    }
+
+    if (job.relocate) {
+      return true;
+    }
+
+    return read_file_tags(job.fullpath, job.file) ==
+           LibRetCode::ReadFileTagsRes::Success;
+  };
 }
 
+void Library::set_skip_unchanged_dirs(bool skip) { skip_unchanged_dirs = skip; }
+
 LibRetCode::InitArtistsRes Library::init_artists() {
   DBGetOpt::ArtistsOptions opts;
   opts.sortby = artists_sortby;
@@ -172,140 +995,243 @@ DBGetOpt::SortAlbums Library::get_albums_sortby_opt() { return albums_sortby; }
 
 bool Library::is_using_albumartist() { return use_albumartist; }
 
-LibRetCode::ScanRes Library::scan_dir_changed_files(
-    Entity::Directory dir,
-    const std::map<std::filesystem::path, Entity::FileMainProps> &saved_files,
-    std::forward_list<Entity::UnreadFile> &unread_files, int &unread_file_count,
-    std::forward_list<Entity::File> &update_needed_files,
-    int &update_needed_file_count) {
-
-  for (const auto &entry :
-       std::filesystem::recursive_directory_iterator(dir.path)) {
-    Enum::FileType filetype = db->get_filetype(entry);
-    if (filetype == Enum::FileType::UNKNOWN) {
-      continue;
-    }
-
-    std::filesystem::path fullpath = entry.path();
-    std::filesystem::path basename = fullpath.filename();
-    std::filesystem::path fulldir_path = fullpath.parent_path();
-
-    uintmax_t filesize = std::filesystem::file_size(fullpath);
-
-    std::int64_t cftime = get_file_mtime_epoch(fullpath);
-
-    try {
-      Entity::FileMainProps existed_file = saved_files.at(fullpath);
-      if (existed_file.modified_time == cftime &&
-          existed_file.filesize == filesize) {
-        continue;
+void Library::check_scanned_file(const WalkEntry &entry, int dir_id,
+                                 Entity::FileMainPropsMap &saved_files,
+                                 ScanPipeline &pipeline, MovedFiles &moved) {
+  std::filesystem::path fullpath = entry.fulldir_path / entry.filename;
+  const unsigned int filesize = entry.size;
+  const std::int64_t cftime = entry.modified_time;
+
+  TagReadJob job;
+  job.fullpath = fullpath;
+
+  // Matched rows leave the snapshot, whatever is left after the walk is no
+  // longer on disk.
+  Entity::FileMainProps existed_file;
+  if (take_saved_file(saved_files, entry.fulldir_path, entry.filename,
+                      existed_file)) {
+    if (existed_file.modified_time == cftime &&
+        existed_file.filesize == filesize) {
+      // Rows stored before fingerprints existed get one, off this thread.
+      if (existed_file.fingerprint == 0) {
+        job.file.id = existed_file.id;
+        job.file.dir_id = existed_file.dir_id;
+        job.file.filename = existed_file.filename;
+        job.file.fulldir_path = existed_file.fulldir_path;
+        job.file.filesize = filesize;
+        job.update = true;
+        job.relocate = true;
+        pipeline.push(std::move(job));
       }
+      return;
+    }
 
-      Entity::File update_needed_file;
-      update_needed_file.id = existed_file.id;
-      update_needed_file.dir_id = existed_file.dir_id;
-      update_needed_file.filename = existed_file.filename;
-      update_needed_file.fulldir_path = existed_file.fulldir_path;
-      update_needed_file.created_time = existed_file.created_time;
-      update_needed_file.filetype = existed_file.filetype;
-      update_needed_file.filesize = filesize;
-      update_needed_file.modified_time = cftime;
+    job.file.id = existed_file.id;
+    job.file.dir_id = existed_file.dir_id;
+    job.file.filename = existed_file.filename;
+    job.file.fulldir_path = existed_file.fulldir_path;
+    job.file.created_time = existed_file.created_time;
+    job.file.filetype = existed_file.filetype;
+    job.file.filesize = filesize;
+    job.file.modified_time = cftime;
+    job.update = true;
+
+    pipeline.push(std::move(job));
+    return;
+  }
 
-      update_needed_file_count++;
-      update_needed_files.push_front(update_needed_file);
-    } catch (std::out_of_range) {
-      Entity::UnreadFile unread_file;
+  if (moved.enabled && moved.may_be_moved(entry, dir_id)) {
+    moved.defer(entry, dir_id);
+    return;
+  }
 
-      unread_file.fullpath = fullpath;
-      unread_file.filename = basename;
-      unread_file.dir_id = dir.id;
-      unread_file.fulldir_path = fulldir_path;
-      unread_file.created_time = cftime;
-      unread_file.modified_time = cftime;
-      unread_file.filesize = filesize;
-      unread_file.filetype = filetype;
+  push_new_file(entry, dir_id, 0, pipeline);
+}
 
-      unread_file_count++;
-      unread_files.push_front(unread_file);
+// Runs once the walk is done and every missing row has been reported. Only
+// new files with the size and mtime of such a row are read for their
+// fingerprint, the others are added and get theirs from a tag reader.
+void Library::resolve_moves(MovedFiles &moved,
+                            Entity::FileMainPropsMap &saved_files,
+                            ScanPipeline &pipeline) {
+  for (const MovedFiles::Deferred &d : moved.take_deferred()) {
+    const WalkEntry &entry = d.entry;
+    const std::filesystem::path fullpath = entry.fulldir_path / entry.filename;
+
+    std::uint64_t fingerprint = 0;
+    Entity::FileMainProps moved_file;
+    if (!moved.may_match(entry, d.dir_id) ||
+        !file_fingerprint(fullpath, entry.size, fingerprint) ||
+        !moved.match(entry, d.dir_id, fingerprint, saved_files, moved_file)) {
+      push_new_file(entry, d.dir_id, fingerprint, pipeline);
+      continue;
     }
-  }
 
-  return LibRetCode::ScanRes::Success;
+    TagReadJob job;
+    job.fullpath = fullpath;
+    job.file.id = moved_file.id;
+    job.file.dir_id = d.dir_id;
+    job.file.filename = entry.filename;
+    job.file.fulldir_path = entry.fulldir_path;
+    job.file.filesize = entry.size;
+    job.file.fingerprint = fingerprint;
+    job.update = false;
+    job.relocate = true;
+
+    pipeline.push(std::move(job));
+  }
 }
 
-LibRetCode::ScanRes Library::populate_files_into_db(
-    const std::forward_list<Entity::UnreadFile> &unread_files,
-    int unread_file_count,
-    const std::forward_list<Entity::File> &update_needed_files,
-    int update_needed_file_count) {
-  int added_count = 0;
-  int updated_count = 0;
+void Library::push_new_file(const WalkEntry &entry, int dir_id,
+                            std::uint64_t fingerprint,
+                            ScanPipeline &pipeline) {
+  TagReadJob job;
+  job.fullpath = entry.fulldir_path / entry.filename;
+  job.file.dir_id = dir_id;
+  job.file.filename = entry.filename;
+  job.file.fulldir_path = entry.fulldir_path;
+  job.file.created_time = entry.modified_time;
+  job.file.modified_time = entry.modified_time;
+  job.file.filesize = entry.size;
+  job.file.filetype = entry.filetype;
+  job.file.fingerprint = fingerprint;
+  job.update = false;
+
+  pipeline.push(std::move(job));
+}
 
-  for (const Entity::UnreadFile &file : unread_files) {
-    Entity::File newfile;
-    if (read_file_tags(file.fullpath, newfile) !=
-        LibRetCode::ReadFileTagsRes::Success) {
-      std::cerr << "Could not read metadata of " << file.fullpath << '\n';
+void Library::collect_removed_files(
+    const Entity::FileMainPropsMap &remaining,
+    const std::unordered_set<std::string> &unchanged_dirs,
+    const std::vector<std::filesystem::path> &unreadable_dirs,
+    MovedFiles &moved, std::vector<int> &removed_ids) {
+  for (const auto &[fulldir_path, files] : remaining) {
+    // Skipped directories were not listed, their files are still there.
+    if (unchanged_dirs.count(fulldir_path)) {
       continue;
     }
 
-    newfile.dir_id = file.dir_id;
-    newfile.filename = file.filename;
-    newfile.fulldir_path = file.fulldir_path;
-    newfile.created_time = file.created_time;
-    newfile.modified_time = file.modified_time;
-    newfile.filesize = file.filesize;
-    newfile.filetype = file.filetype;
-
-    int result_id;
-    DBRetCode::AddFileRes rc = db->add_file(newfile, result_id);
-    if (rc == DBRetCode::AddFileRes::FileAlreadyExists) {
+    // Nothing is known about what is below a directory that failed to read.
+    bool unreadable = false;
+    for (const std::filesystem::path &dir : unreadable_dirs) {
+      unreadable |= is_path_within(fulldir_path, dir);
+    }
+    if (unreadable) {
       continue;
     }
 
-    if (rc != DBRetCode::AddFileRes::Success) {
-      return LibRetCode::ScanRes::AddingUnreadFilesError;
+    for (const auto &[name, f] : files) {
+      moved.missing(f, removed_ids);
     }
+  }
+}
 
-    added_count++;
+LibRetCode::ScanRes Library::scan_dir_changed_files(
+    Entity::Directory dir, Entity::FileMainPropsMap &saved_files,
+    ScanPipeline &pipeline, MovedFiles &moved,
+    std::vector<Entity::ScannedDir> &scanned_dirs,
+    std::unordered_set<std::string> &unchanged_dirs,
+    std::vector<std::filesystem::path> &unreadable_dirs) {
+
+  std::map<std::filesystem::path, Entity::ScannedDir> saved_dirs;
+  if (skip_unchanged_dirs &&
+      db->get_scanned_dirs(dir.id, saved_dirs) !=
+          DBRetCode::GetScannedDirsRes::Success) {
+    return LibRetCode::ScanRes::SqlError;
+  }
 
-    std::cout << "Added (" << added_count << " / " << unread_file_count
-              << ") files..." << '\n';
+  // A skipped directory is not read, so its subdirectories come from the
+  // previous scan. Any added or removed subdirectory changes its mtime.
+  std::map<std::filesystem::path, std::vector<std::filesystem::path>>
+      saved_subdirs;
+  for (const auto &[path, d] : saved_dirs) {
+    if (path != dir.path) {
+      saved_subdirs[path.parent_path()].push_back(path);
+    }
   }
 
-  for (const Entity::File &file : update_needed_files) {
-    Entity::File newfile;
+  WalkDirHooks hooks;
+  hooks.should_list = [&](const std::filesystem::path &path,
+                          std::int64_t modified_time_ns,
+                          std::vector<std::filesystem::path> &subdirs) {
+    auto saved = saved_dirs.find(path);
+    if (saved == saved_dirs.end() ||
+        saved->second.modified_time_ns != modified_time_ns) {
+      return true;
+    }
 
-    std::filesystem::path fullpath = db->get_file_fullpath(file);
+    auto children = saved_subdirs.find(path);
+    if (children != saved_subdirs.end()) {
+      subdirs = children->second;
+    }
+    unchanged_dirs.insert(path.native());
+    return false;
+  };
+  hooks.on_dir = [&](const WalkDirInfo &info) {
+    // Kept with a time that never matches, so the next scan reads it again
+    // even when its parent is skipped, and never checkpointed.
+    if (info.unreadable) {
+      unreadable_dirs.push_back(info.path);
+      scanned_dirs.emplace_back(dir.id, info.path, -1, 0);
+      return;
+    }
 
-    if (read_file_tags(fullpath, newfile) !=
-        LibRetCode::ReadFileTagsRes::Success) {
-      std::cerr << "Could not read metadata of " << fullpath << '\n';
-      continue;
+    if (!info.listed) {
+      scanned_dirs.emplace_back(dir.id, info.path, info.modified_time_ns,
+                                saved_dirs[info.path].entry_count);
+      return;
     }
 
-    newfile.id = file.id;
-    newfile.dir_id = file.dir_id;
-    newfile.filename = file.filename;
-    newfile.fulldir_path = file.fulldir_path;
-    newfile.created_time = file.created_time;
-    newfile.modified_time = file.modified_time;
-    newfile.filesize = file.filesize;
-    newfile.filetype = file.filetype;
+    Entity::ScannedDir listed(dir.id, info.path, info.modified_time_ns,
+                              info.entry_count);
+    scanned_dirs.push_back(listed);
+
+    // Every file of a listed directory has been matched by now, the rows
+    // left are gone from disk.
+    std::vector<int> removed_ids;
+    bool kept_for_moves = false;
+    auto leftovers = saved_files.find(info.path.native());
+    if (leftovers != saved_files.end()) {
+      for (const auto &[name, f] : leftovers->second) {
+        kept_for_moves |= moved.missing(f, removed_ids);
+      }
+      saved_files.erase(leftovers);
+    }
 
-    DBRetCode::UpdateFileRes rc = db->update_file(file.id, newfile);
-    if (rc == DBRetCode::UpdateFileRes::NotFound) {
-      continue;
+    // Rows kept for matching go at the end of the scan, and new files that
+    // may be moves are only written then. Until then the directory is not
+    // checkpointed, or a resumed scan would skip it and lose either.
+    if (kept_for_moves || moved.has_deferred(info.path)) {
+      moved.remove_later(removed_ids);
+      return;
     }
 
-    if (rc != DBRetCode::UpdateFileRes::Success) {
-      return LibRetCode::ScanRes::UpdatingFilesError;
+    // Subdirectories get a row that never matches, so a resumed scan that
+    // skips this directory still descends into them.
+    std::vector<Entity::ScannedDir> subdirs;
+    for (const std::filesystem::path &subdir : info.subdirs) {
+      if (!saved_dirs.count(subdir)) {
+        subdirs.emplace_back(dir.id, subdir, -1, 0);
+      }
     }
 
-    updated_count++;
+    pipeline.dir_listed(listed, std::move(subdirs), std::move(removed_ids));
+  };
+  hooks.cancel = &scan_cancel;
+
+  WalkRetCode::WalkRes walk_res = walk_audio_files(
+      dir.path,
+      [&](const WalkEntry &entry) {
+        check_scanned_file(entry, dir.id, saved_files, pipeline, moved);
+      },
+      &hooks);
+
+  if (walk_res == WalkRetCode::WalkRes::Cancelled) {
+    return LibRetCode::ScanRes::Cancelled;
+  }
 
-    std::cout << "Updated (" << updated_count << " / "
-              << update_needed_file_count << ") files..." << '\n';
+  if (walk_res != WalkRetCode::WalkRes::Success) {
+    return LibRetCode::ScanRes::CannotGetDir;
   }
 
   return LibRetCode::ScanRes::Success;
@@ -313,6 +1239,15 @@ LibRetCode::ScanRes Library::populate_files_into_db(
 
 LibRetCode::ReadFileTagsRes
 Library::read_file_tags(std::filesystem::path fullpath, Entity::File &result) {
+  // Most of a library is MP3, whose fields are read without building a
+  // TagLib file. TagLib still handles the other formats and the MP3s the
+  // fast path gives up on.
+  if (get_filetype_from_name(fullpath.filename().c_str()) ==
+          Enum::FileType::MP3 &&
+      read_mpeg_tags(fullpath, result) == MpegTagsRetCode::ReadRes::Success) {
+    return LibRetCode::ReadFileTagsRes::Success;
+  }
+
   TagLib::FileRef f(fullpath.c_str());
   if (f.isNull() || !f.tag()) {
     return LibRetCode::ReadFileTagsRes::CannotReadTags;
@@ -1,6 +1,13 @@
 #pragma once
+#include "common/dir_walker.hpp"
 #include "db.hpp"
-#include <forward_list>
+#include <atomic>
+#include <condition_variable>
+#include <functional>
+#include <mutex>
+#include <set>
+#include <thread>
+#include <unordered_set>
 #include <vector>
 
 namespace LibRetCode {
@@ -12,11 +19,13 @@ enum class ScanRes {
   SqlError,
   GettingUnreadFilesError,
   AddingUnreadFilesError,
-  UpdatingFilesError
+  UpdatingFilesError,
+  Cancelled
 };
 enum class ReadFileTagsRes { Success = 0, CannotReadTags };
 enum class InitArtistsRes { Success = 0, SqlError };
 enum class SetArtistAlbumsRes { Success = 0, SqlError };
+enum class BuildIndexesRes { Success = 0, SqlError, Cancelled };
 
 }; // namespace LibRetCode
 
@@ -28,6 +37,10 @@ enum class MoveRes { Success = 0, InvalidIndex };
 
 }; // namespace QueueRetCode
 
+struct TagReadJob;
+class ScanPipeline;
+class MovedFiles;
+
 class Library {
 public:
   Library(DB *db__);
@@ -37,6 +50,28 @@ public:
 
   LibRetCode::ScanRes full_scan();
   LibRetCode::ScanRes partial_scan(int dir_id);
+  // Stops a running scan at the next directory, and the scans already
+  // requested that wait for it. Files already read are still written and
+  // the scan resumes from its checkpoint next time.
+  void cancel_scan();
+  // Brings the given paths of root dir_id up to date without a rescan.
+  // `files` are single files that changed or disappeared, `trees` are
+  // directories that appeared or disappeared as a whole.
+  LibRetCode::ScanRes update_paths(int dir_id,
+                                   const std::set<std::filesystem::path> &files,
+                                   const std::set<std::filesystem::path> &trees);
+
+  LibRetCode::BuildIndexesRes build_frame_indexes(int min_length);
+  void start_frame_index_job();
+  void stop_frame_index_job();
+  void set_frame_index_min_length(int seconds);
+
+  // Workers reading tags during a scan, 0 uses one per core.
+  void set_tag_read_threads(int count);
+
+  // Rescans skip directories whose mtime matches the last scan. Files edited
+  // in place don't touch the directory mtime, disable this to catch them.
+  void set_skip_unchanged_dirs(bool skip);
 
   LibRetCode::InitArtistsRes init_artists();
   LibRetCode::SetArtistAlbumsRes set_artist_albums(Entity::Artist &artist);
@@ -55,21 +90,54 @@ private:
   DBGetOpt::SortAlbums albums_sortby = DBGetOpt::SortAlbums::YearAscAndNameAsc;
   bool use_albumartist = true;
 
+  // Files at least this long (seconds) get a persisted seek index after a
+  // scan, 0 disables the job. One worker serves every scan and update,
+  // index_mtx guards the fields below it, index_ctl_mtx starts and stops it.
+  int frame_index_min_length = 0;
+  std::thread index_thrd;
+  std::mutex index_ctl_mtx;
+  std::mutex index_mtx;
+  std::condition_variable index_cv;
+  bool index_pending = false;
+  bool index_exit = false;
+  std::atomic<bool> index_job_cancel = false;
+
+  int tag_read_threads = 0;
+  bool skip_unchanged_dirs = true;
+  // Scans and watcher updates may come from different threads.
+  std::mutex scan_mtx;
+  std::atomic<bool> scan_cancel = false;
+  // Bumped by cancel_scan(), a scan requested before the bump is cancelled.
+  std::atomic<std::uint64_t> cancel_generation = 0;
+
+  void index_loop();
   LibRetCode::ReadFileTagsRes read_file_tags(std::filesystem::path fullpath,
                                              Entity::File &result);
 
-  LibRetCode::ScanRes scan_dir_changed_files(
-      Entity::Directory dir,
-      const std::map<std::filesystem::path, Entity::FileMainProps> &saved_files,
-      std::forward_list<Entity::UnreadFile> &unread_files,
-      int &unread_file_count,
-      std::forward_list<Entity::File> &update_needed_files,
-      int &update_needed_file_count);
-  LibRetCode::ScanRes populate_files_into_db(
-      const std::forward_list<Entity::UnreadFile> &unread_files,
-      int unread_file_count,
-      const std::forward_list<Entity::File> &update_needed_files,
-      int update_needed_file_count);
+  LibRetCode::ScanRes
+  scan_directories(const std::vector<Entity::Directory> &directories,
+                   std::uint64_t generation);
+  std::function<bool(TagReadJob &)> read_tags_fn();
+  void check_scanned_file(const WalkEntry &entry, int dir_id,
+                          Entity::FileMainPropsMap &saved_files,
+                          ScanPipeline &pipeline, MovedFiles &moved);
+  void resolve_moves(MovedFiles &moved, Entity::FileMainPropsMap &saved_files,
+                     ScanPipeline &pipeline);
+  void push_new_file(const WalkEntry &entry, int dir_id,
+                     std::uint64_t fingerprint, ScanPipeline &pipeline);
+  void
+  collect_removed_files(
+      const Entity::FileMainPropsMap &remaining,
+      const std::unordered_set<std::string> &unchanged_dirs,
+      const std::vector<std::filesystem::path> &unreadable_dirs,
+      MovedFiles &moved, std::vector<int> &removed_ids);
+  LibRetCode::ScanRes
+  scan_dir_changed_files(Entity::Directory dir,
+                         Entity::FileMainPropsMap &saved_files,
+                         ScanPipeline &pipeline, MovedFiles &moved,
+                         std::vector<Entity::ScannedDir> &scanned_dirs,
+                         std::unordered_set<std::string> &unchanged_dirs,
+                         std::vector<std::filesystem::path> &unreadable_dirs);
 };
 
 class MusicQueue {
@@ -1,6 +1,7 @@
 #include "db.hpp"
 #include "library.hpp"
 #include "player.hpp"
+#include "watcher.hpp"
 #include <filesystem>
 #include <fmt/format.h>
 #include <iostream>
@@ -24,15 +25,28 @@ int main() {
   db.add_directory("/home/entropy/projects/smp/test_dir", r);
   lib.full_scan();
 
+  LibraryWatcher watcher = LibraryWatcher(&lib, &db);
+  watcher.start();
+
   q.enqueue(1);
 
-  Player p = Player();
+  PlayerConfig config;
+  config.output_type = Enum::OutputType::ALSA;
+  config.device_type = Enum::OutputDeviceType::DEFAULT;
+
+  Player p = Player(config, &db);
+  p.init();
+
+  p.set_queue(&q);
+  p.load_from_queue(0);
+  p.play();
 
-  std::vector<Entity::File> queue = q.get_queue();
-  p.load(queue[0]);
-  std::thread t(&Player::play, &p);
+  while (p.is_playing()) {
+    std::this_thread::sleep_for(std::chrono::milliseconds(200));
+  }
 
-  t.join();
+  p.exit();
+  watcher.stop();
 
   // q.move(0, 3);
 
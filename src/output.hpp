@@ -1,6 +1,10 @@
 #pragma once
 #include "common/types.hpp"
 #include <alsa/asoundlib.h>
+#include <atomic>
+#include <cstdio>
+#include <memory>
+#include <string>
 
 namespace OutputRetCode {
 
@@ -39,6 +43,27 @@ enum class WriteRes {
   Error,
 };
 
+enum class BeginWriteRes {
+  Success = 0,
+  NotSupported,
+  Error,
+};
+
+enum class CommitWriteRes {
+  Success = 0,
+  Error,
+};
+
+enum class BufferInfoRes {
+  Success = 0,
+  Error,
+};
+
+enum class DelayRes {
+  Success = 0,
+  Error,
+};
+
 enum class StopRes {
   Success = 0,
   Error,
@@ -65,6 +90,8 @@ public:
   virtual OutputRetCode::InitRes init(const char *device) = 0;
   virtual OutputRetCode::ExitRes exit() = 0;
 
+  // May be called while already open. The device is kept when the format is
+  // unchanged and renegotiated in place when it differs.
   virtual OutputRetCode::OpenRes open(const Audio::FormatInfo &afi) = 0;
   virtual OutputRetCode::CloseRes close() = 0;
 
@@ -73,12 +100,30 @@ public:
 
   virtual OutputRetCode::WriteRes write(const char *buf, int count) = 0;
 
+  // Zero-copy write: begin_write() hands out up to `count` bytes of device
+  // memory, the caller fills it and passes the bytes used to commit_write().
+  // Outputs without direct buffer access return NotSupported, write() must
+  // be used instead.
+  virtual OutputRetCode::BeginWriteRes begin_write(char *&buf, int &count) = 0;
+  virtual OutputRetCode::CommitWriteRes commit_write(int count) = 0;
+
+  // Frames written but not yet played by the device.
+  virtual OutputRetCode::DelayRes get_delay(int64_t &frames) = 0;
+
+  // Buffer and period size negotiated by the last successful open().
+  virtual OutputRetCode::BufferInfoRes
+  get_buffer_info(Audio::BufferInfo &info) = 0;
+
   virtual OutputRetCode::StopRes stop() = 0;
   virtual OutputRetCode::PauseRes pause() = 0;
   virtual OutputRetCode::UnpauseRes unpause() = 0;
 
   virtual void change_device(const char *device) = 0;
 
+  // Take effect on the next open().
+  virtual void set_access(Enum::OutputAccess access) = 0;
+  virtual void set_latency_profile(Enum::LatencyProfile profile) = 0;
+
   virtual Enum::OutputType get_output_type() const = 0;
   virtual Enum::OutputDeviceType get_output_device_type() const = 0;
 };
@@ -96,12 +141,22 @@ public:
 
   OutputRetCode::WriteRes write(const char *buf, int count) override;
 
+  OutputRetCode::BeginWriteRes begin_write(char *&buf, int &count) override;
+  OutputRetCode::CommitWriteRes commit_write(int count) override;
+
+  OutputRetCode::DelayRes get_delay(int64_t &frames) override;
+  OutputRetCode::BufferInfoRes
+  get_buffer_info(Audio::BufferInfo &info) override;
+
   OutputRetCode::StopRes stop() override;
   OutputRetCode::PauseRes pause() override;
   OutputRetCode::UnpauseRes unpause() override;
 
   void change_device(const char *device) override;
 
+  void set_access(Enum::OutputAccess access__) override;
+  void set_latency_profile(Enum::LatencyProfile profile) override;
+
   Enum::OutputType get_output_type() const override;
   Enum::OutputDeviceType get_output_device_type() const override;
 
@@ -115,15 +170,139 @@ private:
   snd_pcm_status_t *status = nullptr;
   snd_pcm_format_t fmt = SND_PCM_FORMAT_UNKNOWN;
 
+  // Requested access mode and the one the device actually accepted, MMAP
+  // falls back to RW on devices that cannot map their buffer.
+  Enum::OutputAccess access = Enum::OutputAccess::RW;
+  Enum::OutputAccess open_access = Enum::OutputAccess::RW;
+  snd_pcm_uframes_t mmap_offset = 0;
+  snd_pcm_uframes_t mmap_frames = 0;
+
+  Audio::LatencyParams latency =
+      Audio::latency_params(Enum::LatencyProfile::DEFAULT);
+  Audio::BufferInfo buffer_info = {0, 0, 0};
+
+  // Format the open handle is configured for. params_dirty marks access or
+  // latency changes that need a renegotiation even for the same format.
+  Audio::FormatInfo open_afi = {};
+  bool params_dirty = false;
+
+  OutputRetCode::OpenRes configure(const Audio::FormatInfo &afi);
   int set_hw_params(const Audio::FormatInfo &afi);
+  int set_sw_params();
+};
+
+// Discards PCM as fast as it arrives, for benchmarks and machines without a
+// sound card. Keeps count of what it was given.
+class NullOutput : public Output {
+public:
+  OutputRetCode::InitRes init(const char *device) override;
+  OutputRetCode::ExitRes exit() override;
+
+  OutputRetCode::OpenRes open(const Audio::FormatInfo &afi) override;
+  OutputRetCode::CloseRes close() override;
+
+  OutputRetCode::UnlockRes unlock() override;
+  OutputRetCode::LockRes lock() override;
+
+  OutputRetCode::WriteRes write(const char *buf, int count) override;
+
+  OutputRetCode::BeginWriteRes begin_write(char *&buf, int &count) override;
+  OutputRetCode::CommitWriteRes commit_write(int count) override;
+
+  OutputRetCode::DelayRes get_delay(int64_t &frames) override;
+  OutputRetCode::BufferInfoRes
+  get_buffer_info(Audio::BufferInfo &info) override;
+
+  OutputRetCode::StopRes stop() override;
+  OutputRetCode::PauseRes pause() override;
+  OutputRetCode::UnpauseRes unpause() override;
+
+  void change_device(const char *device) override;
+
+  void set_access(Enum::OutputAccess access__) override;
+  void set_latency_profile(Enum::LatencyProfile profile) override;
+
+  Enum::OutputType get_output_type() const override;
+  Enum::OutputDeviceType get_output_device_type() const override;
+
+  uint64_t get_bytes_written() const;
+  uint64_t get_frames_written() const;
+
+private:
+  bool opened = false;
+  int fsize = 0;
+  unsigned int rate = 0;
+
+  std::atomic<uint64_t> bytes_written = 0;
+  std::atomic<uint64_t> frames_written = 0;
+};
+
+// Writes PCM to a file, or to stdout when the device is "-". As WAV_FILE it
+// writes a RIFF header that is patched with the final sizes on close() when
+// the target is seekable, as RAW_FILE it writes bare interleaved samples.
+// A format change between tracks starts a new WAV stream.
+class FileOutput : public Output {
+public:
+  FileOutput(Enum::OutputType type__);
+
+  OutputRetCode::InitRes init(const char *device) override;
+  OutputRetCode::ExitRes exit() override;
+
+  OutputRetCode::OpenRes open(const Audio::FormatInfo &afi) override;
+  OutputRetCode::CloseRes close() override;
+
+  OutputRetCode::UnlockRes unlock() override;
+  OutputRetCode::LockRes lock() override;
+
+  OutputRetCode::WriteRes write(const char *buf, int count) override;
+
+  OutputRetCode::BeginWriteRes begin_write(char *&buf, int &count) override;
+  OutputRetCode::CommitWriteRes commit_write(int count) override;
+
+  OutputRetCode::DelayRes get_delay(int64_t &frames) override;
+  OutputRetCode::BufferInfoRes
+  get_buffer_info(Audio::BufferInfo &info) override;
+
+  OutputRetCode::StopRes stop() override;
+  OutputRetCode::PauseRes pause() override;
+  OutputRetCode::UnpauseRes unpause() override;
+
+  void change_device(const char *device) override;
+
+  void set_access(Enum::OutputAccess access__) override;
+  void set_latency_profile(Enum::LatencyProfile profile) override;
+
+  Enum::OutputType get_output_type() const override;
+  Enum::OutputDeviceType get_output_device_type() const override;
+
+private:
+  Enum::OutputType type;
+  std::string path = "-";
+
+  FILE *file = nullptr;
+  bool seekable = false;
+  Audio::FormatInfo current_afi;
+  uint64_t data_bytes = 0;
+  // Files opened since init(), later ones get a number, see next_path().
+  int files_opened = 0;
+
+  std::string next_path();
+  bool write_wav_header(uint32_t data_size);
+  bool finish_wav();
 };
 
 class OutputFactory {
 public:
   static std::unique_ptr<Output> create(const Enum::OutputType type) {
-    if (type == Enum::OutputType::ALSA) {
+    switch (type) {
+    case Enum::OutputType::ALSA:
       return std::make_unique<AlsaOutput>();
-    } else {
+    case Enum::OutputType::NULL_SINK:
+      return std::make_unique<NullOutput>();
+    case Enum::OutputType::WAV_FILE:
+    case Enum::OutputType::RAW_FILE:
+      return std::make_unique<FileOutput>(type);
+    default:
       return nullptr;
     }
   }
@@ -1,4 +1,5 @@
 #include "../output.hpp"
+#include <algorithm>
 
 static int poll_pcm(snd_pcm_t *handle, int timeout_ms) {
   int count = snd_pcm_poll_descriptors_count(handle);
@@ -27,6 +28,11 @@ OutputRetCode::InitRes AlsaOutput::init(const char *device) {
 }
 
 OutputRetCode::ExitRes AlsaOutput::exit() {
+  if (handle) {
+    snd_pcm_drop(handle);
+    snd_pcm_close(handle);
+    handle = nullptr;
+  }
   if (status) {
     snd_pcm_status_free(status);
     status = nullptr;
@@ -38,6 +44,32 @@ OutputRetCode::OpenRes AlsaOutput::open(const Audio::FormatInfo &afi) {
   int rc;
   fsize = afi.frame_size;
 
+  // Reopening a PCM can take hundreds of ms on some USB DACs, so an open
+  // handle is reused whenever the format allows it.
+  if (handle) {
+    const bool same_format = afi.rate == open_afi.rate &&
+                             afi.channels == open_afi.channels &&
+                             afi.encoding == open_afi.encoding;
+
+    if (same_format && !params_dirty) {
+      snd_pcm_state_t state = snd_pcm_state(handle);
+      if (state == SND_PCM_STATE_PREPARED || state == SND_PCM_STATE_RUNNING)
+        return OutputRetCode::OpenRes::Success;
+
+      if (snd_pcm_prepare(handle) == 0)
+        return OutputRetCode::OpenRes::Success;
+    } else {
+      // Let the previous format play out, then renegotiate on the same
+      // handle.
+      snd_pcm_drain(handle);
+      if (configure(afi) == OutputRetCode::OpenRes::Success)
+        return OutputRetCode::OpenRes::Success;
+    }
+
+    snd_pcm_close(handle);
+    handle = nullptr;
+  }
+
   if (dev == nullptr) {
     rc = snd_pcm_open(&handle, "sysdefault", SND_PCM_STREAM_PLAYBACK, 0);
   } else {
@@ -49,21 +81,40 @@ OutputRetCode::OpenRes AlsaOutput::open(const Audio::FormatInfo &afi) {
   }
 
   if (rc < 0) {
+    handle = nullptr;
     return OutputRetCode::OpenRes::OpenError;
   }
 
+  OutputRetCode::OpenRes res = configure(afi);
+  if (res != OutputRetCode::OpenRes::Success) {
+    snd_pcm_close(handle);
+    handle = nullptr;
+  }
+
+  return res;
+}
+
+OutputRetCode::OpenRes AlsaOutput::configure(const Audio::FormatInfo &afi) {
+  int rc;
+
   rc = set_hw_params(afi);
   if (rc < 0) {
-    snd_pcm_close(handle);
+    return OutputRetCode::OpenRes::SetParamsError;
+  }
+
+  rc = set_sw_params();
+  if (rc < 0) {
     return OutputRetCode::OpenRes::SetParamsError;
   }
 
   rc = snd_pcm_prepare(handle);
   if (rc < 0) {
-    snd_pcm_close(handle);
     return OutputRetCode::OpenRes::PrepareError;
   }
 
+  open_afi = afi;
+  params_dirty = false;
+
   return OutputRetCode::OpenRes::Success;
 }
 
@@ -110,6 +161,111 @@ OutputRetCode::WriteRes AlsaOutput::write(const char *buf, int count) {
   return OutputRetCode::WriteRes::Success;
 }
 
+OutputRetCode::BeginWriteRes AlsaOutput::begin_write(char *&buf,
+                                                     int &count) {
+  if (!handle)
+    return OutputRetCode::BeginWriteRes::Error;
+  if (open_access != Enum::OutputAccess::MMAP)
+    return OutputRetCode::BeginWriteRes::NotSupported;
+
+  int rc;
+  snd_pcm_uframes_t frames = count / fsize;
+  snd_pcm_sframes_t avail;
+
+  // Block like snd_pcm_writei() would until the whole request fits, or at
+  // least part of it when the request is larger than the device buffer.
+  while (true) {
+    avail = snd_pcm_avail_update(handle);
+    if (avail < 0) {
+      rc = snd_pcm_recover(handle, avail, 1);
+      if (rc < 0)
+        return OutputRetCode::BeginWriteRes::Error;
+      continue;
+    }
+
+    if ((snd_pcm_uframes_t)avail >= frames)
+      break;
+
+    if (snd_pcm_state(handle) != SND_PCM_STATE_RUNNING) {
+      if (avail > 0)
+        break;
+
+      rc = snd_pcm_start(handle);
+      if (rc < 0)
+        return OutputRetCode::BeginWriteRes::Error;
+    }
+
+    rc = snd_pcm_wait(handle, 1000);
+    if (rc < 0) {
+      rc = snd_pcm_recover(handle, rc, 1);
+      if (rc < 0)
+        return OutputRetCode::BeginWriteRes::Error;
+    } else if (rc == 0 && avail > 0) {
+      break;
+    }
+  }
+
+  frames = std::min<snd_pcm_uframes_t>(frames, avail);
+
+  const snd_pcm_channel_area_t *areas;
+  rc = snd_pcm_mmap_begin(handle, &areas, &mmap_offset, &frames);
+  if (rc < 0) {
+    rc = snd_pcm_recover(handle, rc, 1);
+    if (rc < 0)
+      return OutputRetCode::BeginWriteRes::Error;
+    rc = snd_pcm_mmap_begin(handle, &areas, &mmap_offset, &frames);
+    if (rc < 0)
+      return OutputRetCode::BeginWriteRes::Error;
+  }
+
+  // Interleaved access: every channel shares one area, frames are contiguous.
+  buf = (char *)areas[0].addr + areas[0].first / 8 +
+        mmap_offset * (areas[0].step / 8);
+  count = frames * fsize;
+  mmap_frames = frames;
+
+  return OutputRetCode::BeginWriteRes::Success;
+}
+
+OutputRetCode::CommitWriteRes AlsaOutput::commit_write(int count) {
+  if (!handle || open_access != Enum::OutputAccess::MMAP)
+    return OutputRetCode::CommitWriteRes::Error;
+
+  snd_pcm_uframes_t frames =
+      std::min<snd_pcm_uframes_t>(count / fsize, mmap_frames);
+  mmap_frames = 0;
+
+  snd_pcm_sframes_t rc = snd_pcm_mmap_commit(handle, mmap_offset, frames);
+  if (rc < 0 || (snd_pcm_uframes_t)rc != frames) {
+    int rec = snd_pcm_recover(handle, rc < 0 ? rc : -EPIPE, 1);
+    if (rec < 0)
+      return OutputRetCode::CommitWriteRes::Error;
+    return OutputRetCode::CommitWriteRes::Success;
+  }
+
+  // Unlike snd_pcm_writei(), committing does not start the stream by itself.
+  if (snd_pcm_state(handle) == SND_PCM_STATE_PREPARED) {
+    if (snd_pcm_start(handle) < 0)
+      return OutputRetCode::CommitWriteRes::Error;
+  }
+
+  return OutputRetCode::CommitWriteRes::Success;
+}
+
+OutputRetCode::DelayRes AlsaOutput::get_delay(int64_t &frames) {
+  if (!handle)
+    return OutputRetCode::DelayRes::Error;
+
+  snd_pcm_sframes_t delay;
+  int rc = snd_pcm_delay(handle, &delay);
+  if (rc < 0) {
+    return OutputRetCode::DelayRes::Error;
+  }
+
+  frames = delay;
+  return OutputRetCode::DelayRes::Success;
+}
+
 OutputRetCode::LockRes AlsaOutput::lock() {
 
   return OutputRetCode::LockRes::Success;
@@ -266,8 +422,15 @@ OutputRetCode::UnpauseRes AlsaOutput::unpause() {
 
 void AlsaOutput::change_device(const char *device) { dev = strdup(device); }
 
+void AlsaOutput::set_access(Enum::OutputAccess access__) {
+  access = access__;
+  params_dirty = true;
+}
+
 int AlsaOutput::set_hw_params(const Audio::FormatInfo &afi) {
-  unsigned int max_buf_time = 300 * 1000; // 300ms
+  unsigned int buffer_time = latency.buffer_us;
+  unsigned int period_time = latency.period_us;
+  snd_pcm_uframes_t buffer_size, period_size;
   int rc, direction;
 
   unsigned int rate = afi.rate;
@@ -277,17 +440,22 @@ int AlsaOutput::set_hw_params(const Audio::FormatInfo &afi) {
   if (rc < 0)
     goto error;
 
-  rc = snd_pcm_hw_params_set_buffer_time_max(handle, params, &max_buf_time,
-                                             &direction);
-  if (rc < 0)
-    goto error;
-
   can_pause = (bool)snd_pcm_hw_params_can_pause(params);
 
-  rc = snd_pcm_hw_params_set_access(handle, params,
-                                    SND_PCM_ACCESS_RW_INTERLEAVED);
-  if (rc < 0)
-    goto error;
+  open_access = Enum::OutputAccess::RW;
+  if (access == Enum::OutputAccess::MMAP) {
+    rc = snd_pcm_hw_params_set_access(handle, params,
+                                      SND_PCM_ACCESS_MMAP_INTERLEAVED);
+    if (rc == 0)
+      open_access = Enum::OutputAccess::MMAP;
+  }
+
+  if (open_access == Enum::OutputAccess::RW) {
+    rc = snd_pcm_hw_params_set_access(handle, params,
+                                      SND_PCM_ACCESS_RW_INTERLEAVED);
+    if (rc < 0)
+      goto error;
+  }
 
   fmt = snd_pcm_build_linear_format(afi.bits, afi.bits, afi.is_signed ? 0 : 1,
                                     afi.is_bigendian);
@@ -304,15 +472,81 @@ int AlsaOutput::set_hw_params(const Audio::FormatInfo &afi) {
   if (rc < 0)
     goto error;
 
+  // Buffer and period times depend on the rate, so they are set last. The
+  // device may round both, what it settled on is kept in buffer_info.
+  rc = snd_pcm_hw_params_set_buffer_time_near(handle, params, &buffer_time,
+                                              &direction);
+  if (rc < 0)
+    goto error;
+
+  rc = snd_pcm_hw_params_set_period_time_near(handle, params, &period_time,
+                                              &direction);
+  if (rc < 0)
+    goto error;
+
   rc = snd_pcm_hw_params(handle, params);
   if (rc < 0)
     goto error;
 
+  rc = snd_pcm_hw_params_get_buffer_size(params, &buffer_size);
+  if (rc < 0)
+    goto error;
+
+  rc = snd_pcm_hw_params_get_period_size(params, &period_size, &direction);
+  if (rc < 0)
+    goto error;
+
+  buffer_info.rate = rate;
+  buffer_info.buffer_frames = buffer_size;
+  buffer_info.period_frames = period_size;
+
 error:
   snd_pcm_hw_params_free(params);
   return rc;
 }
 
+// Wake the writer only once a whole period is free, so large periods mean
+// few wakeups, and start the stream as soon as the first period is queued.
+int AlsaOutput::set_sw_params() {
+  snd_pcm_sw_params_t *sw_params = nullptr;
+  int rc;
+
+  const snd_pcm_uframes_t period = buffer_info.period_frames;
+
+  snd_pcm_sw_params_malloc(&sw_params);
+  rc = snd_pcm_sw_params_current(handle, sw_params);
+  if (rc < 0)
+    goto error;
+
+  rc = snd_pcm_sw_params_set_avail_min(handle, sw_params, period);
+  if (rc < 0)
+    goto error;
+
+  rc = snd_pcm_sw_params_set_start_threshold(handle, sw_params, period);
+  if (rc < 0)
+    goto error;
+
+  rc = snd_pcm_sw_params(handle, sw_params);
+
+error:
+  snd_pcm_sw_params_free(sw_params);
+  return rc;
+}
+
+OutputRetCode::BufferInfoRes
+AlsaOutput::get_buffer_info(Audio::BufferInfo &info) {
+  if (!handle)
+    return OutputRetCode::BufferInfoRes::Error;
+
+  info = buffer_info;
+  return OutputRetCode::BufferInfoRes::Success;
+}
+
+void AlsaOutput::set_latency_profile(Enum::LatencyProfile profile) {
+  latency = Audio::latency_params(profile);
+  params_dirty = true;
+}
+
 Enum::OutputType AlsaOutput::get_output_type() const {
   return Enum::OutputType::ALSA;
 }
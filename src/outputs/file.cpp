@@ -0,0 +1,228 @@
+#include "../output.hpp"
+#include <cstring>
+#include <filesystem>
+#include <string>
+
+static void put_le16(unsigned char *p, uint16_t v) {
+  p[0] = v & 0xff;
+  p[1] = (v >> 8) & 0xff;
+}
+
+static void put_le32(unsigned char *p, uint32_t v) {
+  p[0] = v & 0xff;
+  p[1] = (v >> 8) & 0xff;
+  p[2] = (v >> 16) & 0xff;
+  p[3] = (v >> 24) & 0xff;
+}
+
+FileOutput::FileOutput(Enum::OutputType type__) : type(type__) {}
+
+OutputRetCode::InitRes FileOutput::init(const char *device) {
+  if (device != nullptr && device[0] != '\0') {
+    path = device;
+  }
+  files_opened = 0;
+
+  return OutputRetCode::InitRes::Success;
+}
+
+OutputRetCode::ExitRes FileOutput::exit() {
+  close();
+  return OutputRetCode::ExitRes::Success;
+}
+
+// A format change never rewrites what is already in the file: the file is
+// finished and the new format goes to the next numbered one. stdout cannot
+// start over, so it keeps its format and refuses the change.
+OutputRetCode::OpenRes FileOutput::open(const Audio::FormatInfo &afi) {
+  if (file != nullptr) {
+    const bool same_format = afi.rate == current_afi.rate &&
+                             afi.channels == current_afi.channels &&
+                             afi.encoding == current_afi.encoding;
+    if (same_format) {
+      current_afi = afi;
+      return OutputRetCode::OpenRes::Success;
+    }
+
+    if (path == "-") {
+      return OutputRetCode::OpenRes::SetParamsError;
+    }
+
+    close();
+  }
+
+  if (path == "-") {
+    file = stdout;
+    seekable = false;
+  } else {
+    file = fopen(next_path().c_str(), "wb");
+    if (file == nullptr) {
+      return OutputRetCode::OpenRes::OpenError;
+    }
+    seekable = true;
+  }
+
+  current_afi = afi;
+  data_bytes = 0;
+
+  // Unknown length for now, players treat 0xffffffff as "until EOF".
+  if (type == Enum::OutputType::WAV_FILE && !write_wav_header(0xffffffff)) {
+    close();
+    return OutputRetCode::OpenRes::SetParamsError;
+  }
+
+  return OutputRetCode::OpenRes::Success;
+}
+
+OutputRetCode::CloseRes FileOutput::close() {
+  if (file == nullptr)
+    return OutputRetCode::CloseRes::Success;
+
+  OutputRetCode::CloseRes res = OutputRetCode::CloseRes::Success;
+
+  if (type == Enum::OutputType::WAV_FILE && !finish_wav()) {
+    res = OutputRetCode::CloseRes::DrainError;
+  }
+
+  if (file == stdout) {
+    fflush(file);
+  } else if (fclose(file) != 0) {
+    res = OutputRetCode::CloseRes::CloseError;
+  }
+
+  file = nullptr;
+  return res;
+}
+
+OutputRetCode::UnlockRes FileOutput::unlock() {
+  return OutputRetCode::UnlockRes::Success;
+}
+
+OutputRetCode::LockRes FileOutput::lock() {
+  return OutputRetCode::LockRes::Success;
+}
+
+OutputRetCode::WriteRes FileOutput::write(const char *buf, int count) {
+  if (file == nullptr)
+    return OutputRetCode::WriteRes::Error;
+
+  if (fwrite(buf, 1, count, file) != (size_t)count)
+    return OutputRetCode::WriteRes::Error;
+
+  data_bytes += count;
+  return OutputRetCode::WriteRes::Success;
+}
+
+OutputRetCode::BeginWriteRes FileOutput::begin_write(char *&buf, int &count) {
+  return OutputRetCode::BeginWriteRes::NotSupported;
+}
+
+OutputRetCode::CommitWriteRes FileOutput::commit_write(int count) {
+  return OutputRetCode::CommitWriteRes::Error;
+}
+
+OutputRetCode::DelayRes FileOutput::get_delay(int64_t &frames) {
+  frames = 0;
+  return OutputRetCode::DelayRes::Success;
+}
+
+OutputRetCode::BufferInfoRes
+FileOutput::get_buffer_info(Audio::BufferInfo &info) {
+  if (file == nullptr)
+    return OutputRetCode::BufferInfoRes::Error;
+
+  info = Audio::BufferInfo{current_afi.rate, 0, 0};
+  return OutputRetCode::BufferInfoRes::Success;
+}
+
+OutputRetCode::StopRes FileOutput::stop() {
+  if (file == nullptr)
+    return OutputRetCode::StopRes::Error;
+
+  fflush(file);
+  return OutputRetCode::StopRes::Success;
+}
+
+OutputRetCode::PauseRes FileOutput::pause() {
+  return OutputRetCode::PauseRes::Success;
+}
+
+OutputRetCode::UnpauseRes FileOutput::unpause() {
+  return OutputRetCode::UnpauseRes::Success;
+}
+
+void FileOutput::change_device(const char *device) {
+  path = device;
+  files_opened = 0;
+}
+
+// `path` for the first file, then "name.1.wav", "name.2.wav" and so on.
+std::string FileOutput::next_path() {
+  const int index = files_opened++;
+  if (index == 0) {
+    return path;
+  }
+
+  std::filesystem::path p(path);
+  std::filesystem::path numbered = p.parent_path() / p.stem();
+  numbered += "." + std::to_string(index);
+  numbered += p.extension();
+  return numbered.string();
+}
+
+void FileOutput::set_access(Enum::OutputAccess access__) {}
+
+void FileOutput::set_latency_profile(Enum::LatencyProfile profile) {}
+
+Enum::OutputType FileOutput::get_output_type() const { return type; }
+
+Enum::OutputDeviceType FileOutput::get_output_device_type() const {
+  return Enum::OutputDeviceType::UNKNOWN;
+}
+
+// Canonical 44 byte PCM header. mpg123 hands out native endian samples,
+// which matches WAV's little endian on every platform we build for.
+bool FileOutput::write_wav_header(uint32_t data_size) {
+  unsigned char header[44];
+
+  const uint16_t channels = current_afi.channels;
+  const uint16_t bits = current_afi.bits;
+  const uint16_t block_align = current_afi.frame_size;
+  const uint32_t byte_rate = current_afi.rate * block_align;
+  const uint32_t riff_size =
+      data_size == 0xffffffff ? 0xffffffff : data_size + 36;
+
+  memcpy(header, "RIFF", 4);
+  put_le32(header + 4, riff_size);
+  memcpy(header + 8, "WAVE", 4);
+  memcpy(header + 12, "fmt ", 4);
+  put_le32(header + 16, 16);
+  put_le16(header + 20, 1); // PCM
+  put_le16(header + 22, channels);
+  put_le32(header + 24, current_afi.rate);
+  put_le32(header + 28, byte_rate);
+  put_le16(header + 32, block_align);
+  put_le16(header + 34, bits);
+  memcpy(header + 36, "data", 4);
+  put_le32(header + 40, data_size);
+
+  return fwrite(header, 1, sizeof(header), file) == sizeof(header);
+}
+
+bool FileOutput::finish_wav() {
+  if (!seekable) {
+    return true;
+  }
+
+  const uint32_t data_size =
+      data_bytes > 0xffffffff - 36 ? 0xffffffff : (uint32_t)data_bytes;
+
+  if (fseek(file, 0, SEEK_SET) != 0) {
+    return false;
+  }
+  if (!write_wav_header(data_size)) {
+    return false;
+  }
+
+  return fseek(file, 0, SEEK_END) == 0;
+}
@@ -0,0 +1,93 @@
+#include "../output.hpp"
+
+OutputRetCode::InitRes NullOutput::init(const char *device) {
+  bytes_written = 0;
+  frames_written = 0;
+  return OutputRetCode::InitRes::Success;
+}
+
+OutputRetCode::ExitRes NullOutput::exit() {
+  opened = false;
+  return OutputRetCode::ExitRes::Success;
+}
+
+OutputRetCode::OpenRes NullOutput::open(const Audio::FormatInfo &afi) {
+  fsize = afi.frame_size;
+  rate = afi.rate;
+  opened = true;
+  return OutputRetCode::OpenRes::Success;
+}
+
+OutputRetCode::CloseRes NullOutput::close() {
+  opened = false;
+  return OutputRetCode::CloseRes::Success;
+}
+
+OutputRetCode::UnlockRes NullOutput::unlock() {
+  return OutputRetCode::UnlockRes::Success;
+}
+
+OutputRetCode::LockRes NullOutput::lock() {
+  return OutputRetCode::LockRes::Success;
+}
+
+OutputRetCode::WriteRes NullOutput::write(const char *buf, int count) {
+  if (!opened || fsize <= 0)
+    return OutputRetCode::WriteRes::Error;
+
+  bytes_written += count;
+  frames_written += count / fsize;
+  return OutputRetCode::WriteRes::Success;
+}
+
+OutputRetCode::BeginWriteRes NullOutput::begin_write(char *&buf, int &count) {
+  return OutputRetCode::BeginWriteRes::NotSupported;
+}
+
+OutputRetCode::CommitWriteRes NullOutput::commit_write(int count) {
+  return OutputRetCode::CommitWriteRes::Error;
+}
+
+OutputRetCode::DelayRes NullOutput::get_delay(int64_t &frames) {
+  frames = 0;
+  return OutputRetCode::DelayRes::Success;
+}
+
+OutputRetCode::BufferInfoRes
+NullOutput::get_buffer_info(Audio::BufferInfo &info) {
+  if (!opened)
+    return OutputRetCode::BufferInfoRes::Error;
+
+  info = Audio::BufferInfo{rate, 0, 0};
+  return OutputRetCode::BufferInfoRes::Success;
+}
+
+OutputRetCode::StopRes NullOutput::stop() {
+  return OutputRetCode::StopRes::Success;
+}
+
+OutputRetCode::PauseRes NullOutput::pause() {
+  return OutputRetCode::PauseRes::Success;
+}
+
+OutputRetCode::UnpauseRes NullOutput::unpause() {
+  return OutputRetCode::UnpauseRes::Success;
+}
+
+void NullOutput::change_device(const char *device) {}
+
+void NullOutput::set_access(Enum::OutputAccess access__) {}
+
+void NullOutput::set_latency_profile(Enum::LatencyProfile profile) {}
+
+Enum::OutputType NullOutput::get_output_type() const {
+  return Enum::OutputType::NULL_SINK;
+}
+
+Enum::OutputDeviceType NullOutput::get_output_device_type() const {
+  return Enum::OutputDeviceType::UNKNOWN;
+}
+
+uint64_t NullOutput::get_bytes_written() const { return bytes_written; }
+
+uint64_t NullOutput::get_frames_written() const { return frames_written; }
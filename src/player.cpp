@@ -2,47 +2,107 @@
 #include "common/types.hpp"
 #include "decoder.hpp"
 #include "output.hpp"
+#include <algorithm>
+#include <cassert>
 #include <filesystem>
 #include <fmt/format.h>
+#include <memory>
+#include <vector>
 
-Player::Player(const PlayerConfig &config)
-    : config(config), thrd(), playback_active(false), pause_action(false),
-      stop_action(false), last_toggle_pause(std::chrono::steady_clock::now() -
-                                            std::chrono::milliseconds(1000)),
+// Amount of PCM moved between the ring and the output per iteration when
+// the output does not report its period size.
+static constexpr unsigned int period_ms = 50;
+
+static int64_t since_us(std::chrono::steady_clock::time_point since) {
+  return std::chrono::duration_cast<std::chrono::microseconds>(
+             std::chrono::steady_clock::now() - since)
+      .count();
+}
+
+Player::Player(const PlayerConfig &config, DB *db__)
+    : config(config), db(db__),
+      last_toggle_pause(std::chrono::steady_clock::now() -
+                        std::chrono::milliseconds(1000)),
       toggle_pause_cooldown(std::chrono::milliseconds(200)) {}
 
+Player::~Player() { exit(); }
+
 PlayerRetCode::InitRes Player::init() {
+  if (engine_thrd.joinable()) {
+    return PlayerRetCode::InitRes::Success;
+  }
+
   playback_active = false;
   pause_action = false;
-  stop_action = false;
+
+  std::string device;
 
   switch (config.output_type) {
   case Enum::OutputType::ALSA: {
     output = OutputFactory::create(config.output_type);
+    device = output_device_str(config.device_type);
+    break;
+  }
+
+  case Enum::OutputType::WAV_FILE:
+  case Enum::OutputType::RAW_FILE: {
+    output = OutputFactory::create(config.output_type);
+    device = config.output_path;
     break;
   }
 
   default: {
     output = OutputFactory::create(config.output_type);
+    device = output_device_str(config.device_type);
     break;
   }
   }
 
-  OutputRetCode::InitRes res =
-      output->init(output_device_str(config.device_type).c_str());
+  if (!output) {
+    return PlayerRetCode::InitRes::Error;
+  }
+
+  output->set_access(config.output_access);
+  output->set_latency_profile(config.latency_profile);
+
+  OutputRetCode::InitRes res = output->init(device.c_str());
 
   if (res != OutputRetCode::InitRes::Success) {
     return PlayerRetCode::InitRes::Error;
   }
 
+  engine_exit = false;
+  decode_thrd = std::thread([this]() { decode_loop(); });
+  engine_thrd = std::thread([this]() { engine_loop(); });
+  engine_running = true;
+
   return PlayerRetCode::InitRes::Success;
 }
 
 void Player::exit() {
+  if (!engine_thrd.joinable()) {
+    return;
+  }
+
   stop();
-  if (thrd.joinable()) {
-    thrd.join();
+
+  {
+    std::lock_guard<std::mutex> lock(ring_mtx);
+    engine_exit = true;
   }
+  engine_cv.notify_all();
+  space_cv.notify_all();
+
+  engine_thrd.join();
+  decode_thrd.join();
+
+  {
+    std::lock_guard<std::mutex> lock(ring_mtx);
+    engine_running = false;
+  }
+  // Raced with exit(), there is nothing left to run them on.
+  fail_commands();
+
   if (decoder) {
     decoder->close();
   }
@@ -51,9 +111,238 @@ void Player::exit() {
   }
 }
 
+// Hands a command to the engine thread. Before init() (or after exit()) there
+// is no engine, the command then fails without touching engine state.
+template <typename Res>
+std::future<Res> Player::submit(std::function<Res()> fn, bool audible) {
+  auto promise = std::make_shared<std::promise<Res>>();
+  std::future<Res> future = promise->get_future();
+
+  PlayerCommand cmd;
+  cmd.run = [promise, fn]() { promise->set_value(fn()); };
+  cmd.fail = [promise]() { promise->set_value(Res::Error); };
+  cmd.issued = std::chrono::steady_clock::now();
+  cmd.audible = audible;
+
+  // Under ring_mtx the push is ordered before the engine's predicate check,
+  // so the wakeup cannot be lost, and exit() drains whatever got in before
+  // it cleared engine_running.
+  bool queued = false;
+  {
+    std::lock_guard<std::mutex> lock(ring_mtx);
+    if (engine_running) {
+      commands.push(std::move(cmd));
+      queued = true;
+    }
+  }
+
+  if (!queued) {
+    cmd.fail();
+    return future;
+  }
+
+  engine_cv.notify_one();
+
+  return future;
+}
+
+void Player::fail_commands() {
+  PlayerCommand cmd;
+
+  while (commands.pop(cmd)) {
+    cmd.fail();
+  }
+}
+
+void Player::run_commands() {
+  PlayerCommand cmd;
+
+  while (commands.pop(cmd)) {
+    last_queue_us = since_us(cmd.issued);
+    command_issued = cmd.issued;
+
+    cmd.run();
+
+    if (cmd.audible && playback_active && !pause_action) {
+      audible_pending_since = cmd.issued;
+    }
+  }
+}
+
+std::future<PlayerRetCode::LoadRes>
+Player::load_async(const Entity::File &file) {
+  return submit<PlayerRetCode::LoadRes>(
+      [this, file]() { return do_load(file); });
+}
+
+std::future<PlayerRetCode::LoadRes>
+Player::load_from_queue_async(unsigned int index) {
+  return submit<PlayerRetCode::LoadRes>(
+      [this, index]() { return do_load_from_queue(index); });
+}
+
+std::future<PlayerRetCode::LoadRes> Player::next_async() {
+  return submit<PlayerRetCode::LoadRes>([this]() { return do_next(); }, true);
+}
+
+std::future<PlayerRetCode::PlayRes> Player::play_async() {
+  return submit<PlayerRetCode::PlayRes>([this]() { return do_play(); }, true);
+}
+
+std::future<PlayerRetCode::StopRes> Player::stop_async() {
+  return submit<PlayerRetCode::StopRes>([this]() { return do_stop(); });
+}
+
+std::future<PlayerRetCode::PauseRes> Player::pause_async() {
+  return submit<PlayerRetCode::PauseRes>([this]() { return do_pause(); });
+}
+
+std::future<PlayerRetCode::ResumeRes> Player::resume_async() {
+  return submit<PlayerRetCode::ResumeRes>([this]() { return do_resume(); },
+                                          true);
+}
+
+std::future<PlayerRetCode::SeekRes> Player::seek_ms_async(int64_t offset_ms) {
+  return submit<PlayerRetCode::SeekRes>(
+      [this, offset_ms]() { return do_seek_ms(offset_ms); }, true);
+}
+
+std::future<PlayerRetCode::SeekRes> Player::seek_to_ms_async(uint64_t to_ms) {
+  return submit<PlayerRetCode::SeekRes>(
+      [this, to_ms]() { return do_seek_to_ms(to_ms); }, true);
+}
+
 PlayerRetCode::LoadRes Player::load(const Entity::File &file) {
+  return load_async(file).get();
+}
+
+PlayerRetCode::LoadRes Player::load_from_queue(unsigned int index) {
+  return load_from_queue_async(index).get();
+}
+
+PlayerRetCode::LoadRes Player::next() { return next_async().get(); }
+
+PlayerRetCode::PlayRes Player::play() { return play_async().get(); }
+
+PlayerRetCode::StopRes Player::stop() { return stop_async().get(); }
+
+PlayerRetCode::PauseRes Player::pause() { return pause_async().get(); }
+
+PlayerRetCode::ResumeRes Player::resume() { return resume_async().get(); }
+
+PlayerRetCode::SeekRes Player::seek(int64_t offset_second) {
+  return seek_ms(offset_second * 1000);
+}
+
+PlayerRetCode::SeekRes Player::seek_to(uint32_t to_second) {
+  return seek_to_ms((uint64_t)to_second * 1000);
+}
+
+PlayerRetCode::SeekRes Player::seek_ms(int64_t offset_ms) {
+  return seek_ms_async(offset_ms).get();
+}
+
+PlayerRetCode::SeekRes Player::seek_to_ms(uint64_t to_ms) {
+  return seek_to_ms_async(to_ms).get();
+}
+
+void Player::set_queue(MusicQueue *queue__) {
   std::lock_guard<std::mutex> lock(state_mtx);
+  queue = queue__;
+  queue_index = -1;
+}
+
+const int Player::get_queue_index() { return queue_index; }
+
+PlayerRetCode::LoadRes Player::do_load(const Entity::File &file) {
+  do_stop();
+
+  queue_index = -1;
+  return load_file(file);
+}
+
+PlayerRetCode::LoadRes Player::do_load_from_queue(unsigned int index) {
+  do_stop();
+
+  Entity::File file;
+  {
+    std::lock_guard<std::mutex> lock(state_mtx);
+
+    if (queue == nullptr) {
+      return PlayerRetCode::LoadRes::QueueNotSet;
+    }
+
+    const std::vector<Entity::File> &files = queue->get_queue();
+    if (index >= files.size()) {
+      return PlayerRetCode::LoadRes::InvalidIndex;
+    }
+
+    file = files[index];
+  }
+
+  PlayerRetCode::LoadRes res = load_file(file);
+  if (res == PlayerRetCode::LoadRes::Success) {
+    queue_index = index;
+    publish_position(0);
+  }
+
+  return res;
+}
+
+PlayerRetCode::LoadRes Player::do_next() {
+  const bool was_playing = playback_active;
+
+  PlayerRetCode::LoadRes res = do_load_from_queue(queue_index + 1);
+  if (res == PlayerRetCode::LoadRes::Success && was_playing) {
+    do_play();
+  }
+
+  return res;
+}
+
+PlayerRetCode::LoadRes Player::load_file(const Entity::File &file) {
+  std::lock_guard<std::mutex> decoder_lock(decoder_mtx);
+  const auto load_start = std::chrono::steady_clock::now();
+
+  next_decoder.reset();
+  ending_decoder.reset();
+  next_file.reset();
+  boundary_pending = false;
+
+  Audio::FormatInfo afi;
+  PlayerRetCode::LoadRes res = open_decoder(file, decoder, afi);
+  timing_decoder_open_us = since_us(load_start);
+  if (res != PlayerRetCode::LoadRes::Success) {
+    return res;
+  }
+
+  const auto output_start = std::chrono::steady_clock::now();
+  OutputRetCode::OpenRes open_res = output->open(afi);
+  timing_output_open_us = since_us(output_start);
+  if (open_res != OutputRetCode::OpenRes::Success)
+    return PlayerRetCode::LoadRes::Error;
+
+  if (output->get_buffer_info(current_buffer) !=
+      OutputRetCode::BufferInfoRes::Success) {
+    current_buffer = Audio::BufferInfo{afi.rate, 0, 0};
+  }
+
+  set_buffer_sizes(afi);
 
+  current_afi = afi;
+  current_file = file;
+  current_length_frames = std::max<int64_t>(-1, decoder->length_frames());
+  played_frames = 0;
+  publish_position(0);
+
+  timing_load_us = since_us(load_start);
+
+  return PlayerRetCode::LoadRes::Success;
+}
+
+PlayerRetCode::LoadRes Player::open_decoder(const Entity::File &file,
+                                            std::unique_ptr<Decoder> &dec,
+                                            Audio::FormatInfo &afi) {
   const std::filesystem::path fullpath =
       fmt::format("{}/{}", file.fulldir_path.c_str(), file.filename.c_str());
 
@@ -64,62 +353,91 @@ PlayerRetCode::LoadRes Player::load(const Entity::File &file) {
     return PlayerRetCode::LoadRes::DecoderNotFound;
   }
 
-  if (decoder) {
-    const Enum::DecoderType decoder_type = decoder->get_decoder_type();
+  if (dec) {
+    const Enum::DecoderType decoder_type = dec->get_decoder_type();
     if (decoder_type != expected_decoder_type) {
-      decoder = DecoderFactory::create(filetype);
+      dec = DecoderFactory::create(filetype);
     }
   } else {
-    decoder = DecoderFactory::create(filetype);
+    dec = DecoderFactory::create(filetype);
   }
 
-  if (!decoder->is_initialized()) {
+  if (!dec->is_initialized()) {
     return PlayerRetCode::LoadRes::FailedToInitDecoder;
   }
 
-  if (decoder->open(fullpath) != DecoderRetCode::OpenRes::Success)
-    goto error;
-
-  Audio::FormatInfo afi;
-  if (decoder->get_format(afi) != DecoderRetCode::GetFmtRes::Success)
-    goto error;
-  if (decoder->set_format(afi) != DecoderRetCode::SetFmtRes::Success)
-    goto error;
+  if (dec->open(fullpath) != DecoderRetCode::OpenRes::Success)
+    return PlayerRetCode::LoadRes::Error;
 
-  if (output->open(afi) != OutputRetCode::OpenRes::Success)
-    goto error;
+  if (dec->get_format(afi) != DecoderRetCode::GetFmtRes::Success)
+    return PlayerRetCode::LoadRes::Error;
+  if (dec->set_format(afi) != DecoderRetCode::SetFmtRes::Success)
+    return PlayerRetCode::LoadRes::Error;
 
-  current_file = &file;
+  load_frame_index(file, *dec);
 
   return PlayerRetCode::LoadRes::Success;
-
-error:
-  return PlayerRetCode::LoadRes::Error;
 }
 
-PlayerRetCode::PlayRes Player::play() {
-  std::lock_guard<std::mutex> lock(state_mtx);
+// A cached seek index spares the decoder from scanning frames on the first
+// seek into a long file. Missing, stale or failed entries are not an
+// error.
+void Player::load_frame_index(const Entity::File &file, Decoder &dec) {
+  if (db == nullptr || !db->is_initialized()) {
+    return;
+  }
+
+  Entity::FrameIndex index;
+  if (db->get_frame_index(file.id, file.modified_time, file.filesize, index) !=
+          DBRetCode::GetFrameIndexRes::Success ||
+      index.offsets.empty()) {
+    return;
+  }
+
+  dec.set_index(index.offsets, index.step);
+}
 
+PlayerRetCode::PlayRes Player::do_play() {
   if (playback_active) {
     return PlayerRetCode::PlayRes::PlaybackIsAlreadyRunning;
   }
 
-  if (current_file == nullptr) {
+  if (!current_file.has_value()) {
     return PlayerRetCode::PlayRes::FileNotLoaded;
   }
 
+  {
+    std::lock_guard<std::mutex> decoder_lock(decoder_mtx);
+
+    // The decoder never writes more than one period once the ring holds less
+    // than fill_target, so this capacity can never overflow.
+    ring.reset(fill_target + period_bytes);
+
+    decode_finished = false;
+    flush_pending = false;
+    decode_index = queue_index;
+  }
+
+  start_since = command_issued;
+  timing_first_decode_us = -1;
+  timing_first_write_us = -1;
+  first_decode_pending = true;
+  first_write_pending = true;
+
+  {
+    std::lock_guard<std::mutex> lock(ring_mtx);
+    decode_active = true;
+  }
+  space_cv.notify_one();
+
   playback_active = true;
   pause_action = false;
-  stop_action = false;
-
-  thrd = std::thread([this]() { playback_loop(); });
+  publish_state();
 
   return PlayerRetCode::PlayRes::Success;
 }
 
-PlayerRetCode::PauseRes Player::pause() {
-  std::lock_guard<std::mutex> lock(state_mtx);
-
+PlayerRetCode::PauseRes Player::do_pause() {
   if (!playback_active) {
     return PlayerRetCode::PauseRes::PlaybackIsNotRunning;
   }
@@ -135,14 +453,13 @@ PlayerRetCode::PauseRes Player::pause() {
   last_toggle_pause = now;
 
   pause_action = true;
+  publish_state();
   output->pause();
 
   return PlayerRetCode::PauseRes::Success;
 }
 
-PlayerRetCode::ResumeRes Player::resume() {
-  std::lock_guard<std::mutex> lock(state_mtx);
-
+PlayerRetCode::ResumeRes Player::do_resume() {
   if (!playback_active) {
     return PlayerRetCode::ResumeRes::PlaybackIsNotRunning;
   }
@@ -158,152 +475,537 @@ PlayerRetCode::ResumeRes Player::resume() {
   last_toggle_pause = now;
 
   pause_action = false;
+  publish_state();
   output->unpause();
-  cv.notify_one();
 
   return PlayerRetCode::ResumeRes::Success;
 }
 
-PlayerRetCode::StopRes Player::stop() {
-  {
-    std::lock_guard<std::mutex> lock(state_mtx);
-    if (!playback_active) {
-      return PlayerRetCode::StopRes::PlaybackIsNotRunning;
-    }
-
-    stop_action = true;
-    pause_action = false;
-    playback_active = false;
-
-    output->stop();
+PlayerRetCode::StopRes Player::do_stop() {
+  if (!playback_active) {
+    return PlayerRetCode::StopRes::PlaybackIsNotRunning;
   }
 
-  cv.notify_one();
+  playback_active = false;
+  pause_action = false;
+  audible_pending_since.reset();
+  deactivate_decode();
+  publish_state();
 
-  if (thrd.joinable()) {
-    thrd.join();
-  }
+  output->stop();
 
   return PlayerRetCode::StopRes::Success;
 }
 
-PlayerRetCode::SeekRes Player::seek(int64_t offset_second) {
-  std::lock_guard<std::mutex> lock(state_mtx);
+PlayerRetCode::SeekRes Player::do_seek_ms(int64_t offset_ms) {
   if (!playback_active) {
     return PlayerRetCode::SeekRes::PlaybackIsNotRunning;
   }
 
-  if (current_file == nullptr) {
+  if (!current_file.has_value()) {
     return PlayerRetCode::SeekRes::FileNotLoaded;
   }
 
-  int bitrate = current_file->bitrate;
-  int byte_per_sec = (bitrate * 1000) / 8;
-
-  uint32_t curr_sec = get_current_tell_sec();
-  int64_t final_sec = curr_sec + offset_second;
+  std::lock_guard<std::mutex> decoder_lock(decoder_mtx);
+  revert_splice();
 
-  if (final_sec < 0 || final_sec > current_file->length) {
-    return PlayerRetCode::SeekRes::OffsetOutOfRange;
+  // Relative to what is heard, not to what the output has been handed,
+  // which runs a whole device buffer ahead.
+  int64_t delay = 0;
+  if (output->get_delay(delay) != OutputRetCode::DelayRes::Success) {
+    delay = 0;
   }
+  const int64_t audible = std::max<int64_t>(0, played_frames - delay);
 
-  double offset = byte_per_sec * offset_second;
+  const int64_t rate = current_afi.rate;
+  int64_t target = audible + offset_ms * rate / 1000;
 
-  DecoderRetCode::SeekRes res = decoder->seek_cur(offset);
-  if (res != DecoderRetCode::SeekRes::Success) {
-    return PlayerRetCode::SeekRes::Error;
+  if (target < 0 ||
+      (current_length_frames >= 0 && target > current_length_frames)) {
+    return PlayerRetCode::SeekRes::OffsetOutOfRange;
   }
 
-  return PlayerRetCode::SeekRes::Success;
+  return seek_to_frame(target);
 }
 
-PlayerRetCode::SeekRes Player::seek_to(uint32_t to_second) {
-  std::lock_guard<std::mutex> lock(state_mtx);
+PlayerRetCode::SeekRes Player::do_seek_to_ms(uint64_t to_ms) {
   if (!playback_active) {
     return PlayerRetCode::SeekRes::PlaybackIsNotRunning;
   }
 
-  if (current_file == nullptr) {
+  if (!current_file.has_value()) {
     return PlayerRetCode::SeekRes::FileNotLoaded;
   }
 
-  if (to_second < 0 || to_second > current_file->length) {
+  std::lock_guard<std::mutex> decoder_lock(decoder_mtx);
+  revert_splice();
+
+  const int64_t rate = current_afi.rate;
+  int64_t target = to_ms * rate / 1000;
+
+  if (current_length_frames >= 0 && target > current_length_frames) {
     return PlayerRetCode::SeekRes::OffsetOutOfRange;
   }
 
-  int bitrate = current_file->bitrate;
-  int byte_per_sec = (bitrate * 1000) / 8;
+  return seek_to_frame(target);
+}
+
+const uint32_t Player::get_current_tell_sec() {
+  return get_position_ms() / 1000;
+}
 
-  uint32_t curr_sec = get_current_tell_sec();
-  int64_t diff = to_second - curr_sec;
+const uint64_t Player::get_position_ms() {
+  PlaybackStatus st = get_status();
+  if (st.state == Enum::PlaybackState::STOPPED || st.rate == 0) {
+    return 0;
+  }
 
-  double offset = byte_per_sec * diff;
+  int64_t audible = std::max<int64_t>(0, st.frames_played - st.output_delay);
+  return (uint64_t)audible * 1000 / st.rate;
+}
 
-  DecoderRetCode::SeekRes res = decoder->seek_cur(offset);
+const uint64_t Player::get_duration_ms() {
+  PlaybackStatus st = get_status();
+  if (st.file_id < 0 || st.rate == 0 || st.length_frames < 0) {
+    return 0;
+  }
+
+  return (uint64_t)st.length_frames * 1000 / st.rate;
+}
+
+const PlaybackStatus Player::get_status() {
+  PlaybackStatus st = status.load();
+  st.state = playback_state.load(std::memory_order_acquire);
+  return st;
+}
+
+const CommandLatency Player::get_command_latency() {
+  return CommandLatency{last_queue_us.load(), last_audible_us.load()};
+}
+
+const StartTiming Player::get_start_timing() {
+  return StartTiming{timing_load_us.load(), timing_decoder_open_us.load(),
+                     timing_output_open_us.load(),
+                     timing_first_decode_us.load(),
+                     timing_first_write_us.load()};
+}
+
+// Position fields have a single writer, the engine thread.
+void Player::publish_position(int64_t output_delay) {
+  PlaybackStatus st;
+  st.state = Enum::PlaybackState::STOPPED;
+  st.file_id = current_file.has_value() ? current_file->id : -1;
+  st.queue_index = queue_index;
+  st.rate = current_afi.rate;
+  st.frames_played = played_frames;
+  st.output_delay = output_delay;
+  st.length_frames = current_length_frames;
+  st.buffer_frames = current_buffer.buffer_frames;
+  st.period_frames = current_buffer.period_frames;
+  status.store(st);
+}
+
+void Player::publish_state() {
+  Enum::PlaybackState state = Enum::PlaybackState::STOPPED;
+  if (playback_active) {
+    state = pause_action ? Enum::PlaybackState::PAUSED
+                         : Enum::PlaybackState::PLAYING;
+  }
+
+  playback_state.store(state, std::memory_order_release);
+}
+
+// Must be called with decoder_mtx held. The engine thread picks up
+// seek_target as its new position when it performs the flush.
+PlayerRetCode::SeekRes Player::seek_to_frame(int64_t frame) {
+  DecoderRetCode::SeekRes res = decoder->seek_frame(frame);
   if (res != DecoderRetCode::SeekRes::Success) {
     return PlayerRetCode::SeekRes::Error;
   }
 
+  seek_target = frame;
+  request_flush();
+
   return PlayerRetCode::SeekRes::Success;
 }
 
-const uint32_t Player::get_current_tell_sec() {
-  std::lock_guard<std::mutex> lock(state_mtx);
-  if (!playback_active) {
-    return 0;
+// Must be called with decoder_mtx held. If the decode thread already spliced
+// the next track into the ring, hand the decoders back so that a seek applies
+// to the track that is actually audible. The spliced PCM is dropped by the
+// flush that follows every seek.
+void Player::revert_splice() {
+  if (!boundary_pending) {
+    return;
   }
 
-  if (current_file == nullptr) {
-    return 0;
-  }
+  decoder->seek_set(0);
+  next_decoder = std::move(decoder);
+  next_afi = boundary_afi;
+  next_file = boundary_file;
+  next_length_frames = boundary_length_frames;
 
-  int bitrate = current_file->bitrate;
-  int byte_per_sec = (bitrate * 1000) / 8;
+  decoder = std::move(ending_decoder);
+  decode_index--;
+  boundary_pending = false;
+}
+
+// Must be called with decoder_mtx held, right after the decoder position
+// changed. The decode thread will not write again until the engine thread
+// has dropped everything buffered from the old position.
+void Player::request_flush() {
+  decode_finished = false;
+  flush_pending = true;
+}
 
-  int64_t curr_tell = decoder->tell();
-  uint32_t curr_sec = curr_tell / byte_per_sec;
-  return curr_sec;
+// Parks the decode thread. Anything spliced but not yet heard is handed back
+// so the next play() starts from the track that was loaded.
+void Player::deactivate_decode() {
+  std::lock_guard<std::mutex> decoder_lock(decoder_mtx);
+  decode_active = false;
+  revert_splice();
+}
+
+void Player::finish_playback() {
+  playback_active = false;
+  pause_action = false;
+  audible_pending_since.reset();
+  deactivate_decode();
+  publish_state();
 }
 
 const bool Player::is_playing() {
-  std::lock_guard<std::mutex> lock(state_mtx);
-  return playback_active && !pause_action;
+  return playback_state.load(std::memory_order_acquire) ==
+         Enum::PlaybackState::PLAYING;
 }
 
 const bool Player::is_paused() {
-  std::lock_guard<std::mutex> lock(state_mtx);
-  return playback_active && pause_action;
+  return playback_state.load(std::memory_order_acquire) ==
+         Enum::PlaybackState::PAUSED;
 }
 
-void Player::playback_loop() {
-  size_t done;
-  const int bufsize = 8192;
-  char *buf = new char[bufsize];
+// Owns the output for the lifetime of the player. Commands are applied
+// between periods, so one never waits for more than a single device write.
+void Player::engine_loop() {
+  std::vector<char> buf;
+  int64_t delay = 0;
 
-  while (true) {
-    {
-      std::unique_lock<std::mutex> lock(state_mtx);
+  while (!engine_exit) {
+    run_commands();
+
+    if (engine_exit) {
+      break;
+    }
 
-      if (stop_action) {
-        break;
+    if (!playback_active || pause_action) {
+      std::unique_lock<std::mutex> lock(ring_mtx);
+      engine_cv.wait(lock,
+                     [this]() { return engine_exit || !commands.empty(); });
+      continue;
+    }
+
+    if (flush_pending) {
+      // The device still holds up to a buffer of audio from before the
+      // seek, drop it too so the target is the next thing heard.
+      output->stop();
+      ring.discard();
+      played_frames = seek_target.load();
+      flush_pending = false;
+      space_cv.notify_one();
+      publish_position(0);
+    }
+
+    const size_t fsize = current_afi.frame_size;
+    const size_t period = period_bytes;
+    if (buf.size() != period) {
+      buf.resize(period);
+    }
+
+    size_t count = std::min(ring.readable(), period);
+
+    if (boundary_pending) {
+      const size_t pos = ring.read_position();
+      const size_t boundary = boundary_pos;
+
+      if (pos >= boundary) {
+        advance_track();
+        continue;
       }
 
-      if (pause_action) {
-        cv.wait(lock, [this]() { return !pause_action || stop_action; });
-        if (stop_action) {
-          break;
-        }
+      count = std::min(count, boundary - pos);
+    }
+
+    if (count < fsize) {
+      if (decode_finished && !flush_pending && !boundary_pending &&
+          ring.readable() < fsize) {
+        finish_playback();
+        continue;
       }
+
+      std::unique_lock<std::mutex> lock(ring_mtx);
+      engine_cv.wait_for(lock, std::chrono::milliseconds(period_ms), [&]() {
+        return engine_exit || !commands.empty() || flush_pending ||
+               decode_finished || ring.readable() >= fsize;
+      });
+      continue;
     }
 
-    if (decoder->read(buf, bufsize, done) == DecoderRetCode::ReadRes::Success) {
-      output->write(buf, done);
+    count -= count % fsize;
+
+    // In mmap mode PCM goes from the ring straight into device memory.
+    char *dst;
+    int room = count;
+    if (output->begin_write(dst, room) ==
+        OutputRetCode::BeginWriteRes::Success) {
+      count = ring.read(dst, room - room % fsize);
+      space_cv.notify_one();
+      output->commit_write(count);
     } else {
+      count = ring.read(buf.data(), count);
+      space_cv.notify_one();
+      output->write(buf.data(), count);
+    }
+    played_frames += count / fsize;
+
+    if (first_write_pending) {
+      timing_first_write_us = since_us(start_since);
+      first_write_pending = false;
+    }
+
+    if (output->get_delay(delay) != OutputRetCode::DelayRes::Success) {
+      delay = 0;
+    }
+    publish_position(delay);
+
+    if (audible_pending_since.has_value()) {
+      auto elapsed = std::chrono::steady_clock::now() - *audible_pending_since;
+      last_audible_us =
+          std::chrono::duration_cast<std::chrono::microseconds>(elapsed)
+              .count() +
+          delay * 1000000 / std::max(1u, current_afi.rate);
+      audible_pending_since.reset();
+    }
+  }
+}
+
+// Called by the engine thread once everything before the splice point has
+// been written, from here on the output plays the next queued track.
+void Player::advance_track() {
+  bool reopen;
+  Audio::FormatInfo afi;
+
+  {
+    std::lock_guard<std::mutex> decoder_lock(decoder_mtx);
+
+    if (!boundary_pending) {
+      return;
+    }
+
+    current_file = boundary_file;
+    current_afi = boundary_afi;
+    current_length_frames = boundary_length_frames;
+    played_frames = 0;
+    queue_index++;
+    publish_position(0);
+
+    ending_decoder.reset();
+    reopen = boundary_reopen;
+    afi = boundary_afi;
+
+    boundary_pending = false;
+  }
+
+  space_cv.notify_one();
+
+  // Outputs keep their device open and only renegotiate the format, after
+  // letting the previous track play out.
+  if (reopen) {
+    // Playing on in the old format would be noise, stop instead.
+    if (output->open(afi) != OutputRetCode::OpenRes::Success) {
+      finish_playback();
+      return;
+    }
+
+    if (output->get_buffer_info(current_buffer) !=
+        OutputRetCode::BufferInfoRes::Success) {
+      current_buffer = Audio::BufferInfo{afi.rate, 0, 0};
+    }
+
+    // The decode thread reads both sizes under decoder_mtx, and writes to
+    // the ring only with it held, so the ring can grow here for a format
+    // with a higher byte rate while it holds the new track.
+    {
+      std::lock_guard<std::mutex> decoder_lock(decoder_mtx);
+      set_buffer_sizes(afi);
+      ring.grow(fill_target + period_bytes);
+    }
+    space_cv.notify_one();
+    publish_position(0);
+  }
+}
+
+// Must be called with decoder_mtx held. Moves one device period per engine
+// iteration, the latency profile then also decides how often the engine and
+// decode threads wake up. Both sizes are whole frames of `afi`.
+void Player::set_buffer_sizes(const Audio::FormatInfo &afi) {
+  const size_t fsize = afi.frame_size;
+  const size_t bytes_per_sec = (size_t)afi.rate * fsize;
+
+  size_t period = current_buffer.period_frames * fsize;
+  if (period == 0) {
+    period = bytes_per_sec * period_ms / 1000;
+  }
+  period = std::max(fsize, period - period % fsize);
+
+  size_t target = bytes_per_sec * config.buffer_ms / 1000;
+  target = std::max(period, target - target % fsize);
+
+  period_bytes = period;
+  fill_target = target;
+}
+
+void Player::decode_loop() {
+  size_t done;
+  bool waiting_boundary = false;
+  std::vector<char> buf;
+
+  while (!engine_exit) {
+    {
+      std::unique_lock<std::mutex> lock(ring_mtx);
+      if (!decode_active) {
+        space_cv.wait(lock, [this]() { return engine_exit || decode_active; });
+        waiting_boundary = false;
+      } else {
+        space_cv.wait_for(lock, std::chrono::milliseconds(period_ms), [&]() {
+          return engine_exit ||
+                 (!flush_pending && !decode_finished &&
+                  !(waiting_boundary && boundary_pending) &&
+                  ring.readable() < fill_target);
+        });
+      }
+    }
+
+    if (engine_exit) {
       break;
     }
+
+    if (decode_active && ring.readable() >= fill_target) {
+      prime_next();
+    }
+
+    std::lock_guard<std::mutex> lock(decoder_mtx);
+
+    if (!decode_active || flush_pending || decode_finished ||
+        ring.readable() >= fill_target) {
+      continue;
+    }
+
+    waiting_boundary = false;
+
+    const size_t period = period_bytes;
+    if (buf.size() != period) {
+      buf.resize(period);
+    }
+
+    if (decoder->read(buf.data(), period, done) ==
+        DecoderRetCode::ReadRes::Success) {
+      // The ring holds at least fill_target plus one period, and decoding
+      // only happens below fill_target.
+      const size_t written = ring.write(buf.data(), done);
+      assert(written == done);
+      (void)written;
+
+      if (first_decode_pending.exchange(false)) {
+        timing_first_decode_us = since_us(start_since);
+      }
+    } else if (!next_decoder) {
+      decode_finished = true;
+    } else if (!boundary_pending) {
+      splice_next();
+    } else {
+      // Only one splice point can be in flight, wait for the engine thread
+      // to reach the previous one.
+      waiting_boundary = true;
+    }
+
+    engine_cv.notify_one();
   }
+}
 
-  std::lock_guard<std::mutex> lock(state_mtx);
-  playback_active = false;
-  delete[] buf;
+// Opens the queue entry after the one being decoded on a second decoder so
+// that it is ready the moment the current one hits end of stream. Runs on
+// the decode thread while the ring is full, so it never delays playback.
+void Player::prime_next() {
+  int index;
+  std::optional<int> failed_id;
+
+  {
+    std::lock_guard<std::mutex> decoder_lock(decoder_mtx);
+    if (next_decoder || decode_index < 0) {
+      return;
+    }
+
+    index = decode_index;
+    if (next_file.has_value()) {
+      failed_id = next_file->id;
+    }
+  }
+
+  Entity::File file;
+
+  {
+    std::lock_guard<std::mutex> lock(state_mtx);
+    if (queue == nullptr) {
+      return;
+    }
+
+    const std::vector<Entity::File> &files = queue->get_queue();
+    if (index + 1 >= (int)files.size()) {
+      return;
+    }
+
+    file = files[index + 1];
+  }
+
+  if (failed_id == file.id) {
+    // Priming this entry failed before, do not retry on every iteration.
+    return;
+  }
+
+  std::unique_ptr<Decoder> dec = nullptr;
+  Audio::FormatInfo afi;
+  PlayerRetCode::LoadRes res = open_decoder(file, dec, afi);
+
+  std::lock_guard<std::mutex> decoder_lock(decoder_mtx);
+  // A seek or a new load may have moved decoding on meanwhile.
+  if (next_decoder || decode_index != index) {
+    return;
+  }
+
+  next_file = file;
+  if (res == PlayerRetCode::LoadRes::Success) {
+    next_length_frames = std::max<int64_t>(-1, dec->length_frames());
+    next_decoder = std::move(dec);
+    next_afi = afi;
+  }
+}
+
+// Must be called with decoder_mtx held. Switches decoding to the primed next
+// track and records where in the ring its first sample lands. Tracks with
+// the same output format are spliced back to back, anything else makes the
+// engine thread reconfigure the device at the boundary.
+void Player::splice_next() {
+  boundary_reopen = next_afi.rate != current_afi.rate ||
+                    next_afi.channels != current_afi.channels ||
+                    next_afi.encoding != current_afi.encoding;
+  boundary_afi = next_afi;
+  boundary_file = *next_file;
+  boundary_length_frames = next_length_frames;
+  boundary_pos = ring.write_position();
+
+  ending_decoder = std::move(decoder);
+  decoder = std::move(next_decoder);
+  next_file.reset();
+  decode_index++;
+
+  boundary_pending = true;
 }
@@ -1,12 +1,20 @@
 #pragma once
+#include "common/mpsc_queue.hpp"
+#include "common/ring_buffer.hpp"
+#include "common/seqlock.hpp"
 #include "common/types.hpp"
 #include "decoder.hpp"
+#include "library.hpp"
 #include "output.hpp"
 #include <array>
 #include <atomic>
 #include <chrono>
 #include <condition_variable>
+#include <functional>
+#include <future>
 #include <mutex>
+#include <optional>
+#include <string>
 #include <thread>
 #include <utility>
 
@@ -21,6 +29,8 @@ enum class LoadRes {
   Success = 0,
   FailedToInitDecoder,
   DecoderNotFound,
+  QueueNotSet,
+  InvalidIndex,
   Error,
 };
 
@@ -63,9 +73,63 @@ enum class SeekRes {
 
 }; // namespace PlayerRetCode
 
+// Snapshot of what the output is doing, readable from any thread without
+// locking. Positions are in PCM frames at `rate`, the audible position is
+// frames_played - output_delay, length_frames is -1 when the decoder can't
+// tell. buffer_frames and period_frames are the device buffer geometry
+// negotiated for the latency profile, 0 if unknown.
+struct PlaybackStatus {
+  Enum::PlaybackState state;
+  int file_id;
+  int queue_index;
+  unsigned int rate;
+  int64_t frames_played;
+  int64_t output_delay;
+  int64_t length_frames;
+  uint64_t buffer_frames;
+  uint64_t period_frames;
+};
+
+// Latency of the last command handled by the audio engine: time spent
+// waiting in the command queue, and for commands that change what is heard
+// (play, resume, seek, next) the time until the first affected sample
+// reaches the device, including the device delay.
+struct CommandLatency {
+  int64_t queue_us;
+  int64_t audible_us;
+};
+
+// Spans of the last track start in microseconds, -1 until measured. load
+// covers opening the decoder (including the format probe) and the output.
+// first_decode and first_write run from the play command being issued to
+// the first PCM entering the ring and being handed to the output.
+struct StartTiming {
+  int64_t load_us;
+  int64_t decoder_open_us;
+  int64_t output_open_us;
+  int64_t first_decode_us;
+  int64_t first_write_us;
+};
+
+struct PlayerCommand {
+  std::function<void()> run;
+  // Answers with the command's Error result instead of running it.
+  std::function<void()> fail;
+  std::chrono::steady_clock::time_point issued;
+  bool audible = false;
+};
+
 struct PlayerConfig {
   Enum::OutputType output_type;
   Enum::OutputDeviceType device_type;
+  unsigned int buffer_ms = 2000;
+  // MMAP skips the copy into the device buffer where the hardware allows it.
+  Enum::OutputAccess output_access = Enum::OutputAccess::RW;
+  // LOW_LATENCY keeps the device buffer around 20ms for snappy seeks,
+  // POWER_SAVING uses 2s with large periods to keep wakeups rare.
+  Enum::LatencyProfile latency_profile = Enum::LatencyProfile::DEFAULT;
+  // Target of WAV_FILE and RAW_FILE outputs, "-" for stdout.
+  std::string output_path = "-";
 };
 
 constexpr std::array<std::pair<Enum::FileType, Enum::DecoderType>, 1>
@@ -82,14 +146,38 @@ constexpr Enum::DecoderType get_decoder_with_filetype(Enum::FileType type) {
 
 class Player {
 public:
-  Player(const PlayerConfig &config);
+  Player(const PlayerConfig &config, DB *db__ = nullptr);
+  ~Player();
 
   PlayerRetCode::InitRes init();
   void exit();
 
   const uint32_t get_current_tell_sec();
+  const uint64_t get_position_ms();
+  const uint64_t get_duration_ms();
+  const PlaybackStatus get_status();
+  const CommandLatency get_command_latency();
+  const StartTiming get_start_timing();
+
+  void set_queue(MusicQueue *queue__);
+  const int get_queue_index();
+
+  // Transport commands run on the audio engine thread. The *_async variants
+  // return as soon as the command is queued, the plain ones wait for it.
+  // Without an engine, before init() or after exit(), they return Error.
+  std::future<PlayerRetCode::LoadRes> load_async(const Entity::File &file);
+  std::future<PlayerRetCode::LoadRes> load_from_queue_async(unsigned int index);
+  std::future<PlayerRetCode::LoadRes> next_async();
+  std::future<PlayerRetCode::PlayRes> play_async();
+  std::future<PlayerRetCode::StopRes> stop_async();
+  std::future<PlayerRetCode::PauseRes> pause_async();
+  std::future<PlayerRetCode::ResumeRes> resume_async();
+  std::future<PlayerRetCode::SeekRes> seek_ms_async(int64_t offset_ms);
+  std::future<PlayerRetCode::SeekRes> seek_to_ms_async(uint64_t to_ms);
 
   PlayerRetCode::LoadRes load(const Entity::File &file);
+  PlayerRetCode::LoadRes load_from_queue(unsigned int index);
+  PlayerRetCode::LoadRes next();
   PlayerRetCode::PlayRes play();
   PlayerRetCode::StopRes stop();
 
@@ -98,28 +186,127 @@ public:
 
   PlayerRetCode::SeekRes seek(int64_t offset_second);
   PlayerRetCode::SeekRes seek_to(uint32_t to_second);
+  PlayerRetCode::SeekRes seek_ms(int64_t offset_ms);
+  PlayerRetCode::SeekRes seek_to_ms(uint64_t to_ms);
 
   const bool is_playing();
   const bool is_paused();
 
 private:
   PlayerConfig config;
+  DB *db = nullptr;
+
+  // Owned by the engine thread.
+  std::optional<Entity::File> current_file;
+  Audio::FormatInfo current_afi;
+  int64_t current_length_frames = 0;
+  Audio::BufferInfo current_buffer = {0, 0, 0};
+
+  // Frames of the current track handed to the output, written by the engine
+  // thread only. seek_target is the frame it restarts from after a flush.
+  std::atomic<int64_t> played_frames = 0;
+  std::atomic<int64_t> seek_target = 0;
+
+  SeqLock<PlaybackStatus> status;
+  std::atomic<Enum::PlaybackState> playback_state =
+      Enum::PlaybackState::STOPPED;
 
-  const Entity::File *current_file = nullptr;
+  std::atomic<int64_t> last_queue_us = 0;
+  std::atomic<int64_t> last_audible_us = 0;
+  std::optional<std::chrono::steady_clock::time_point> audible_pending_since;
+  std::chrono::steady_clock::time_point command_issued;
+
+  std::atomic<int64_t> timing_load_us = -1;
+  std::atomic<int64_t> timing_decoder_open_us = -1;
+  std::atomic<int64_t> timing_output_open_us = -1;
+  std::atomic<int64_t> timing_first_decode_us = -1;
+  std::atomic<int64_t> timing_first_write_us = -1;
+  std::chrono::steady_clock::time_point start_since;
+  std::atomic<bool> first_decode_pending = false;
+  bool first_write_pending = false;
+
+  MusicQueue *queue = nullptr;
+  std::atomic<int> queue_index = -1;
 
   std::unique_ptr<Output> output = nullptr;
   std::unique_ptr<Decoder> decoder = nullptr;
 
-  std::thread thrd;
-  std::condition_variable cv;
+  // Gapless state, guarded by decoder_mtx. decode_index is the queue entry
+  // being decoded, which runs ahead of queue_index (the one being heard).
+  int decode_index = -1;
+  std::unique_ptr<Decoder> next_decoder = nullptr;
+  std::unique_ptr<Decoder> ending_decoder = nullptr;
+  std::optional<Entity::File> next_file;
+  Audio::FormatInfo next_afi;
+  int64_t next_length_frames = 0;
+
+  std::atomic<bool> boundary_pending = false;
+  std::atomic<size_t> boundary_pos = 0;
+  bool boundary_reopen = false;
+  Entity::File boundary_file;
+  Audio::FormatInfo boundary_afi;
+  int64_t boundary_length_frames = 0;
+
+  std::thread engine_thrd;
+  std::atomic<bool> engine_running = false;
+  std::atomic<bool> engine_exit = false;
+  MPSCQueue<PlayerCommand> commands;
   std::mutex state_mtx;
 
+  std::thread decode_thrd;
+  std::mutex decoder_mtx;
+
+  PCMRingBuffer ring;
+  std::atomic<size_t> period_bytes = 0;
+  std::atomic<size_t> fill_target = 0;
+  std::mutex ring_mtx;
+  std::condition_variable space_cv;
+  std::condition_variable engine_cv;
+
   std::atomic<bool> playback_active = false;
   std::atomic<bool> pause_action = false;
-  std::atomic<bool> stop_action = false;
+  std::atomic<bool> decode_active = false;
+  std::atomic<bool> decode_finished = false;
+  std::atomic<bool> flush_pending = false;
 
   std::chrono::steady_clock::time_point last_toggle_pause;
   const std::chrono::milliseconds toggle_pause_cooldown;
 
-  void playback_loop();
+  template <typename Res>
+  std::future<Res> submit(std::function<Res()> fn, bool audible = false);
+  void run_commands();
+  void fail_commands();
+
+  PlayerRetCode::LoadRes do_load(const Entity::File &file);
+  PlayerRetCode::LoadRes do_load_from_queue(unsigned int index);
+  PlayerRetCode::LoadRes do_next();
+  PlayerRetCode::PlayRes do_play();
+  PlayerRetCode::StopRes do_stop();
+  PlayerRetCode::PauseRes do_pause();
+  PlayerRetCode::ResumeRes do_resume();
+  PlayerRetCode::SeekRes do_seek_ms(int64_t offset_ms);
+  PlayerRetCode::SeekRes do_seek_to_ms(uint64_t to_ms);
+
+  PlayerRetCode::LoadRes load_file(const Entity::File &file);
+  PlayerRetCode::LoadRes open_decoder(const Entity::File &file,
+                                      std::unique_ptr<Decoder> &dec,
+                                      Audio::FormatInfo &afi);
+
+  void load_frame_index(const Entity::File &file, Decoder &dec);
+
+  void prime_next();
+  void splice_next();
+  void revert_splice();
+  void advance_track();
+  void set_buffer_sizes(const Audio::FormatInfo &afi);
+
+  PlayerRetCode::SeekRes seek_to_frame(int64_t frame);
+  void request_flush();
+  void deactivate_decode();
+  void finish_playback();
+  void publish_position(int64_t output_delay);
+  void publish_state();
+
+  void engine_loop();
+  void decode_loop();
 };
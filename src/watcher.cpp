@@ -0,0 +1,315 @@
+#include "watcher.hpp"
+#include "common/dir_walker.hpp"
+#include "common/utils.hpp"
+#include <algorithm>
+#include <array>
+#include <cerrno>
+#include <cstdint>
+#include <iostream>
+#include <poll.h>
+#include <sys/eventfd.h>
+#include <sys/inotify.h>
+#include <unistd.h>
+#include <vector>
+
+// Rips arrive through close-after-write or a rename into the tree, plain
+// creates cover links. Per-write IN_MODIFY events are not worth waking for.
+static constexpr uint32_t watch_mask = IN_CLOSE_WRITE | IN_CREATE | IN_DELETE |
+                                       IN_MOVED_FROM | IN_MOVED_TO |
+                                       IN_ONLYDIR;
+
+static constexpr size_t event_buf_size = 64 * 1024;
+
+LibraryWatcher::LibraryWatcher(Library *lib__, DB *db__)
+    : lib(lib__), db(db__) {}
+
+LibraryWatcher::~LibraryWatcher() { stop(); }
+
+WatcherRetCode::StartRes LibraryWatcher::start() {
+  if (running) {
+    return WatcherRetCode::StartRes::AlreadyRunning;
+  }
+
+  // The watch thread may have given up on an error, reap it first.
+  stop();
+
+  inotify_fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+  if (inotify_fd < 0) {
+    return WatcherRetCode::StartRes::CannotInit;
+  }
+
+  {
+    std::lock_guard<std::mutex> lock(roots_mtx);
+    wake_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+  }
+  if (wake_fd < 0) {
+    close(inotify_fd);
+    inotify_fd = -1;
+    return WatcherRetCode::StartRes::CannotInit;
+  }
+
+  // Read after add_root() starts queueing, so a root added meanwhile is
+  // either listed here or queued.
+  std::vector<Entity::Directory> directories;
+  if (db->get_directories_list(directories) != DBRetCode::GetDirRes::Success) {
+    close_fds();
+    return WatcherRetCode::StartRes::CannotGetDirs;
+  }
+
+  running = true;
+
+  // Setting up the watches walks every root, keep that off the caller.
+  watch_thrd = std::thread([this, directories]() {
+    for (const Entity::Directory &dir : directories) {
+      watch_tree(dir.id, dir.path);
+    }
+    watch_loop();
+  });
+
+  return WatcherRetCode::StartRes::Success;
+}
+
+void LibraryWatcher::stop() {
+  running = false;
+  if (!watch_thrd.joinable()) {
+    return;
+  }
+
+  wake();
+  watch_thrd.join();
+  close_fds();
+
+  watches.clear();
+  pending.clear();
+  overflowed = false;
+}
+
+bool LibraryWatcher::is_running() { return running; }
+
+void LibraryWatcher::add_root(int dir_id, const std::filesystem::path &path) {
+  std::lock_guard<std::mutex> lock(roots_mtx);
+  if (wake_fd < 0) {
+    return;
+  }
+  root_changes.push_back(RootChange{dir_id, path, true});
+  wake();
+}
+
+void LibraryWatcher::remove_root(int dir_id) {
+  std::lock_guard<std::mutex> lock(roots_mtx);
+  if (wake_fd < 0) {
+    return;
+  }
+  root_changes.push_back(RootChange{dir_id, {}, false});
+  wake();
+}
+
+void LibraryWatcher::set_debounce(std::chrono::milliseconds debounce__,
+                                  std::chrono::milliseconds max_delay__) {
+  debounce = debounce__;
+  max_delay = max_delay__;
+}
+
+void LibraryWatcher::watch_tree(int dir_id, const std::filesystem::path &root) {
+  WalkDirHooks hooks;
+  hooks.on_dir = [&](const WalkDirInfo &info) {
+    int wd = inotify_add_watch(inotify_fd, info.path.c_str(), watch_mask);
+    if (wd < 0) {
+      if (errno == ENOSPC) {
+        std::cerr << "Out of inotify watches at " << info.path << '\n';
+      }
+      return;
+    }
+
+    // Watching an inode twice returns the same descriptor, a moved
+    // directory just gets its new path.
+    watches[wd] = WatchedDir{dir_id, info.path};
+  };
+
+  walk_audio_files(root, [](const WalkEntry &) {}, &hooks);
+}
+
+void LibraryWatcher::unwatch_tree(const std::filesystem::path &root) {
+  for (auto it = watches.begin(); it != watches.end();) {
+    if (is_path_within(it->second.path, root)) {
+      inotify_rm_watch(inotify_fd, it->first);
+      it = watches.erase(it);
+    } else {
+      ++it;
+    }
+  }
+}
+
+void LibraryWatcher::apply_root_changes() {
+  std::vector<RootChange> changes;
+  {
+    std::lock_guard<std::mutex> lock(roots_mtx);
+    changes.swap(root_changes);
+  }
+
+  for (const RootChange &change : changes) {
+    if (change.added) {
+      watch_tree(change.dir_id, change.path);
+      continue;
+    }
+
+    for (auto it = watches.begin(); it != watches.end();) {
+      if (it->second.dir_id == change.dir_id) {
+        inotify_rm_watch(inotify_fd, it->first);
+        it = watches.erase(it);
+      } else {
+        ++it;
+      }
+    }
+    pending.erase(change.dir_id);
+  }
+}
+
+void LibraryWatcher::wake() {
+  const uint64_t one = 1;
+  if (write(wake_fd, &one, sizeof(one)) < 0) {
+    std::cerr << "Could not wake the library watcher" << '\n';
+  }
+}
+
+void LibraryWatcher::close_fds() {
+  close(inotify_fd);
+  inotify_fd = -1;
+
+  std::lock_guard<std::mutex> lock(roots_mtx);
+  close(wake_fd);
+  wake_fd = -1;
+  root_changes.clear();
+}
+
+void LibraryWatcher::read_events() {
+  alignas(struct inotify_event) std::array<char, event_buf_size> buf;
+
+  while (true) {
+    ssize_t len = read(inotify_fd, buf.data(), buf.size());
+    if (len <= 0) {
+      return;
+    }
+
+    const auto now = std::chrono::steady_clock::now();
+    if (pending.empty() && !overflowed) {
+      first_event = now;
+    }
+    last_event = now;
+
+    for (ssize_t off = 0; off < len;) {
+      const struct inotify_event *ev =
+          reinterpret_cast<const struct inotify_event *>(buf.data() + off);
+      off += sizeof(struct inotify_event) + ev->len;
+
+      if (ev->mask & IN_Q_OVERFLOW) {
+        overflowed = true;
+        continue;
+      }
+
+      auto watch = watches.find(ev->wd);
+      if (watch == watches.end()) {
+        continue;
+      }
+
+      if (ev->mask & IN_IGNORED) {
+        watches.erase(watch);
+        continue;
+      }
+
+      // Events about the watched directory itself are also reported to its
+      // parent, with a name.
+      if (ev->len == 0) {
+        continue;
+      }
+
+      const int dir_id = watch->second.dir_id;
+      const std::filesystem::path path = watch->second.path / ev->name;
+      PendingChanges &changes = pending[dir_id];
+
+      if (!(ev->mask & IN_ISDIR)) {
+        changes.files.insert(path);
+        continue;
+      }
+
+      if (ev->mask & (IN_CREATE | IN_MOVED_TO)) {
+        watch_tree(dir_id, path);
+      } else if (ev->mask & IN_MOVED_FROM) {
+        unwatch_tree(path);
+      }
+      changes.trees.insert(path);
+    }
+  }
+}
+
+void LibraryWatcher::flush() {
+  if (overflowed) {
+    // Events were lost, fall back to rescanning. Unchanged directories are
+    // still skipped.
+    overflowed = false;
+    pending.clear();
+
+    std::vector<Entity::Directory> directories;
+    if (db->get_directories_list(directories) !=
+        DBRetCode::GetDirRes::Success) {
+      return;
+    }
+
+    for (const Entity::Directory &dir : directories) {
+      if (lib->partial_scan(dir.id) != LibRetCode::ScanRes::Success) {
+        std::cerr << "Could not rescan " << dir.path << '\n';
+      }
+    }
+    return;
+  }
+
+  for (const auto &[dir_id, changes] : pending) {
+    if (lib->update_paths(dir_id, changes.files, changes.trees) !=
+        LibRetCode::ScanRes::Success) {
+      std::cerr << "Could not update directory " << dir_id << '\n';
+    }
+  }
+  pending.clear();
+}
+
+void LibraryWatcher::watch_loop() {
+  while (running) {
+    int timeout = -1;
+
+    if (!pending.empty() || overflowed) {
+      const auto now = std::chrono::steady_clock::now();
+      const auto due = std::min(last_event + debounce, first_event + max_delay);
+      if (due <= now) {
+        flush();
+        continue;
+      }
+
+      timeout = std::chrono::ceil<std::chrono::milliseconds>(due - now).count();
+    }
+
+    std::array<struct pollfd, 2> fds = {{{inotify_fd, POLLIN, 0},
+                                         {wake_fd, POLLIN, 0}}};
+    if (poll(fds.data(), fds.size(), timeout) < 0) {
+      if (errno == EINTR) {
+        continue;
+      }
+      std::cerr << "Library watcher stopped polling" << '\n';
+      running = false;
+      return;
+    }
+
+    // Either stop() or a root change, the loop condition tells which.
+    if (fds[1].revents & POLLIN) {
+      uint64_t count = 0;
+      if (read(wake_fd, &count, sizeof(count)) < 0 && errno != EAGAIN) {
+        std::cerr << "Could not read the library watcher wakeup" << '\n';
+      }
+      apply_root_changes();
+      continue;
+    }
+
+    if (fds[0].revents & POLLIN) {
+      read_events();
+    }
+  }
+}
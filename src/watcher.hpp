@@ -0,0 +1,91 @@
+#pragma once
+#include "library.hpp"
+#include <atomic>
+#include <chrono>
+#include <filesystem>
+#include <map>
+#include <mutex>
+#include <set>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+
+namespace WatcherRetCode {
+
+enum class StartRes { Success = 0, AlreadyRunning, CannotInit, CannotGetDirs };
+
+}; // namespace WatcherRetCode
+
+// Keeps the library in sync with the roots of the `directories` table
+// through inotify. Events are collected per root and handed to
+// Library::update_paths once the tree has been quiet for `debounce`, or
+// after `max_delay` while a long copy keeps it busy. Roots added or removed
+// while it runs are reported through add_root() and remove_root().
+class LibraryWatcher {
+public:
+  LibraryWatcher(Library *lib__, DB *db__);
+  ~LibraryWatcher();
+
+  WatcherRetCode::StartRes start();
+  void stop();
+  // False once stopped, or after the watch thread gave up on an error.
+  bool is_running();
+
+  // Call after adding or removing a row of `directories`. Ignored while
+  // stopped, start() reads the table again.
+  void add_root(int dir_id, const std::filesystem::path &path);
+  void remove_root(int dir_id);
+
+  // Only takes effect on the next start().
+  void set_debounce(std::chrono::milliseconds debounce__,
+                    std::chrono::milliseconds max_delay__);
+
+private:
+  struct WatchedDir {
+    int dir_id;
+    std::filesystem::path path;
+  };
+
+  struct RootChange {
+    int dir_id;
+    std::filesystem::path path;
+    bool added;
+  };
+
+  struct PendingChanges {
+    std::set<std::filesystem::path> files;
+    std::set<std::filesystem::path> trees;
+  };
+
+  Library *lib = nullptr;
+  DB *db = nullptr;
+
+  int inotify_fd = -1;
+  int wake_fd = -1;
+  std::thread watch_thrd;
+  std::atomic<bool> running = false;
+
+  std::chrono::milliseconds debounce = std::chrono::milliseconds(500);
+  std::chrono::milliseconds max_delay = std::chrono::milliseconds(5000);
+
+  // Handed to the watch thread, which applies them when woken. wake_fd is
+  // only opened and closed under roots_mtx.
+  std::mutex roots_mtx;
+  std::vector<RootChange> root_changes;
+
+  // Owned by the watch thread once started.
+  std::unordered_map<int, WatchedDir> watches;
+  std::map<int, PendingChanges> pending;
+  std::chrono::steady_clock::time_point first_event;
+  std::chrono::steady_clock::time_point last_event;
+  bool overflowed = false;
+
+  void watch_tree(int dir_id, const std::filesystem::path &root);
+  void unwatch_tree(const std::filesystem::path &root);
+  void apply_root_changes();
+  void wake();
+  void close_fds();
+  void read_events();
+  void flush();
+  void watch_loop();
+};
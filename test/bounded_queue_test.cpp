@@ -0,0 +1,61 @@
+#include "../src/common/bounded_queue.hpp"
+#include <atomic>
+#include <gtest/gtest.h>
+#include <thread>
+#include <vector>
+
+TEST(BoundedQueueTest, PopsInPushOrderThenDrainsAfterClose) {
+  BoundedQueue<int> queue(4);
+  for (int i = 0; i < 4; i++) {
+    ASSERT_TRUE(queue.push(i));
+  }
+  queue.close();
+  EXPECT_FALSE(queue.push(4));
+
+  int value;
+  for (int i = 0; i < 4; i++) {
+    ASSERT_TRUE(queue.pop(value));
+    EXPECT_EQ(value, i);
+  }
+  EXPECT_FALSE(queue.pop(value));
+}
+
+TEST(BoundedQueueTest, NeverHoldsMoreThanCapacity) {
+  const int total = 10000;
+  BoundedQueue<int> queue(8);
+  std::atomic<int> pushed = 0;
+
+  std::thread producer([&]() {
+    for (int i = 0; i < total; i++) {
+      queue.push(i);
+      pushed++;
+    }
+    queue.close();
+  });
+
+  int value;
+  int popped = 0;
+  while (queue.pop(value)) {
+    EXPECT_EQ(value, popped);
+    popped++;
+    // The producer is at most one item past the capacity, the one waiting.
+    EXPECT_LE(pushed - popped, 8);
+  }
+  producer.join();
+
+  EXPECT_EQ(popped, total);
+}
+
+TEST(BoundedQueueTest, CancelReleasesBlockedProducers) {
+  BoundedQueue<int> queue(1);
+  ASSERT_TRUE(queue.push(0));
+
+  bool result = true;
+  std::thread producer([&]() { result = queue.push(1); });
+  queue.cancel();
+  producer.join();
+
+  EXPECT_FALSE(result);
+  int value;
+  EXPECT_FALSE(queue.pop(value));
+}
@@ -0,0 +1,118 @@
+#include "../src/db.hpp"
+#include <atomic>
+#include <filesystem>
+#include <gtest/gtest.h>
+#include <sqlite3.h>
+#include <string>
+#include <thread>
+#include <vector>
+
+class DBConnectionsTest : public ::testing::Test {
+protected:
+  void SetUp() override { remove_files(); }
+  void TearDown() override { remove_files(); }
+
+  void remove_files() {
+    for (const char *suffix : {"", "-wal", "-shm"}) {
+      std::filesystem::remove(db_path + suffix);
+    }
+  }
+
+  static Entity::File make_file(int dir_id, int i) {
+    return Entity::File(0, dir_id, std::to_string(i) + ".mp3", "/music", 0, 0,
+                        "Title", "Album", "Artist", "", i, 1, 2000, "Rock",
+                        100, 128, 1000, Enum::FileType::MP3);
+  }
+
+  std::string db_path = "test_db_connections.db";
+};
+
+TEST_F(DBConnectionsTest, UsesWal) {
+  DB db(db_path);
+  ASSERT_TRUE(db.is_initialized());
+
+  sqlite3 *conn = nullptr;
+  ASSERT_EQ(sqlite3_open(db_path.c_str(), &conn), SQLITE_OK);
+  sqlite3_stmt *stmt = nullptr;
+  ASSERT_EQ(sqlite3_prepare_v2(conn, "PRAGMA journal_mode;", -1, &stmt,
+                               nullptr),
+            SQLITE_OK);
+  ASSERT_EQ(sqlite3_step(stmt), SQLITE_ROW);
+  EXPECT_STREQ(reinterpret_cast<const char *>(sqlite3_column_text(stmt, 0)),
+               "wal");
+  sqlite3_finalize(stmt);
+  sqlite3_close(conn);
+}
+
+TEST_F(DBConnectionsTest, QueriesSeeCommittedBatchesDuringWrites) {
+  DB db(db_path);
+  ASSERT_TRUE(db.is_initialized());
+
+  int dir_id = 0;
+  ASSERT_EQ(db.add_directory("/music", dir_id), DBRetCode::AddDirRes::Success);
+
+  const int total = 4000;
+  const int batch_size = 100;
+  std::vector<Entity::File> files;
+  for (int i = 0; i < total; i++) {
+    files.push_back(make_file(dir_id, i));
+  }
+
+  std::atomic<bool> done = false;
+  std::thread writer([&]() {
+    std::vector<int> ids;
+    EXPECT_EQ(db.upsert_files(files, batch_size, ids),
+              DBRetCode::UpsertFilesRes::Success);
+    done = true;
+  });
+
+  std::vector<std::thread> browsers;
+  for (int t = 0; t < 3; t++) {
+    browsers.emplace_back([&]() {
+      size_t last = 0;
+      while (!done) {
+        std::vector<Entity::File> seen;
+        ASSERT_EQ(db.get_dir_files_list(dir_id, seen),
+                  DBRetCode::GetFileRes::Success);
+        EXPECT_EQ(seen.size() % batch_size, 0u);
+        EXPECT_GE(seen.size(), last);
+        last = seen.size();
+      }
+    });
+  }
+
+  writer.join();
+  for (std::thread &t : browsers) {
+    t.join();
+  }
+
+  std::vector<Entity::File> result;
+  ASSERT_EQ(db.get_dir_files_list(dir_id, result),
+            DBRetCode::GetFileRes::Success);
+  EXPECT_EQ(result.size(), (size_t)total);
+}
+
+TEST_F(DBConnectionsTest, WritesFromManyThreads) {
+  DB db(db_path);
+  ASSERT_TRUE(db.is_initialized());
+
+  std::vector<std::thread> threads;
+  for (int t = 0; t < 4; t++) {
+    threads.emplace_back([&db, t]() {
+      for (int i = 0; i < 50; i++) {
+        int id = 0;
+        EXPECT_EQ(db.add_directory(
+                      "/music/" + std::to_string(t) + "/" + std::to_string(i),
+                      id),
+                  DBRetCode::AddDirRes::Success);
+      }
+    });
+  }
+  for (std::thread &t : threads) {
+    t.join();
+  }
+
+  std::vector<Entity::Directory> dirs;
+  ASSERT_EQ(db.get_directories_list(dirs), DBRetCode::GetDirRes::Success);
+  EXPECT_EQ(dirs.size(), 200u);
+}
@@ -0,0 +1,85 @@
+#include "../src/db.hpp"
+#include <filesystem>
+#include <gtest/gtest.h>
+#include <memory>
+#include <string>
+#include <vector>
+
+class DBFrameIndexTest : public ::testing::Test {
+protected:
+  void SetUp() override {
+    remove_files();
+    db = std::make_unique<DB>(db_path);
+    ASSERT_TRUE(db->is_initialized());
+
+    int dir_id = 0;
+    ASSERT_EQ(db->add_directory("/music", dir_id),
+              DBRetCode::AddDirRes::Success);
+
+    std::vector<Entity::File> files;
+    for (const char *name : {"long.mp3", "broken.mp3"}) {
+      files.emplace_back(0, dir_id, name, "/music", 10, 20, "Title", "Album",
+                         "Artist", "", 1, 1, 2000, "Rock", 3600, 128, 1000,
+                         Enum::FileType::MP3);
+    }
+    ASSERT_EQ(db->upsert_files(files, 0, ids),
+              DBRetCode::UpsertFilesRes::Success);
+  }
+  void TearDown() override {
+    db.reset();
+    remove_files();
+  }
+
+  void remove_files() {
+    for (const char *suffix : {"", "-wal", "-shm"}) {
+      std::filesystem::remove(db_path + suffix);
+    }
+  }
+
+  std::vector<int> unindexed() {
+    std::vector<Entity::FileMainProps> files;
+    EXPECT_EQ(db->get_unindexed_files(Enum::FileType::MP3, 60, files),
+              DBRetCode::GetFileRes::Success);
+
+    std::vector<int> result;
+    for (const Entity::FileMainProps &f : files) {
+      result.push_back(f.id);
+    }
+    return result;
+  }
+
+  std::string db_path = "test_db_frame_index.db";
+  std::unique_ptr<DB> db;
+  std::vector<int> ids;
+};
+
+TEST_F(DBFrameIndexTest, FailureMarkerIsNotRetriedUntilTheFileChanges) {
+  ASSERT_EQ(unindexed().size(), 2u);
+
+  ASSERT_EQ(db->set_frame_index(
+                Entity::FrameIndex(ids[0], 20, 1000, 4096, {0, 417, 834})),
+            DBRetCode::SetFrameIndexRes::Success);
+  ASSERT_EQ(db->set_frame_index(Entity::FrameIndex(ids[1], 20, 1000, 0, {})),
+            DBRetCode::SetFrameIndexRes::Success);
+  EXPECT_TRUE(unindexed().empty());
+
+  Entity::FrameIndex index;
+  ASSERT_EQ(db->get_frame_index(ids[0], 20, 1000, index),
+            DBRetCode::GetFrameIndexRes::Success);
+  EXPECT_EQ(index.offsets, (std::vector<std::int64_t>{0, 417, 834}));
+
+  ASSERT_EQ(db->get_frame_index(ids[1], 20, 1000, index),
+            DBRetCode::GetFrameIndexRes::Success);
+  EXPECT_TRUE(index.offsets.empty());
+
+  // A rewritten file gets another attempt.
+  EXPECT_EQ(db->get_frame_index(ids[1], 21, 1000, index),
+            DBRetCode::GetFrameIndexRes::NotFound);
+  std::vector<Entity::File> changed(1);
+  ASSERT_EQ(db->get_file(ids[1], changed[0]), DBRetCode::GetFileRes::Success);
+  changed[0].modified_time = 21;
+  std::vector<int> changed_ids;
+  ASSERT_EQ(db->upsert_files(changed, 0, changed_ids),
+            DBRetCode::UpsertFilesRes::Success);
+  EXPECT_EQ(unindexed(), std::vector<int>{ids[1]});
+}
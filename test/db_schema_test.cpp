@@ -0,0 +1,110 @@
+#include "../src/db.hpp"
+#include <filesystem>
+#include <gtest/gtest.h>
+#include <sqlite3.h>
+#include <string>
+
+class DBSchemaTest : public ::testing::Test {
+protected:
+  void SetUp() override { std::filesystem::remove(db_path); }
+  void TearDown() override { std::filesystem::remove(db_path); }
+
+  // Runs sql on its own connection, returning the last column of each row,
+  // one per line.
+  std::string query(const std::string &sql) {
+    sqlite3 *conn = nullptr;
+    EXPECT_EQ(sqlite3_open(db_path.c_str(), &conn), SQLITE_OK);
+
+    std::string result;
+    sqlite3_stmt *stmt = nullptr;
+    const char *tail = sql.c_str();
+    while (*tail) {
+      EXPECT_EQ(sqlite3_prepare_v2(conn, tail, -1, &stmt, &tail), SQLITE_OK)
+          << sqlite3_errmsg(conn);
+      if (!stmt) {
+        break;
+      }
+      while (sqlite3_step(stmt) == SQLITE_ROW) {
+        const unsigned char *txt =
+            sqlite3_column_text(stmt, sqlite3_column_count(stmt) - 1);
+        if (!result.empty()) {
+          result += '\n';
+        }
+        result += txt ? reinterpret_cast<const char *>(txt) : "";
+      }
+      sqlite3_finalize(stmt);
+    }
+
+    sqlite3_close(conn);
+    return result;
+  }
+
+  std::string db_path = "test_db_schema.db";
+};
+
+TEST_F(DBSchemaTest, NewDatabaseGetsLatestSchema) {
+  {
+    DB db(db_path);
+    ASSERT_TRUE(db.is_initialized());
+  }
+
+  EXPECT_EQ(query("SELECT version FROM schema_version;"), "2");
+  EXPECT_EQ(query("SELECT COUNT(*) FROM sqlite_master WHERE type = 'index' "
+                  "AND name IN ('files_path_idx', 'files_fingerprint_idx', "
+                  "'files_dir_idx', 'files_artist_idx', "
+                  "'files_albumartist_idx');"),
+            "5");
+
+  // Reopening applies nothing twice.
+  DB db(db_path);
+  ASSERT_TRUE(db.is_initialized());
+  EXPECT_EQ(query("SELECT COUNT(*) FROM schema_version;"), "1");
+}
+
+TEST_F(DBSchemaTest, MigratesUnversionedDatabase) {
+  const std::string row =
+      "(1, 'a.mp3', '/m', 0, 0, 't', 'al', 'ar', '', 1, 1, 2000, 'g', 1, 1, "
+      "1, 1)";
+  query("CREATE TABLE files (id INTEGER PRIMARY KEY AUTOINCREMENT,"
+        "dir_id INTEGER NOT NULL, filename TEXT NOT NULL,"
+        "fulldir_path TEXT NOT NULL, created_time INTEGER NOT NULL,"
+        "modified_time INTEGER NOT NULL, title TEXT NOT NULL,"
+        "album TEXT NOT NULL, artist TEXT NOT NULL,"
+        "albumartist TEXT NOT NULL, track_number INTEGER NOT NULL,"
+        "disc_number INTEGER NOT NULL, year INTEGER NOT NULL,"
+        "genre TEXT NOT NULL, length INTEGER NOT NULL,"
+        "bitrate INTEGER NOT NULL, filesize INTEGER NOT NULL,"
+        "filetype INTEGER NOT NULL);"
+        "INSERT INTO files (dir_id, filename, fulldir_path, created_time,"
+        "modified_time, title, album, artist, albumartist, track_number,"
+        "disc_number, year, genre, length, bitrate, filesize, filetype) "
+        "VALUES " +
+        row + ", " + row + ";");
+
+  DB db(db_path);
+  ASSERT_TRUE(db.is_initialized());
+
+  EXPECT_EQ(query("SELECT version FROM schema_version;"), "2");
+  EXPECT_EQ(query("SELECT COUNT(*) FROM files;"), "1");
+  EXPECT_EQ(query("SELECT fingerprint FROM files;"), "0");
+}
+
+TEST_F(DBSchemaTest, RefusesNewerSchema) {
+  query("CREATE TABLE schema_version (version INTEGER NOT NULL);"
+        "INSERT INTO schema_version VALUES (1000);");
+
+  DB db(db_path);
+  EXPECT_FALSE(db.is_initialized());
+}
+
+TEST_F(DBSchemaTest, AlbumTracksUseArtistIndex) {
+  {
+    DB db(db_path);
+    ASSERT_TRUE(db.is_initialized());
+  }
+
+  const std::string plan =
+      query("EXPLAIN QUERY PLAN SELECT id FROM files WHERE artist = 'a' AND "
+            "album = 'b' ORDER BY disc_number, track_number;");
+  EXPECT_NE(plan.find("files_artist_idx"), std::string::npos) << plan;
+}
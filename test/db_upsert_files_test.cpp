@@ -0,0 +1,134 @@
+#include "../src/db.hpp"
+#include <filesystem>
+#include <gtest/gtest.h>
+#include <memory>
+#include <sqlite3.h>
+#include <string>
+#include <vector>
+
+class DBUpsertFilesTest : public ::testing::Test {
+protected:
+  void SetUp() override {
+    remove_files();
+    db = std::make_unique<DB>(db_path);
+    ASSERT_TRUE(db->is_initialized());
+    ASSERT_EQ(db->add_directory("/music", dir_id),
+              DBRetCode::AddDirRes::Success);
+  }
+  void TearDown() override {
+    db.reset();
+    remove_files();
+  }
+
+  void remove_files() {
+    for (const char *suffix : {"", "-wal", "-shm"}) {
+      std::filesystem::remove(db_path + suffix);
+    }
+  }
+
+  Entity::File make_file(const std::string &name,
+                         const std::string &title = "Title") {
+    return Entity::File(0, dir_id, name, "/music/album", 10, 20, title,
+                        "Album", "Artist", "", 1, 1, 2000, "Rock", 100, 128,
+                        1000, Enum::FileType::MP3);
+  }
+
+  size_t row_count() {
+    std::vector<Entity::File> files;
+    EXPECT_EQ(db->get_dir_files_list(dir_id, files),
+              DBRetCode::GetFileRes::Success);
+    return files.size();
+  }
+
+  std::string db_path = "test_db_upsert_files.db";
+  std::unique_ptr<DB> db;
+  int dir_id = 0;
+};
+
+TEST_F(DBUpsertFilesTest, ReturnsIdsInInputOrder) {
+  std::vector<Entity::File> files;
+  for (const char *name : {"c.mp3", "a.mp3", "e.mp3", "b.mp3", "d.mp3"}) {
+    files.push_back(make_file(name));
+  }
+
+  std::vector<int> ids;
+  ASSERT_EQ(db->upsert_files(files, 2, ids),
+            DBRetCode::UpsertFilesRes::Success);
+  ASSERT_EQ(ids.size(), files.size());
+
+  for (size_t i = 0; i < files.size(); i++) {
+    Entity::File stored;
+    ASSERT_EQ(db->get_file_by_path(files[i].fulldir_path, files[i].filename,
+                                   stored),
+              DBRetCode::GetFileRes::Success);
+    EXPECT_EQ(stored.id, ids[i]) << files[i].filename;
+  }
+}
+
+TEST_F(DBUpsertFilesTest, UpdatesExistingRowsInPlace) {
+  std::vector<int> first_ids;
+  ASSERT_EQ(db->upsert_files({make_file("a.mp3"), make_file("b.mp3")}, 0,
+                             first_ids),
+            DBRetCode::UpsertFilesRes::Success);
+
+  Entity::File changed = make_file("b.mp3", "New title");
+  changed.modified_time = 30;
+  changed.filesize = 2000;
+
+  std::vector<int> ids;
+  ASSERT_EQ(db->upsert_files({make_file("c.mp3"), changed}, 0, ids),
+            DBRetCode::UpsertFilesRes::Success);
+  ASSERT_EQ(ids.size(), 2u);
+  EXPECT_EQ(ids[1], first_ids[1]);
+  EXPECT_NE(ids[0], first_ids[0]);
+  EXPECT_NE(ids[0], first_ids[1]);
+
+  Entity::File stored;
+  ASSERT_EQ(db->get_file(first_ids[1], stored),
+            DBRetCode::GetFileRes::Success);
+  EXPECT_EQ(stored.title, "New title");
+  EXPECT_EQ(stored.modified_time, 30);
+  EXPECT_EQ(stored.filesize, 2000u);
+
+  EXPECT_EQ(row_count(), 3u);
+}
+
+TEST_F(DBUpsertFilesTest, RollsBackTheFailingBatchOnly) {
+  // Another connection makes one row fail mid-batch.
+  sqlite3 *conn = nullptr;
+  ASSERT_EQ(sqlite3_open(db_path.c_str(), &conn), SQLITE_OK);
+  ASSERT_EQ(sqlite3_exec(conn,
+                         "CREATE TRIGGER reject_bad BEFORE INSERT ON files "
+                         "WHEN NEW.filename = 'bad.mp3' "
+                         "BEGIN SELECT RAISE(ABORT, 'rejected'); END;",
+                         nullptr, nullptr, nullptr),
+            SQLITE_OK);
+  sqlite3_close(conn);
+
+  std::vector<Entity::File> files;
+  for (const char *name : {"a.mp3", "b.mp3", "c.mp3", "bad.mp3", "e.mp3"}) {
+    files.push_back(make_file(name));
+  }
+
+  std::vector<int> ids;
+  EXPECT_EQ(db->upsert_files(files, 2, ids),
+            DBRetCode::UpsertFilesRes::SqlError);
+
+  Entity::File stored;
+  for (const char *name : {"a.mp3", "b.mp3"}) {
+    EXPECT_EQ(db->get_file_by_path("/music/album", name, stored),
+              DBRetCode::GetFileRes::Success)
+        << name;
+  }
+  for (const char *name : {"c.mp3", "bad.mp3", "e.mp3"}) {
+    EXPECT_EQ(db->get_file_by_path("/music/album", name, stored),
+              DBRetCode::GetFileRes::NotFound)
+        << name;
+  }
+  EXPECT_EQ(row_count(), 2u);
+
+  // The writer is usable again once the batch has been rolled back.
+  ASSERT_EQ(db->upsert_files({make_file("c.mp3")}, 0, ids),
+            DBRetCode::UpsertFilesRes::Success);
+  EXPECT_EQ(row_count(), 3u);
+}
@@ -0,0 +1,127 @@
+#include "../src/common/dir_walker.hpp"
+#include <filesystem>
+#include <fstream>
+#include <gtest/gtest.h>
+#include <set>
+#include <string>
+
+class DirWalkerTest : public ::testing::Test {
+protected:
+  void SetUp() override {
+    std::filesystem::remove_all(root);
+    std::filesystem::create_directories(root / "a" / "b");
+  }
+  void TearDown() override { std::filesystem::remove_all(root); }
+
+  void touch(const std::filesystem::path &path, const std::string &data) {
+    std::ofstream(path, std::ios::binary) << data;
+  }
+
+  std::set<std::string> walk() {
+    std::set<std::string> names;
+    EXPECT_EQ(walk_audio_files(root,
+                               [&](const WalkEntry &e) {
+                                 names.insert(e.filename.string());
+                               }),
+              WalkRetCode::WalkRes::Success);
+    return names;
+  }
+
+  std::filesystem::path root = "test_walker_root";
+};
+
+TEST_F(DirWalkerTest, ListsAudioFilesRecursively) {
+  touch(root / "a" / "1.mp3", "x");
+  touch(root / "a" / "b" / "2.FLAC", "yy");
+  touch(root / "a" / "b" / "3.txt", "z");
+
+  EXPECT_EQ(walk(), (std::set<std::string>{"1.mp3", "2.FLAC"}));
+}
+
+TEST_F(DirWalkerTest, ReportsSizeAndType) {
+  touch(root / "a" / "1.ogg", "12345");
+
+  WalkEntry found = {};
+  walk_audio_files(root, [&](const WalkEntry &e) { found = e; });
+
+  EXPECT_EQ(found.filename, "1.ogg");
+  EXPECT_EQ(found.fulldir_path, root / "a");
+  EXPECT_EQ(found.size, 5);
+  EXPECT_EQ(found.filetype, Enum::FileType::OGG);
+  EXPECT_GT(found.modified_time, 0);
+}
+
+TEST_F(DirWalkerTest, VisitsHardlinksOnce) {
+  touch(root / "a" / "1.mp3", "x");
+  std::filesystem::create_hard_link(root / "a" / "1.mp3", root / "2.mp3");
+
+  EXPECT_EQ(walk().size(), 1);
+}
+
+TEST_F(DirWalkerTest, SurvivesSymlinkLoops) {
+  touch(root / "a" / "b" / "1.mp3", "x");
+  std::filesystem::create_directory_symlink("../..", root / "a" / "b" / "up");
+
+  EXPECT_EQ(walk(), (std::set<std::string>{"1.mp3"}));
+}
+
+TEST_F(DirWalkerTest, SkipsDirectoriesRejectedByHooks) {
+  touch(root / "a" / "1.mp3", "x");
+  touch(root / "a" / "b" / "2.mp3", "x");
+
+  std::set<std::string> listed;
+  WalkDirHooks hooks;
+  hooks.should_list = [&](const std::filesystem::path &dir, std::int64_t,
+                          std::vector<std::filesystem::path> &subdirs) {
+    if (dir == root / "a") {
+      subdirs.push_back(root / "a" / "b");
+      return false;
+    }
+    return true;
+  };
+  hooks.on_dir = [&](const WalkDirInfo &info) {
+    if (info.listed) {
+      listed.insert(info.path.filename().string());
+    }
+  };
+
+  std::set<std::string> names;
+  walk_audio_files(
+      root, [&](const WalkEntry &e) { names.insert(e.filename.string()); },
+      &hooks);
+
+  EXPECT_EQ(names, (std::set<std::string>{"2.mp3"}));
+  EXPECT_EQ(listed, (std::set<std::string>{root.filename().string(), "b"}));
+}
+
+TEST(DirWalkerMissingRoot, ReportsError) {
+  EXPECT_EQ(walk_audio_files("does_not_exist", [](const WalkEntry &) {}),
+            WalkRetCode::WalkRes::CannotOpenDir);
+}
+
+TEST_F(DirWalkerTest, ReportsDirectoriesThatCannotBeOpened) {
+  touch(root / "a" / "1.mp3", "x");
+
+  std::vector<WalkDirInfo> unreadable;
+  WalkDirHooks hooks;
+  hooks.should_list = [&](const std::filesystem::path &dir, std::int64_t,
+                          std::vector<std::filesystem::path> &subdirs) {
+    if (dir == root / "a") {
+      subdirs.push_back(root / "a" / "gone");
+    }
+    return dir != root / "a";
+  };
+  hooks.on_dir = [&](const WalkDirInfo &info) {
+    if (info.unreadable) {
+      unreadable.push_back(info);
+    }
+  };
+
+  EXPECT_EQ(walk_audio_files(root, [](const WalkEntry &) {}, &hooks),
+            WalkRetCode::WalkRes::Success);
+
+  ASSERT_EQ(unreadable.size(), 1);
+  EXPECT_EQ(unreadable[0].path, root / "a" / "gone");
+  EXPECT_FALSE(unreadable[0].listed);
+  EXPECT_EQ(unreadable[0].modified_time_ns, -1);
+}
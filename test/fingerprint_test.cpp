@@ -0,0 +1,56 @@
+#include "../src/common/fingerprint.hpp"
+#include <filesystem>
+#include <fstream>
+#include <gtest/gtest.h>
+#include <string>
+
+class FingerprintTest : public ::testing::Test {
+protected:
+  void SetUp() override {
+    std::filesystem::remove_all(root);
+    std::filesystem::create_directories(root);
+  }
+  void TearDown() override { std::filesystem::remove_all(root); }
+
+  std::uint64_t fingerprint(const std::string &name, const std::string &data) {
+    std::filesystem::path path = root / name;
+    std::ofstream(path, std::ios::binary) << data;
+
+    std::uint64_t result = 0;
+    EXPECT_TRUE(file_fingerprint(path, data.size(), result));
+    return result;
+  }
+
+  std::filesystem::path root = "test_fingerprint_root";
+};
+
+TEST_F(FingerprintTest, SameContentMatchesWhateverTheName) {
+  const std::string data(100000, 'a');
+  EXPECT_EQ(fingerprint("1.mp3", data), fingerprint("2.mp3", data));
+}
+
+TEST_F(FingerprintTest, SampledBlocksAndSizeChangeIt) {
+  std::string data(100000, 'a');
+  const std::uint64_t base = fingerprint("1.mp3", data);
+
+  for (size_t pos : {size_t(0), data.size() / 2, data.size() - 1}) {
+    std::string changed = data;
+    changed[pos] = 'b';
+    EXPECT_NE(fingerprint("2.mp3", changed), base) << pos;
+  }
+
+  EXPECT_NE(fingerprint("3.mp3", data + "a"), base);
+}
+
+TEST_F(FingerprintTest, HashesSmallFilesWhole) {
+  std::string data(5000, 'a');
+  const std::uint64_t base = fingerprint("1.mp3", data);
+  data[4500] = 'b';
+  EXPECT_NE(fingerprint("2.mp3", data), base);
+  EXPECT_NE(fingerprint("3.mp3", ""), 0);
+}
+
+TEST_F(FingerprintTest, FailsOnMissingFile) {
+  std::uint64_t result = 0;
+  EXPECT_FALSE(file_fingerprint(root / "none.mp3", 10, result));
+}
@@ -0,0 +1,150 @@
+#include "../src/common/mpeg_tags.hpp"
+#include <cstdint>
+#include <filesystem>
+#include <fstream>
+#include <gtest/gtest.h>
+#include <string>
+
+// MPEG 1 layer III, 128 kbps, 44100 Hz, stereo: 417 byte frames.
+static const std::string frame_header("\xFF\xFB\x90\x00", 4);
+static constexpr size_t frame_length = 417;
+
+class MpegTagsTest : public ::testing::Test {
+protected:
+  void SetUp() override {
+    std::filesystem::remove_all(root);
+    std::filesystem::create_directories(root);
+  }
+  void TearDown() override { std::filesystem::remove_all(root); }
+
+  static std::string be32(std::uint32_t v, bool syncsafe) {
+    std::string out(4, '\0');
+    for (int i = 3; i >= 0; i--) {
+      out[i] = (char)(syncsafe ? v & 0x7F : v & 0xFF);
+      v >>= syncsafe ? 7 : 8;
+    }
+    return out;
+  }
+
+  static std::string frame(int version, const std::string &id,
+                           const std::string &body, char format_flags = 0) {
+    return id + be32(body.size(), version == 4) + '\0' + format_flags + body;
+  }
+
+  static std::string id3v2(int version, const std::string &frames,
+                           char flags = 0) {
+    return std::string("ID3") + (char)version + '\0' + flags +
+           be32(frames.size() + 64, true) + frames + std::string(64, '\0');
+  }
+
+  static std::string audio(size_t frames) {
+    std::string out;
+    for (size_t i = 0; i < frames; i++) {
+      out += frame_header + std::string(frame_length - 4, '\x55');
+    }
+    return out;
+  }
+
+  MpegTagsRetCode::ReadRes read(const std::string &data, Entity::File &f) {
+    std::filesystem::path path = root / "1.mp3";
+    std::ofstream(path, std::ios::binary) << data;
+    return read_mpeg_tags(path, f);
+  }
+
+  std::filesystem::path root = "test_mpeg_tags_root";
+};
+
+TEST_F(MpegTagsTest, ReadsId3v23FramesAndCbrLength) {
+  const std::string frames =
+      frame(3, "TIT2", std::string("\0Caf\xE9", 5)) +
+      frame(3, "TPE1", std::string("\1\xFF\xFEO\0k\0", 7)) +
+      frame(3, "TALB", std::string("\3Album", 6)) +
+      frame(3, "TPE2", std::string("\0Various", 8)) +
+      frame(3, "TRCK", std::string("\0003/12", 5)) +
+      frame(3, "TPOS", std::string("\0002/2", 4)) +
+      frame(3, "TYER", std::string("\0" "1999", 5)) +
+      frame(3, "TCON", std::string("\0(17)Rock", 9)) +
+      frame(3, "APIC", std::string(5000, '\0'));
+
+  Entity::File f;
+  ASSERT_EQ(read(id3v2(3, frames) + audio(1000), f),
+            MpegTagsRetCode::ReadRes::Success);
+
+  EXPECT_EQ(f.title, "Caf\xC3\xA9");
+  EXPECT_EQ(f.artist, "Ok");
+  EXPECT_EQ(f.album, "Album");
+  EXPECT_EQ(f.albumartist, "Various");
+  EXPECT_EQ(f.track_number, 3);
+  EXPECT_EQ(f.disc_number, 2);
+  EXPECT_EQ(f.year, 1999);
+  EXPECT_EQ(f.genre, "Rock");
+  EXPECT_EQ(f.bitrate, 128);
+  // 1000 * 417 bytes at 128 kbps.
+  EXPECT_EQ(f.length, 26);
+}
+
+TEST_F(MpegTagsTest, ReadsId3v24WithUnsyncAndMultipleValues) {
+  const std::string frames =
+      frame(4, "TIT2", std::string("\3A\xFF\0B", 5), 0x02) +
+      frame(4, "TPE1", std::string("\3One\0Two", 8)) +
+      frame(4, "TDRC", std::string("\3" "2004-05-06", 11)) +
+      frame(4, "TCON", std::string("\3" "17\0Jazz", 8));
+
+  Entity::File f;
+  ASSERT_EQ(read(id3v2(4, frames) + audio(10), f),
+            MpegTagsRetCode::ReadRes::Success);
+
+  EXPECT_EQ(f.title, "A\xFF" "B");
+  EXPECT_EQ(f.artist, "One Two");
+  EXPECT_EQ(f.year, 2004);
+  EXPECT_EQ(f.genre, "Rock Jazz");
+}
+
+TEST_F(MpegTagsTest, TakesLengthFromXingHeader) {
+  std::string first = audio(1);
+  // Side info of a stereo MPEG 1 frame is 32 bytes.
+  first.replace(36, 16,
+                std::string("Xing") + be32(3, false) + be32(2000, false) +
+                    be32(2000 * 300, false));
+
+  Entity::File f;
+  ASSERT_EQ(read(first + audio(20), f), MpegTagsRetCode::ReadRes::Success);
+
+  // 2000 frames of 1152 samples at 44100 Hz.
+  EXPECT_EQ(f.length, 52);
+  EXPECT_EQ(f.bitrate, 92);
+}
+
+TEST_F(MpegTagsTest, PrefersApeOverId3v1) {
+  const std::string item = std::string("\5\0\0\0\0\0\0\0Title\0Later", 19);
+  const std::string ape = item + "APETAGEX" + std::string("\xD0\7\0\0", 4) +
+                          std::string("\x33\0\0\0\1\0\0\0\0\0\0\0", 12) +
+                          std::string(8, '\0');
+
+  std::string v1 = "TAG" + std::string("First") + std::string(25, ' ') +
+                   std::string("Artist") + std::string(24, '\0') +
+                   std::string(30, '\0') + "2001" + std::string(28, '\0') +
+                   '\0' + '\7' + '\x11';
+
+  Entity::File f;
+  ASSERT_EQ(read(audio(100) + ape + v1, f), MpegTagsRetCode::ReadRes::Success);
+
+  EXPECT_EQ(f.title, "Later");
+  EXPECT_EQ(f.artist, "Artist");
+  EXPECT_EQ(f.year, 2001);
+  EXPECT_EQ(f.track_number, 7);
+  EXPECT_EQ(f.genre, "Rock");
+  // Neither tag counts as audio.
+  EXPECT_EQ(f.length, 2);
+}
+
+TEST_F(MpegTagsTest, LeavesUnusualFilesToTagLib) {
+  Entity::File f;
+  EXPECT_EQ(read(id3v2(3, frame(3, "TIT2", "\0x"), '\x80') + audio(10), f),
+            MpegTagsRetCode::ReadRes::Unsupported);
+  EXPECT_EQ(read(id3v2(3, frame(3, "TIT2", "\0x")) + std::string(1000, 'a'),
+                 f),
+            MpegTagsRetCode::ReadRes::Unsupported);
+  EXPECT_EQ(read_mpeg_tags(root / "none.mp3", f),
+            MpegTagsRetCode::ReadRes::CannotOpen);
+}
@@ -0,0 +1,59 @@
+#include "../src/common/mpsc_queue.hpp"
+#include <gtest/gtest.h>
+#include <thread>
+#include <vector>
+
+TEST(MPSCQueueTest, PopsInPushOrder) {
+  MPSCQueue<int> queue;
+  EXPECT_TRUE(queue.empty());
+
+  for (int i = 0; i < 10; i++) {
+    queue.push(i);
+  }
+  EXPECT_FALSE(queue.empty());
+
+  int value;
+  for (int i = 0; i < 10; i++) {
+    ASSERT_TRUE(queue.pop(value));
+    EXPECT_EQ(value, i);
+  }
+  EXPECT_FALSE(queue.pop(value));
+  EXPECT_TRUE(queue.empty());
+}
+
+TEST(MPSCQueueTest, ConcurrentProducers) {
+  const int producers = 4;
+  const int per_producer = 10000;
+  MPSCQueue<int> queue;
+
+  std::vector<std::thread> threads;
+  for (int p = 0; p < producers; p++) {
+    threads.emplace_back([&queue, p]() {
+      for (int i = 0; i < per_producer; i++) {
+        queue.push(p * per_producer + i);
+      }
+    });
+  }
+
+  // Each producer's values must come out in the order it pushed them.
+  std::vector<int> last(producers, -1);
+  int received = 0;
+  int value;
+
+  while (received < producers * per_producer) {
+    if (!queue.pop(value)) {
+      std::this_thread::yield();
+      continue;
+    }
+
+    const int p = value / per_producer;
+    EXPECT_GT(value, last[p]);
+    last[p] = value;
+    received++;
+  }
+
+  for (std::thread &t : threads) {
+    t.join();
+  }
+  EXPECT_TRUE(queue.empty());
+}
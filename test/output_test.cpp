@@ -0,0 +1,137 @@
+#include "../src/output.hpp"
+#include <filesystem>
+#include <fstream>
+#include <gtest/gtest.h>
+#include <iterator>
+#include <vector>
+
+static Audio::FormatInfo stereo_s16() {
+  Audio::FormatInfo afi = {};
+  afi.frame_size = 4;
+  afi.rate = 44100;
+  afi.channels = 2;
+  afi.bits = 16;
+  afi.is_signed = 1;
+  return afi;
+}
+
+TEST(NullOutputTest, CountsBytesAndFrames) {
+  NullOutput out;
+  ASSERT_EQ(out.init(nullptr), OutputRetCode::InitRes::Success);
+  ASSERT_EQ(out.open(stereo_s16()), OutputRetCode::OpenRes::Success);
+
+  std::vector<char> buf(4096);
+  EXPECT_EQ(out.write(buf.data(), buf.size()),
+            OutputRetCode::WriteRes::Success);
+  EXPECT_EQ(out.write(buf.data(), 400), OutputRetCode::WriteRes::Success);
+
+  EXPECT_EQ(out.get_bytes_written(), 4496);
+  EXPECT_EQ(out.get_frames_written(), 1124);
+
+  int64_t delay = -1;
+  EXPECT_EQ(out.get_delay(delay), OutputRetCode::DelayRes::Success);
+  EXPECT_EQ(delay, 0);
+}
+
+class FileOutputTest : public ::testing::Test {
+protected:
+  void TearDown() override { std::filesystem::remove(path); }
+
+  std::vector<unsigned char> read_all() {
+    std::ifstream in(path, std::ios::binary);
+    return std::vector<unsigned char>(std::istreambuf_iterator<char>(in),
+                                      std::istreambuf_iterator<char>());
+  }
+
+  static uint32_t le32(const std::vector<unsigned char> &d, size_t off) {
+    return d[off] | d[off + 1] << 8 | d[off + 2] << 16 |
+           (uint32_t)d[off + 3] << 24;
+  }
+
+  std::string path = "test_output.pcm";
+};
+
+TEST_F(FileOutputTest, WavHeaderIsPatchedOnClose) {
+  FileOutput out(Enum::OutputType::WAV_FILE);
+  ASSERT_EQ(out.init(path.c_str()), OutputRetCode::InitRes::Success);
+  ASSERT_EQ(out.open(stereo_s16()), OutputRetCode::OpenRes::Success);
+
+  std::vector<char> buf(1000, 1);
+  ASSERT_EQ(out.write(buf.data(), buf.size()),
+            OutputRetCode::WriteRes::Success);
+  ASSERT_EQ(out.close(), OutputRetCode::CloseRes::Success);
+
+  std::vector<unsigned char> data = read_all();
+  ASSERT_EQ(data.size(), 44 + buf.size());
+  EXPECT_EQ(std::string(data.begin(), data.begin() + 4), "RIFF");
+  EXPECT_EQ(std::string(data.begin() + 8, data.begin() + 12), "WAVE");
+  EXPECT_EQ(le32(data, 4), 36 + buf.size());
+  EXPECT_EQ(le32(data, 24), 44100);
+  EXPECT_EQ(le32(data, 28), 44100 * 4);
+  EXPECT_EQ(le32(data, 40), buf.size());
+}
+
+TEST_F(FileOutputTest, RawWritesSamplesOnly) {
+  FileOutput out(Enum::OutputType::RAW_FILE);
+  ASSERT_EQ(out.init(path.c_str()), OutputRetCode::InitRes::Success);
+  ASSERT_EQ(out.open(stereo_s16()), OutputRetCode::OpenRes::Success);
+
+  std::vector<char> buf(64, 7);
+  ASSERT_EQ(out.write(buf.data(), buf.size()),
+            OutputRetCode::WriteRes::Success);
+  ASSERT_EQ(out.close(), OutputRetCode::CloseRes::Success);
+
+  std::vector<unsigned char> data = read_all();
+  ASSERT_EQ(data.size(), buf.size());
+  EXPECT_EQ(data[0], 7);
+}
+
+TEST_F(FileOutputTest, FormatChangeStartsNextFile) {
+  const std::string next = "test_output.1.pcm";
+  FileOutput out(Enum::OutputType::WAV_FILE);
+  ASSERT_EQ(out.init(path.c_str()), OutputRetCode::InitRes::Success);
+  ASSERT_EQ(out.open(stereo_s16()), OutputRetCode::OpenRes::Success);
+
+  std::vector<char> first(400, 1);
+  ASSERT_EQ(out.write(first.data(), first.size()),
+            OutputRetCode::WriteRes::Success);
+
+  Audio::FormatInfo afi = stereo_s16();
+  afi.rate = 48000;
+  ASSERT_EQ(out.open(afi), OutputRetCode::OpenRes::Success);
+
+  std::vector<char> second(200, 2);
+  ASSERT_EQ(out.write(second.data(), second.size()),
+            OutputRetCode::WriteRes::Success);
+  ASSERT_EQ(out.close(), OutputRetCode::CloseRes::Success);
+
+  // The first track is still whole, with its own header.
+  std::vector<unsigned char> data = read_all();
+  ASSERT_EQ(data.size(), 44 + first.size());
+  EXPECT_EQ(le32(data, 24), 44100);
+  EXPECT_EQ(le32(data, 40), first.size());
+  EXPECT_EQ(data[44], 1);
+  EXPECT_EQ(data.back(), 1);
+
+  std::ifstream in(next, std::ios::binary);
+  std::vector<unsigned char> rest((std::istreambuf_iterator<char>(in)),
+                                  std::istreambuf_iterator<char>());
+  std::filesystem::remove(next);
+  ASSERT_EQ(rest.size(), 44 + second.size());
+  EXPECT_EQ(le32(rest, 24), 48000);
+  EXPECT_EQ(rest[44], 2);
+}
+
+TEST_F(FileOutputTest, StdoutRefusesFormatChange) {
+  FileOutput out(Enum::OutputType::RAW_FILE);
+  ASSERT_EQ(out.init("-"), OutputRetCode::InitRes::Success);
+  ASSERT_EQ(out.open(stereo_s16()), OutputRetCode::OpenRes::Success);
+
+  Audio::FormatInfo afi = stereo_s16();
+  afi.rate = 48000;
+  EXPECT_EQ(out.open(afi), OutputRetCode::OpenRes::SetParamsError);
+
+  Audio::BufferInfo info;
+  ASSERT_EQ(out.get_buffer_info(info), OutputRetCode::BufferInfoRes::Success);
+  EXPECT_EQ(info.rate, 44100u);
+}
@@ -0,0 +1,104 @@
+#include "../src/common/ring_buffer.hpp"
+#include <gtest/gtest.h>
+#include <numeric>
+#include <thread>
+#include <vector>
+
+class RingBufferTest : public ::testing::Test {
+protected:
+  void SetUp() override { ring.reset(capacity); }
+  const size_t capacity = 64;
+  PCMRingBuffer ring;
+};
+
+TEST_F(RingBufferTest, StartsEmpty) {
+  EXPECT_EQ(ring.readable(), 0);
+  EXPECT_EQ(ring.writable(), capacity);
+}
+
+TEST_F(RingBufferTest, WriteIsBoundedByCapacity) {
+  std::vector<char> in(capacity * 2, 'x');
+  EXPECT_EQ(ring.write(in.data(), in.size()), capacity);
+  EXPECT_EQ(ring.writable(), 0);
+  EXPECT_EQ(ring.write(in.data(), 1), 0);
+}
+
+TEST_F(RingBufferTest, ReadWrapsAround) {
+  std::vector<char> in(48);
+  std::iota(in.begin(), in.end(), 0);
+  std::vector<char> out(48);
+
+  ASSERT_EQ(ring.write(in.data(), 40), 40);
+  ASSERT_EQ(ring.read(out.data(), 40), 40);
+
+  ASSERT_EQ(ring.write(in.data(), 48), 48);
+  ASSERT_EQ(ring.read(out.data(), 48), 48);
+  EXPECT_EQ(in, out);
+}
+
+TEST_F(RingBufferTest, DiscardDropsReadable) {
+  std::vector<char> in(16, 'x');
+  ring.write(in.data(), in.size());
+  ring.discard();
+  EXPECT_EQ(ring.readable(), 0);
+  EXPECT_EQ(ring.writable(), capacity);
+}
+
+TEST_F(RingBufferTest, GrowKeepsContentAndPositions) {
+  std::vector<char> in(48);
+  std::iota(in.begin(), in.end(), 0);
+  std::vector<char> out(48);
+
+  // Leave 40 bytes wrapped around the end of the ring.
+  ASSERT_EQ(ring.write(in.data(), 40), 40);
+  ASSERT_EQ(ring.read(out.data(), 40), 40);
+  ASSERT_EQ(ring.write(in.data(), 40), 40);
+  const size_t read_pos = ring.read_position();
+  const size_t write_pos = ring.write_position();
+
+  ring.grow(capacity * 3);
+  EXPECT_EQ(ring.capacity(), capacity * 3);
+  EXPECT_EQ(ring.read_position(), read_pos);
+  EXPECT_EQ(ring.write_position(), write_pos);
+  EXPECT_EQ(ring.writable(), capacity * 3 - 40);
+
+  ASSERT_EQ(ring.write(in.data() + 40, 8), 8);
+  ASSERT_EQ(ring.read(out.data(), 48), 48);
+  EXPECT_EQ(in, out);
+}
+
+TEST_F(RingBufferTest, GrowNeverShrinks) {
+  ring.grow(capacity / 2);
+  EXPECT_EQ(ring.capacity(), capacity);
+}
+
+TEST_F(RingBufferTest, ProducerConsumerKeepsOrder) {
+  const int total = 100000;
+
+  std::thread producer([this, total]() {
+    int i = 0;
+    while (i < total) {
+      char c = static_cast<char>(i);
+      if (ring.write(&c, 1) == 1) {
+        i++;
+      } else {
+        std::this_thread::yield();
+      }
+    }
+  });
+
+  int i = 0;
+  bool ordered = true;
+  while (i < total) {
+    char c;
+    if (ring.read(&c, 1) == 1) {
+      ordered = ordered && c == static_cast<char>(i);
+      i++;
+    } else {
+      std::this_thread::yield();
+    }
+  }
+
+  producer.join();
+  EXPECT_TRUE(ordered);
+}
@@ -0,0 +1,311 @@
+#include "../src/library.hpp"
+#include <chrono>
+#include <filesystem>
+#include <fmt/format.h>
+#include <fstream>
+#include <gtest/gtest.h>
+#include <iostream>
+#include <map>
+#include <string>
+#include <sys/stat.h>
+#include <thread>
+
+namespace fs = std::filesystem;
+
+// MPEG 1 layer III, 128 kbps, 44100 Hz, stereo: 417 byte frames.
+static const std::string frame_header("\xFF\xFB\x90\x00", 4);
+static constexpr size_t frame_length = 417;
+
+class ScanResumeTest : public ::testing::Test {
+protected:
+  void SetUp() override {
+    remove_all();
+    fs::create_directories(root);
+    root = fs::absolute(root);
+  }
+  void TearDown() override { remove_all(); }
+
+  void remove_all() {
+    fs::remove_all(root);
+    for (const char *suffix : {"", "-wal", "-shm"}) {
+      fs::remove(db_path + suffix);
+    }
+  }
+
+  // A few frames whose payload names the file, so no two files share a
+  // fingerprint.
+  static void write_mp3(const fs::path &path) {
+    const std::string name = path.string();
+    std::string payload;
+    while (payload.size() < frame_length - 4) {
+      payload += name;
+    }
+    payload.resize(frame_length - 4);
+
+    std::ofstream out(path, std::ios::binary);
+    for (int i = 0; i < 3; i++) {
+      out << frame_header << payload;
+    }
+  }
+
+  void make_dir(const std::string &name, int files) {
+    fs::create_directories(root / name);
+    for (int i = 0; i < files; i++) {
+      write_mp3(root / name / fmt::format("{}.mp3", i));
+    }
+  }
+
+  static std::int64_t dir_mtime_ns(const fs::path &path) {
+    struct stat st;
+    if (stat(path.c_str(), &st) != 0) {
+      return -1;
+    }
+    return (std::int64_t)st.st_mtim.tv_sec * 1000000000 + st.st_mtim.tv_nsec;
+  }
+
+  // Rows keyed by path relative to the root.
+  std::map<std::string, Entity::FileMainProps> rows(DB &db, int dir_id) {
+    Entity::FileMainPropsMap saved;
+    EXPECT_EQ(db.get_dir_files_main_props(dir_id, saved),
+              DBRetCode::GetFileRes::Success);
+
+    std::map<std::string, Entity::FileMainProps> result;
+    for (const auto &[dir, files] : saved) {
+      for (const auto &[name, f] : files) {
+        const std::string rel = fs::relative(fs::path(dir) / name, root);
+        EXPECT_TRUE(result.emplace(rel, f).second) << rel;
+      }
+    }
+    return result;
+  }
+
+  fs::path root = "test_scan_resume_root";
+  std::string db_path = "test_scan_resume.db";
+};
+
+TEST_F(ScanResumeTest, CheckpointDropsRowsOnceAndKeepsKnownDirs) {
+  DB db(db_path);
+  ASSERT_TRUE(db.is_initialized());
+
+  int dir_id = 0;
+  ASSERT_EQ(db.add_directory(root, dir_id), DBRetCode::AddDirRes::Success);
+
+  std::vector<Entity::File> files;
+  for (int i = 0; i < 3; i++) {
+    files.emplace_back(0, dir_id, fmt::format("{}.mp3", i), root / "a", 0, 0,
+                       "Title", "Album", "Artist", "", i, 1, 2000, "Rock",
+                       100, 128, 1000, Enum::FileType::MP3);
+  }
+  std::vector<int> ids;
+  ASSERT_EQ(db.upsert_files(files, 10, ids),
+            DBRetCode::UpsertFilesRes::Success);
+
+  const Entity::ScannedDir a(dir_id, root / "a", 1234, 3);
+  const Entity::ScanJournal journal(dir_id, Enum::ScanState::RUNNING, 1, 2, 3,
+                                    1);
+  ASSERT_EQ(db.save_scan_checkpoint({ids[0]}, {a}, {}, {journal}),
+            DBRetCode::SaveCheckpointRes::Success);
+
+  // A row removed by an earlier checkpoint may come up again, and a new
+  // directory must not replace the time of one already done.
+  const Entity::ScannedDir a_again(dir_id, root / "a", -1, 0);
+  const Entity::ScannedDir b(dir_id, root / "b", -1, 0);
+  ASSERT_EQ(db.save_scan_checkpoint({ids[0]}, {}, {a_again, b}, {journal}),
+            DBRetCode::SaveCheckpointRes::Success);
+
+  EXPECT_EQ(rows(db, dir_id).size(), 2u);
+
+  std::map<fs::path, Entity::ScannedDir> dirs;
+  ASSERT_EQ(db.get_scanned_dirs(dir_id, dirs),
+            DBRetCode::GetScannedDirsRes::Success);
+  ASSERT_EQ(dirs.size(), 2u);
+  EXPECT_EQ(dirs[root / "a"].modified_time_ns, 1234);
+  EXPECT_EQ(dirs[root / "b"].modified_time_ns, -1);
+
+  Entity::ScanJournal saved;
+  ASSERT_EQ(db.get_scan_journal(dir_id, saved),
+            DBRetCode::GetScanJournalRes::Success);
+  EXPECT_EQ(saved.state, Enum::ScanState::RUNNING);
+  EXPECT_EQ(saved.files_written, 3u);
+  EXPECT_EQ(saved.dirs_done, 1u);
+}
+
+TEST_F(ScanResumeTest, ResumeSkipsDoneDirsAndDescendsIntoPending) {
+  make_dir("a", 2);
+
+  DB db(db_path);
+  ASSERT_TRUE(db.is_initialized());
+  int dir_id = 0;
+  ASSERT_EQ(db.add_directory(root, dir_id), DBRetCode::AddDirRes::Success);
+
+  Library lib(&db);
+  ASSERT_EQ(lib.full_scan(), LibRetCode::ScanRes::Success);
+  const std::map<std::string, Entity::FileMainProps> before = rows(db, dir_id);
+  ASSERT_EQ(before.size(), 2u);
+
+  // What a scan interrupted after listing the root and `a` leaves behind:
+  // both done, `b` and `c` pending with a time that never matches.
+  make_dir("b", 2);
+  make_dir("c", 2);
+  std::vector<Entity::File> ghost = {Entity::File(
+      0, dir_id, "ghost.mp3", root / "c", 0, 0, "Title", "Album", "Artist",
+      "", 1, 1, 2000, "Rock", 100, 128, 1000, Enum::FileType::MP3)};
+  std::vector<int> ghost_ids;
+  ASSERT_EQ(db.upsert_files(ghost, 10, ghost_ids),
+            DBRetCode::UpsertFilesRes::Success);
+
+  ASSERT_EQ(db.save_scan_checkpoint(
+                {},
+                {Entity::ScannedDir(dir_id, root, dir_mtime_ns(root), 3),
+                 Entity::ScannedDir(dir_id, root / "a",
+                                    dir_mtime_ns(root / "a"), 2)},
+                {Entity::ScannedDir(dir_id, root / "b", -1, 0),
+                 Entity::ScannedDir(dir_id, root / "c", -1, 0)},
+                {Entity::ScanJournal(dir_id, Enum::ScanState::RUNNING, 1, 2, 2,
+                                     2)}),
+            DBRetCode::SaveCheckpointRes::Success);
+
+  // Leaves the directory time alone, only a listing would notice.
+  const fs::path touched = root / "a" / "0.mp3";
+  fs::last_write_time(touched,
+                      fs::last_write_time(touched) + std::chrono::hours(1));
+
+  ASSERT_EQ(lib.partial_scan(dir_id), LibRetCode::ScanRes::Success);
+
+  const std::map<std::string, Entity::FileMainProps> after = rows(db, dir_id);
+  EXPECT_EQ(after.size(), 6u);
+  EXPECT_EQ(after.count("c/ghost.mp3"), 0u);
+  for (const std::string rel :
+       {"a/0.mp3", "a/1.mp3", "b/0.mp3", "b/1.mp3", "c/0.mp3", "c/1.mp3"}) {
+    EXPECT_EQ(after.count(rel), 1u) << rel;
+  }
+
+  // `a` was not listed again, its rows are the ones written before.
+  EXPECT_EQ(after.at("a/0.mp3").id, before.at("a/0.mp3").id);
+  EXPECT_EQ(after.at("a/0.mp3").modified_time,
+            before.at("a/0.mp3").modified_time);
+
+  Entity::ScanJournal journal;
+  ASSERT_EQ(db.get_scan_journal(dir_id, journal),
+            DBRetCode::GetScanJournalRes::Success);
+  EXPECT_EQ(journal.state, Enum::ScanState::FINISHED);
+}
+
+TEST_F(ScanResumeTest, CancelledScanResumesWithoutLosingRowsOrMoves) {
+  const int dir_count = 100;
+  const int files_per_dir = 50;
+  const int known_dirs = dir_count / 2;
+  for (int d = 0; d < known_dirs; d++) {
+    make_dir(fmt::format("d{}", d), files_per_dir);
+  }
+
+  DB db(db_path);
+  ASSERT_TRUE(db.is_initialized());
+  int dir_id = 0;
+  ASSERT_EQ(db.add_directory(root, dir_id), DBRetCode::AddDirRes::Success);
+
+  Library lib(&db);
+  lib.set_tag_read_threads(1);
+  ASSERT_EQ(lib.full_scan(), LibRetCode::ScanRes::Success);
+  const std::map<std::string, Entity::FileMainProps> first = rows(db, dir_id);
+  ASSERT_EQ(first.size(), (size_t)(known_dirs * files_per_dir));
+
+  // Moves keep their rows and a new file makes every known directory
+  // listed again. The new directories give the scan several batches to
+  // checkpoint.
+  const std::string moved_to = fmt::format("d{}", known_dirs - 1);
+  for (int i = 0; i < 5; i++) {
+    fs::rename(root / "d0" / fmt::format("{}.mp3", i),
+               root / moved_to / fmt::format("moved{}.mp3", i));
+  }
+  for (int d = 0; d < known_dirs; d++) {
+    write_mp3(root / fmt::format("d{}", d) / "new.mp3");
+  }
+  for (int d = known_dirs; d < dir_count; d++) {
+    make_dir(fmt::format("d{}", d), files_per_dir);
+  }
+
+  LibRetCode::ScanRes cancelled_res = LibRetCode::ScanRes::Success;
+  std::thread scan([&]() { cancelled_res = lib.full_scan(); });
+
+  // Stop it once the first batch has been checkpointed.
+  Entity::ScanJournal journal;
+  const auto deadline = std::chrono::steady_clock::now() +
+                        std::chrono::seconds(10);
+  while (std::chrono::steady_clock::now() < deadline) {
+    if (db.get_scan_journal(dir_id, journal) ==
+            DBRetCode::GetScanJournalRes::Success &&
+        journal.state == Enum::ScanState::RUNNING && journal.dirs_done > 0) {
+      break;
+    }
+    std::this_thread::sleep_for(std::chrono::microseconds(200));
+  }
+  lib.cancel_scan();
+  scan.join();
+
+  const std::map<std::string, Entity::FileMainProps> partial =
+      rows(db, dir_id);
+
+  ASSERT_EQ(lib.full_scan(), LibRetCode::ScanRes::Success);
+  const std::map<std::string, Entity::FileMainProps> resumed =
+      rows(db, dir_id);
+
+  EXPECT_EQ(resumed.size(),
+            (size_t)(dir_count * files_per_dir + known_dirs));
+  for (int i = 0; i < 5; i++) {
+    EXPECT_EQ(resumed.count(fmt::format("d0/{}.mp3", i)), 0u);
+    const std::string moved = fmt::format("{}/moved{}.mp3", moved_to, i);
+    ASSERT_EQ(resumed.count(moved), 1u) << moved;
+    EXPECT_EQ(resumed.at(moved).id, first.at(fmt::format("d0/{}.mp3", i)).id);
+  }
+
+  // Whatever the cancelled scan wrote is kept as it is.
+  for (const auto &[rel, f] : partial) {
+    if (resumed.count(rel)) {
+      EXPECT_EQ(resumed.at(rel).id, f.id) << rel;
+    }
+  }
+
+  if (cancelled_res == LibRetCode::ScanRes::Success) {
+    std::cout << "The scan finished before it was cancelled" << '\n';
+  } else {
+    EXPECT_EQ(cancelled_res, LibRetCode::ScanRes::Cancelled);
+  }
+}
+
+TEST_F(ScanResumeTest, CancelReachesScansWaitingForTheLock) {
+  for (int d = 0; d < 100; d++) {
+    make_dir(fmt::format("d{}", d), 50);
+  }
+
+  DB db(db_path);
+  ASSERT_TRUE(db.is_initialized());
+  int dir_id = 0;
+  ASSERT_EQ(db.add_directory(root, dir_id), DBRetCode::AddDirRes::Success);
+
+  Library lib(&db);
+  lib.set_tag_read_threads(1);
+
+  LibRetCode::ScanRes running_res = LibRetCode::ScanRes::Success;
+  LibRetCode::ScanRes waiting_res = LibRetCode::ScanRes::Success;
+  std::thread running([&]() { running_res = lib.full_scan(); });
+  std::this_thread::sleep_for(std::chrono::milliseconds(20));
+  std::thread waiting([&]() { waiting_res = lib.partial_scan(dir_id); });
+  std::this_thread::sleep_for(std::chrono::milliseconds(50));
+
+  lib.cancel_scan();
+  running.join();
+  waiting.join();
+
+  // Only tells something when the cancel came while the first scan held
+  // the lock.
+  if (running_res == LibRetCode::ScanRes::Cancelled) {
+    EXPECT_EQ(waiting_res, LibRetCode::ScanRes::Cancelled);
+  } else {
+    std::cout << "The scan finished before it was cancelled" << '\n';
+  }
+
+  // The cancel does not outlive the scans it was meant for.
+  EXPECT_EQ(lib.partial_scan(dir_id), LibRetCode::ScanRes::Success);
+  EXPECT_EQ(rows(db, dir_id).size(), 5000u);
+}
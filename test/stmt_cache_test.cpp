@@ -0,0 +1,102 @@
+#include "../src/common/stmt_cache.hpp"
+#include "../src/db.hpp"
+#include <filesystem>
+#include <gtest/gtest.h>
+#include <sqlite3.h>
+
+class StmtCacheTest : public ::testing::Test {
+protected:
+  void SetUp() override {
+    ASSERT_EQ(sqlite3_open(":memory:", &conn), SQLITE_OK);
+  }
+  void TearDown() override {
+    cache.clear();
+    sqlite3_close(conn);
+  }
+
+  sqlite3 *conn = nullptr;
+  StmtCache cache{2};
+};
+
+TEST_F(StmtCacheTest, ReusesStatementResetAndUnbound) {
+  sqlite3_stmt *stmt = nullptr;
+  ASSERT_EQ(cache.prepare(conn, "SELECT ?;", stmt), SQLITE_OK);
+  sqlite3_bind_int(stmt, 1, 7);
+  ASSERT_EQ(sqlite3_step(stmt), SQLITE_ROW);
+  sqlite3_stmt *first = stmt;
+  cache.finalize(stmt);
+
+  ASSERT_EQ(cache.prepare(conn, "SELECT ?;", stmt), SQLITE_OK);
+  EXPECT_EQ(stmt, first);
+  ASSERT_EQ(sqlite3_step(stmt), SQLITE_ROW);
+  EXPECT_EQ(sqlite3_column_type(stmt, 0), SQLITE_NULL);
+  cache.finalize(stmt);
+
+  StmtCacheStats stats = cache.get_stats();
+  EXPECT_EQ(stats.hits, 1u);
+  EXPECT_EQ(stats.misses, 1u);
+  EXPECT_EQ(stats.cached, 1u);
+}
+
+TEST_F(StmtCacheTest, HandsOutOneStatementPerUser) {
+  sqlite3_stmt *a = nullptr;
+  sqlite3_stmt *b = nullptr;
+  ASSERT_EQ(cache.prepare(conn, "SELECT 1;", a), SQLITE_OK);
+  ASSERT_EQ(cache.prepare(conn, "SELECT 1;", b), SQLITE_OK);
+  EXPECT_NE(a, b);
+  cache.finalize(a);
+  cache.finalize(b);
+
+  EXPECT_EQ(cache.get_stats().cached, 1u);
+}
+
+TEST_F(StmtCacheTest, DropsLeastRecentlyUsedPastCapacity) {
+  sqlite3_stmt *stmt = nullptr;
+  for (const char *sql :
+       {"SELECT 1;", "SELECT 2;", "SELECT 1;", "SELECT 3;"}) {
+    ASSERT_EQ(cache.prepare(conn, sql, stmt), SQLITE_OK);
+    cache.finalize(stmt);
+  }
+  EXPECT_EQ(cache.get_stats().cached, 2u);
+
+  // "SELECT 1;" was used after "SELECT 2;", which "SELECT 3;" evicted.
+  ASSERT_EQ(cache.prepare(conn, "SELECT 1;", stmt), SQLITE_OK);
+  cache.finalize(stmt);
+  ASSERT_EQ(cache.prepare(conn, "SELECT 2;", stmt), SQLITE_OK);
+  cache.finalize(stmt);
+
+  StmtCacheStats stats = cache.get_stats();
+  EXPECT_EQ(stats.hits, 2u);
+  EXPECT_EQ(stats.misses, 4u);
+}
+
+TEST_F(StmtCacheTest, ReportsPrepareErrors) {
+  sqlite3_stmt *stmt = nullptr;
+  EXPECT_NE(cache.prepare(conn, "SELEC 1;", stmt), SQLITE_OK);
+  EXPECT_EQ(stmt, nullptr);
+  cache.finalize(stmt);
+  EXPECT_EQ(cache.get_stats().cached, 0u);
+}
+
+TEST(DBStmtCacheTest, RepeatedQueriesHitTheCache) {
+  const std::string db_path = "test_db_stmt_cache.db";
+  std::filesystem::remove(db_path);
+  {
+    DB db(db_path);
+    ASSERT_TRUE(db.is_initialized());
+
+    int dir_id = 0;
+    ASSERT_EQ(db.add_directory("/music", dir_id),
+              DBRetCode::AddDirRes::Success);
+
+    Entity::Directory dir;
+    ASSERT_EQ(db.get_directory(dir_id, dir), DBRetCode::GetDirRes::Success);
+    StmtCacheStats before = db.get_stmt_cache_stats();
+    ASSERT_EQ(db.get_directory(dir_id, dir), DBRetCode::GetDirRes::Success);
+    StmtCacheStats after = db.get_stmt_cache_stats();
+
+    EXPECT_EQ(after.misses, before.misses);
+    EXPECT_GT(after.hits, before.hits);
+  }
+  std::filesystem::remove(db_path);
+}